@@ -16,15 +16,25 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#define print_class bmfparse_print_class
 #define print_classes bmfparse_print_classes
 #define print_variable bmfparse_print_variable
 #define print_qualifiers bmfparse_print_qualifiers
 #define print_variable_type bmfparse_print_variable_type
+#define print_instance bmfparse_print_instance
+#define mof_supported bmfparse_mof_supported
 #include "bmfparse.c"
+#undef mof_supported
+#undef print_class
 #undef print_classes
 #undef print_variable
 #undef print_qualifiers
 #undef print_variable_type
+#undef print_instance
+
+static int mof_supported(void) {
+  return 1;
+}
 
 static void print_string(FILE *fout, char *str) {
   int len = strlen(str);
@@ -37,7 +47,7 @@ static void print_string(FILE *fout, char *str) {
 }
 
 static void print_qualifiers(FILE *fout, struct mof_qualifier *qualifiers, uint32_t count, char *prefix) {
-  uint32_t i;
+  uint32_t i, j;
   if (count > 0 || prefix) {
     fprintf(fout, "[");
     if (prefix) {
@@ -62,6 +72,18 @@ static void print_qualifiers(FILE *fout, struct mof_qualifier *qualifiers, uint3
         print_string(fout, qualifiers[i].value.string);
         fprintf(fout, "\")");
         break;
+      case MOF_QUALIFIER_STRING_ARRAY:
+        print_string(fout, qualifiers[i].name);
+        fprintf(fout, "{");
+        for (j = 0; j < qualifiers[i].value.strings.count; ++j) {
+          if (j != 0)
+            fprintf(fout, ", ");
+          fprintf(fout, "\"");
+          print_string(fout, qualifiers[i].value.strings.values[j]);
+          fprintf(fout, "\"");
+        }
+        fprintf(fout, "}");
+        break;
       default:
         fprintf(fout, "unknown");
         break;
@@ -85,27 +107,12 @@ static void print_qualifiers(FILE *fout, struct mof_qualifier *qualifiers, uint3
 }
 
 static void print_variable_type(FILE *fout, struct mof_variable *variable) {
-  char *type = NULL;
+  const char *type = NULL;
   switch (variable->variable_type) {
   case MOF_VARIABLE_BASIC:
   case MOF_VARIABLE_BASIC_ARRAY:
-    switch (variable->type.basic) {
-    case MOF_BASIC_TYPE_STRING: type = "string"; break;
-    case MOF_BASIC_TYPE_REAL64: type = "real64"; break;
-    case MOF_BASIC_TYPE_REAL32: type = "real32"; break;
-    case MOF_BASIC_TYPE_SINT32: type = "sint32"; break;
-    case MOF_BASIC_TYPE_UINT32: type = "uint32"; break;
-    case MOF_BASIC_TYPE_SINT16: type = "sint16"; break;
-    case MOF_BASIC_TYPE_UINT16: type = "uint16"; break;
-    case MOF_BASIC_TYPE_SINT64: type = "sint64"; break;
-    case MOF_BASIC_TYPE_UINT64: type = "uint64"; break;
-    case MOF_BASIC_TYPE_SINT8: type = "sint8"; break;
-    case MOF_BASIC_TYPE_UINT8: type = "uint8"; break;
-    case MOF_BASIC_TYPE_DATETIME: type = "datetime"; break;
-    case MOF_BASIC_TYPE_CHAR16: type = "char16"; break;
-    case MOF_BASIC_TYPE_BOOLEAN: type = "boolean"; break;
-    default: break;
-    }
+    if (mof_basic_type_valid(variable->type.basic))
+      type = mof_basic_types[variable->type.basic].mof_name;
     break;
   case MOF_VARIABLE_OBJECT:
   case MOF_VARIABLE_OBJECT_ARRAY:
@@ -117,6 +124,21 @@ static void print_variable_type(FILE *fout, struct mof_variable *variable) {
   fprintf(fout, "%s", type ? type : "unknown");
 }
 
+static void print_variable_value(FILE *fout, struct mof_variable *variable) {
+  uint32_t i;
+  if (variable->variable_type == MOF_VARIABLE_BASIC) {
+    print_value(fout, variable, 0, 1);
+    return;
+  }
+  fprintf(fout, "{");
+  for (i = 0; i < variable->values_count; ++i) {
+    if (i != 0)
+      fprintf(fout, ", ");
+    print_value(fout, variable, i, 1);
+  }
+  fprintf(fout, "}");
+}
+
 static void print_variable(FILE *fout, struct mof_variable *variable, char *prefix) {
   if (variable->qualifiers_count > 0 || prefix) {
     print_qualifiers(fout, variable->qualifiers, variable->qualifiers_count, prefix);
@@ -131,106 +153,157 @@ static void print_variable(FILE *fout, struct mof_variable *variable, char *pref
       fprintf(fout, "%d", variable->array_max);
     fprintf(fout, "]");
   }
+  if (variable->has_value) {
+    fprintf(fout, " = ");
+    print_variable_value(fout, variable);
+  }
 }
 
-static void print_classes(FILE *fout, struct mof_class *classes, uint32_t count) {
+static void print_class(FILE *fout, struct mof_class *class, uint32_t index, const struct classes_summary *summary) {
   char *direction;
-  uint32_t i, j, k;
-  int print_namespace = 0;
-  int print_classflags = 0;
+  uint32_t j, k;
+  if (!class->name)
+    return;
+  TRACE_BEGIN(print_mof_class, index, class->name);
+  if (summary->namespace) {
+    fprintf(fout, "#pragma namespace(\"");
+    if (class->namespace)
+      print_string(fout, class->namespace);
+    else
+      print_string(fout, "root\\default");
+    fprintf(fout, "\")\n");
+  }
+  if (summary->classflags) {
+    fprintf(fout, "#pragma classflags(");
+    if (class->classflags == 1)
+      fprintf(fout, "\"updateonly\"");
+    else if (class->classflags == 2)
+      fprintf(fout, "\"createonly\"");
+    else if (class->classflags == 32)
+      fprintf(fout, "\"safeupdate\"");
+    else if (class->classflags == 33)
+      fprintf(fout, "\"updateonly\", \"safeupdate\"");
+    else if (class->classflags == 64)
+      fprintf(fout, "\"forceupdate\"");
+    else if (class->classflags == 65)
+      fprintf(fout, "\"updateonly\", \"forceupdate\"");
+    else
+      fprintf(fout, "%d", (int)class->classflags);
+    fprintf(fout, ")\n");
+  }
+  if (class->qualifiers_count > 0) {
+    print_qualifiers(fout, class->qualifiers, class->qualifiers_count, NULL);
+    fprintf(fout, "\n");
+  }
+  fprintf(fout, "class ");
+  print_string(fout, class->name);
+  fprintf(fout, " ");
+  if (class->superclassname) {
+    fprintf(fout, ": ");
+    print_string(fout, class->superclassname);
+    fprintf(fout, " ");
+  }
+  fprintf(fout, "{\n");
+  for (j = 0; j < class->variables_count; ++j) {
+    fprintf(fout, "  ");
+    print_variable(fout, &class->variables[j], NULL);
+    fprintf(fout, ";\n");
+  }
+  if (class->variables_count && class->methods_count)
+    fprintf(fout, "\n");
+  for (j = 0; j < class->methods_count; ++j) {
+    fprintf(fout, "  ");
+    if (class->methods[j].qualifiers_count > 0) {
+      print_qualifiers(fout, class->methods[j].qualifiers, class->methods[j].qualifiers_count, NULL);
+      fprintf(fout, " ");
+    }
+    if (class->methods[j].return_value.variable_type)
+      print_variable_type(fout, &class->methods[j].return_value);
+    else
+      fprintf(fout, "void");
+    fprintf(fout, " ");
+    print_string(fout, class->methods[j].name);
+    fprintf(fout, "(");
+    for (k = 0; k < class->methods[j].parameters_count; ++k) {
+      switch (class->methods[j].parameters_direction[k]) {
+      case MOF_PARAMETER_IN:
+        direction = "in";
+        break;
+      case MOF_PARAMETER_OUT:
+        direction = "out";
+        break;
+      case MOF_PARAMETER_IN_OUT:
+        direction = "in, out";
+        break;
+      default:
+        direction = NULL;
+        break;
+      }
+      print_variable(fout, &class->methods[j].parameters[k], direction);
+      if (k != class->methods[j].parameters_count-1)
+        fprintf(fout, ", ");
+    }
+    fprintf(fout, ");\n");
+  }
+  fprintf(fout, "};\n");
+  if (index != summary->count-1)
+    fprintf(fout, "\n");
+  TRACE_END(print_mof_class, index, class->name);
+}
+
+static void summarize_classes(struct mof_class *classes, uint32_t count, struct classes_summary *summary) {
+  uint32_t i;
+  memset(summary, 0, sizeof(*summary));
+  summary->count = count;
   for (i = 0; i < count; ++i) {
     if (!classes[i].name)
       continue;
     if (classes[i].namespace && strcmp(classes[i].namespace, "root\\default") != 0)
-      print_namespace = 1;
+      summary->namespace = 1;
     if (classes[i].classflags)
-      print_classflags = 1;
+      summary->classflags = 1;
   }
-  for (i = 0; i < count; ++i) {
-    if (!classes[i].name)
+}
+
+static void print_classes(FILE *fout, struct mof_class *classes, uint32_t count) {
+  struct classes_summary summary;
+  uint32_t i;
+  summarize_classes(classes, count, &summary);
+  for (i = 0; i < count; ++i)
+    print_class(fout, &classes[i], i, &summary);
+}
+
+static void print_instance(FILE *fout, struct mof_class *instance, uint32_t index) {
+  uint32_t i;
+  (void)index;
+  TRACE_BEGIN(print_mof_instance, index, instance->name);
+  fprintf(fout, "\n");
+  if (instance->namespace && strcmp(instance->namespace, "root\\default") != 0) {
+    fprintf(fout, "#pragma namespace(\"");
+    print_string(fout, instance->namespace);
+    fprintf(fout, "\")\n");
+  }
+  if (instance->qualifiers_count > 0) {
+    print_qualifiers(fout, instance->qualifiers, instance->qualifiers_count, NULL);
+    fprintf(fout, "\n");
+  }
+  fprintf(fout, "instance of ");
+  print_string(fout, instance->name);
+  fprintf(fout, "\n{\n");
+  for (i = 0; i < instance->variables_count; ++i) {
+    struct mof_variable *variable = &instance->variables[i];
+    if (!variable->has_value)
       continue;
-    if (print_namespace) {
-      fprintf(fout, "#pragma namespace(\"");
-      if (classes[i].namespace)
-        print_string(fout, classes[i].namespace);
-      else
-        print_string(fout, "root\\default");
-      fprintf(fout, "\")\n");
-    }
-    if (print_classflags) {
-      fprintf(fout, "#pragma classflags(");
-      if (classes[i].classflags == 1)
-        fprintf(fout, "\"updateonly\"");
-      else if (classes[i].classflags == 2)
-        fprintf(fout, "\"createonly\"");
-      else if (classes[i].classflags == 32)
-        fprintf(fout, "\"safeupdate\"");
-      else if (classes[i].classflags == 33)
-        fprintf(fout, "\"updateonly\", \"safeupdate\"");
-      else if (classes[i].classflags == 64)
-        fprintf(fout, "\"forceupdate\"");
-      else if (classes[i].classflags == 65)
-        fprintf(fout, "\"updateonly\", \"forceupdate\"");
-      else
-        fprintf(fout, "%d", (int)classes[i].classflags);
-      fprintf(fout, ")\n");
-    }
-    if (classes[i].qualifiers_count > 0) {
-      print_qualifiers(fout, classes[i].qualifiers, classes[i].qualifiers_count, NULL);
-      fprintf(fout, "\n");
-    }
-    fprintf(fout, "class ");
-    print_string(fout, classes[i].name);
-    fprintf(fout, " ");
-    if (classes[i].superclassname) {
-      fprintf(fout, ": ");
-      print_string(fout, classes[i].superclassname);
+    fprintf(fout, "  ");
+    if (variable->qualifiers_count > 0) {
+      print_qualifiers(fout, variable->qualifiers, variable->qualifiers_count, NULL);
       fprintf(fout, " ");
     }
-    fprintf(fout, "{\n");
-    for (j = 0; j < classes[i].variables_count; ++j) {
-      fprintf(fout, "  ");
-      print_variable(fout, &classes[i].variables[j], NULL);
-      fprintf(fout, ";\n");
-    }
-    if (classes[i].variables_count && classes[i].methods_count)
-      fprintf(fout, "\n");
-    for (j = 0; j < classes[i].methods_count; ++j) {
-      fprintf(fout, "  ");
-      if (classes[i].methods[j].qualifiers_count > 0) {
-        print_qualifiers(fout, classes[i].methods[j].qualifiers, classes[i].methods[j].qualifiers_count, NULL);
-        fprintf(fout, " ");
-      }
-      if (classes[i].methods[j].return_value.variable_type)
-        print_variable_type(fout, &classes[i].methods[j].return_value);
-      else
-        fprintf(fout, "void");
-      fprintf(fout, " ");
-      print_string(fout, classes[i].methods[j].name);
-      fprintf(fout, "(");
-      for (k = 0; k < classes[i].methods[j].parameters_count; ++k) {
-        switch (classes[i].methods[j].parameters_direction[k]) {
-        case MOF_PARAMETER_IN:
-          direction = "in";
-          break;
-        case MOF_PARAMETER_OUT:
-          direction = "out";
-          break;
-        case MOF_PARAMETER_IN_OUT:
-          direction = "in, out";
-          break;
-        default:
-          direction = NULL;
-          break;
-        }
-        print_variable(fout, &classes[i].methods[j].parameters[k], direction);
-        if (k != classes[i].methods[j].parameters_count-1)
-          fprintf(fout, ", ");
-      }
-      fprintf(fout, ");\n");
-    }
-    fprintf(fout, "};\n");
-    if (i != count-1)
-      fprintf(fout, "\n");
+    print_string(fout, variable->name);
+    fprintf(fout, " = ");
+    print_variable_value(fout, variable);
+    fprintf(fout, ";\n");
   }
+  fprintf(fout, "};\n");
+  TRACE_END(print_mof_instance, index, instance->name);
 }
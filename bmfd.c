@@ -0,0 +1,697 @@
+/*
+    bmfd.c - Daemon which decompiles binary MOF files (BMF) for clients on Unix socket
+    Copyright (C) 2017  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; version 2.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * Protocol: client sends request line "FORMAT SOURCE LENGTH\n" followed by
+ * LENGTH bytes. FORMAT is mof (bmf2mof output), text (bmfparse output),
+ * json or raw (decompressed data). SOURCE is data when bytes are BMF file
+ * or path when bytes are name of BMF file readable by daemon. Daemon
+ * answers "OK LENGTH\n" followed by LENGTH bytes of output or "ERR message\n".
+ * More requests can be sent over one connection. Connection is closed when
+ * client does not send or receive anything for BMFD_TIMEOUT seconds.
+ *
+ * Results are cached in LRU keyed by hash of BMF file and format. Worker
+ * threads read requests, look up cache, decompress input into their own
+ * reused buffer and send answers in parallel, but parsing and printing run
+ * one at a time, because they use global state (error_jmp, mem_malloc()
+ * list, diagnostics).
+ *
+ * Trust model: every client which can connect to socket can let daemon read
+ * any file readable by daemon (path requests) and can find out whether it
+ * exists from the error message. Therefore socket is created with mode 0600
+ * by default, --mode= should grant access only to trusted users.
+ */
+
+#define main bmfdec_main
+#include "bmf2mof.c"
+#undef main
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define BMFD_MAX_INPUT 0x4000000
+
+/* Idle connection would otherwise block its worker forever */
+#define BMFD_TIMEOUT 30
+
+/* Names of formats in requests, text is structured dump */
+static const char *bmfd_formats[OUTPUT_COUNT] = {
+  [OUTPUT_RAW] = "raw",
+  [OUTPUT_MOF] = "mof",
+  [OUTPUT_DUMP] = "text",
+  [OUTPUT_JSON] = "json",
+};
+
+static int bmfd_format_lookup(const char *name) {
+  int i;
+  for (i = 0; i < OUTPUT_COUNT; ++i) {
+    if (strcmp(name, bmfd_formats[i]) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/* Growable buffer, kept by worker and reused for all its requests */
+struct bmfd_buffer {
+  char *data;
+  size_t size;
+  size_t len;
+};
+
+static int bmfd_buffer_reserve(struct bmfd_buffer *buffer, size_t size) {
+  char *data;
+  if (size <= buffer->size)
+    return 0;
+  /* malloc() memory is aligned as needed by decompress_data() */
+  data = realloc(buffer->data, size);
+  if (!data)
+    return 1;
+  buffer->data = data;
+  buffer->size = size;
+  return 0;
+}
+
+/*
+ * LRU cache of outputs. Entries are in hash buckets and in list ordered by
+ * last use, least recently used entries are dropped when cache_limit bytes
+ * would be exceeded. Entry keeps copy of its input, so hash collision is
+ * not served as hit.
+ */
+struct cache_entry {
+  uint64_t hash;
+  enum output_format format;
+  size_t input_len;
+  char *input;
+  size_t len;
+  char *data;
+  struct cache_entry *next;
+  struct cache_entry *lru_prev;
+  struct cache_entry *lru_next;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry **cache_buckets;
+static size_t cache_buckets_count;
+static struct cache_entry cache_lru = { 0, 0, 0, NULL, 0, NULL, NULL, &cache_lru, &cache_lru };
+static size_t cache_limit = 64 << 20;
+static size_t cache_used;
+static unsigned long cache_hits;
+static unsigned long cache_misses;
+
+static int cache_init(void) {
+  cache_buckets_count = 256;
+  while (cache_buckets_count < cache_limit / 4096 && cache_buckets_count < (1 << 20))
+    cache_buckets_count *= 2;
+  cache_buckets = calloc(cache_buckets_count, sizeof(*cache_buckets));
+  return cache_buckets ? 0 : 1;
+}
+
+static void cache_lru_unlink(struct cache_entry *entry) {
+  entry->lru_prev->lru_next = entry->lru_next;
+  entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+static void cache_lru_push(struct cache_entry *entry) {
+  entry->lru_prev = &cache_lru;
+  entry->lru_next = cache_lru.lru_next;
+  cache_lru.lru_next->lru_prev = entry;
+  cache_lru.lru_next = entry;
+}
+
+static struct cache_entry **cache_find(uint64_t hash, enum output_format format) {
+  struct cache_entry **entry = &cache_buckets[(hash ^ format) & (cache_buckets_count-1)];
+  while (*entry && ((*entry)->hash != hash || (*entry)->format != format))
+    entry = &(*entry)->next;
+  return entry;
+}
+
+static void cache_drop(struct cache_entry **entry) {
+  struct cache_entry *tmp = *entry;
+  *entry = tmp->next;
+  cache_lru_unlink(tmp);
+  cache_used -= sizeof(*tmp) + tmp->input_len + tmp->len;
+  free(tmp->input);
+  free(tmp->data);
+  free(tmp);
+}
+
+/* Copy cached output of input into buffer, returns zero when it was found */
+static int cache_get(uint64_t hash, enum output_format format, const struct bmfd_buffer *input, struct bmfd_buffer *out) {
+  struct cache_entry *entry;
+  int ret = 1;
+  pthread_mutex_lock(&cache_lock);
+  entry = *cache_find(hash, format);
+  if (entry && (entry->input_len != input->len || memcmp(entry->input, input->data, input->len) != 0))
+    entry = NULL;
+  if (entry && bmfd_buffer_reserve(out, entry->len+1) == 0) {
+    memcpy(out->data, entry->data, entry->len);
+    out->len = entry->len;
+    cache_lru_unlink(entry);
+    cache_lru_push(entry);
+    ret = 0;
+  }
+  if (ret)
+    cache_misses++;
+  else
+    cache_hits++;
+  pthread_mutex_unlock(&cache_lock);
+  return ret;
+}
+
+static void cache_put(uint64_t hash, enum output_format format, const struct bmfd_buffer *input, const char *data, size_t len) {
+  struct cache_entry **slot;
+  struct cache_entry *entry;
+  if (sizeof(*entry) + input->len + len > cache_limit)
+    return;
+  entry = malloc(sizeof(*entry));
+  if (!entry)
+    return;
+  entry->input = malloc(input->len ? input->len : 1);
+  entry->data = malloc(len ? len : 1);
+  if (!entry->input || !entry->data) {
+    free(entry->input);
+    free(entry->data);
+    free(entry);
+    return;
+  }
+  memcpy(entry->input, input->data, input->len);
+  memcpy(entry->data, data, len);
+  entry->hash = hash;
+  entry->format = format;
+  entry->input_len = input->len;
+  entry->len = len;
+  pthread_mutex_lock(&cache_lock);
+  slot = cache_find(hash, format);
+  if (*slot)
+    cache_drop(slot);
+  while (cache_used + sizeof(*entry) + input->len + len > cache_limit) {
+    struct cache_entry *last = cache_lru.lru_prev;
+    cache_drop(cache_find(last->hash, last->format));
+  }
+  slot = cache_find(hash, format);
+  entry->next = NULL;
+  *slot = entry;
+  cache_lru_push(entry);
+  cache_used += sizeof(*entry) + input->len + len;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/* Parsing and printing use global state and run under this lock */
+static pthread_mutex_t decompile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Decompile BMF file in input into out. Input is decompressed into data
+ * without lock, ds_dec_parallel() has no global state. Output is written by
+ * stdio into memory stream and then moved to out. Returns zero on success.
+ */
+static int decompile(const char *name, struct bmfd_buffer *input, enum output_format format, struct bmfd_buffer *data, struct bmfd_buffer *out) {
+  char *stream_data = NULL;
+  size_t stream_len = 0;
+  FILE *outputs[OUTPUT_COUNT] = { NULL };
+  uint32_t lout;
+  FILE *fout;
+  int ret;
+  if (check_header((uint32_t *)input->data, input->len, &lout))
+    return 1;
+  /* decompressed data are not allocated by mem_malloc(), so check them here */
+  if (memory_limit && lout > memory_limit) {
+    fprintf(stderr, "Memory limit exceeded\n");
+    return 1;
+  }
+  if (bmfd_buffer_reserve(data, (size_t)lout+1)) {
+    fprintf(stderr, "Cannot allocate memory for decompression\n");
+    return 1;
+  }
+  if (ds_dec_parallel(input->data+16, input->len-16, data->data, lout, 0, decompress_threads) != (int)lout) {
+    fprintf(stderr, "Decompress failed\n");
+    return 1;
+  }
+  fout = open_memstream(&stream_data, &stream_len);
+  if (!fout)
+    return 1;
+  outputs[format] = fout;
+  pthread_mutex_lock(&decompile_lock);
+  diag_begin(name);
+  ret = process_outputs(data->data, lout, outputs);
+  mem_free_all();
+  diag_flush();
+  pthread_mutex_unlock(&decompile_lock);
+  if (fclose(fout) != 0)
+    ret = 1;
+  if (ret == 0 && bmfd_buffer_reserve(out, stream_len+1) == 0) {
+    memcpy(out->data, stream_data, stream_len);
+    out->len = stream_len;
+  } else {
+    ret = 1;
+  }
+  free(stream_data);
+  return ret;
+}
+
+/* Connection with buffered reading */
+struct bmfd_conn {
+  int fd;
+  size_t pos;
+  size_t len;
+  char buf[4096];
+};
+
+static int conn_fill(struct bmfd_conn *conn) {
+  ssize_t ret;
+  do {
+    ret = read(conn->fd, conn->buf, sizeof(conn->buf));
+  } while (ret < 0 && errno == EINTR);
+  if (ret <= 0)
+    return 1;
+  conn->pos = 0;
+  conn->len = ret;
+  return 0;
+}
+
+/* Read line without newline, returns 1 on EOF or error and 2 when line is too long */
+static int conn_read_line(struct bmfd_conn *conn, char *line, size_t size) {
+  size_t i = 0;
+  for (;;) {
+    if (conn->pos == conn->len && conn_fill(conn))
+      return 1;
+    if (conn->buf[conn->pos] == '\n') {
+      conn->pos++;
+      line[i] = 0;
+      return 0;
+    }
+    if (i+1 >= size)
+      return 2;
+    line[i++] = conn->buf[conn->pos++];
+  }
+}
+
+static int conn_read(struct bmfd_conn *conn, char *data, size_t size) {
+  size_t len;
+  while (size > 0) {
+    if (conn->pos == conn->len && conn_fill(conn))
+      return 1;
+    len = conn->len - conn->pos;
+    if (len > size)
+      len = size;
+    memcpy(data, conn->buf + conn->pos, len);
+    conn->pos += len;
+    data += len;
+    size -= len;
+  }
+  return 0;
+}
+
+static int write_all(int fd, const char *data, size_t size) {
+  ssize_t ret;
+  while (size > 0) {
+    ret = send(fd, data, size, MSG_NOSIGNAL);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return 1;
+    data += ret;
+    size -= ret;
+  }
+  return 0;
+}
+
+/* Read BMF file named path into input */
+static int read_path(const char *path, struct bmfd_buffer *input) {
+  struct stat st;
+  FILE *fin;
+  int ret = 1;
+  fin = fopen(path, "rb");
+  if (!fin)
+    return 1;
+  if (fstat(fileno(fin), &st) == 0 && S_ISREG(st.st_mode) && st.st_size <= BMFD_MAX_INPUT && bmfd_buffer_reserve(input, st.st_size+1) == 0) {
+    input->len = fread(input->data, 1, st.st_size+1, fin);
+    if (!ferror(fin) && input->len == (size_t)st.st_size)
+      ret = 0;
+  }
+  fclose(fin);
+  return ret;
+}
+
+struct bmfd_worker {
+  struct bmfd_buffer input;
+  struct bmfd_buffer data;  /* decompressed input */
+  struct bmfd_buffer output;
+  char path[4096];
+};
+
+/* Serve one request, returns nonzero when connection has to be closed */
+static int serve_request(struct bmfd_conn *conn, struct bmfd_worker *worker) {
+  char line[128];
+  char format_name[16];
+  char source[16];
+  unsigned long len;
+  const char *name;
+  const char *err = NULL;
+  uint64_t hash;
+  int format;
+  int ret;
+  ret = conn_read_line(conn, line, sizeof(line));
+  if (ret == 1)
+    return 1;
+  if (ret != 0 || sscanf(line, "%15s %15s %lu", format_name, source, &len) != 3 || (format = bmfd_format_lookup(format_name)) < 0) {
+    write_all(conn->fd, "ERR Invalid request\n", strlen("ERR Invalid request\n"));
+    return 1;
+  }
+  if (strcmp(source, "data") == 0) {
+    if (len > BMFD_MAX_INPUT || bmfd_buffer_reserve(&worker->input, len+1)) {
+      write_all(conn->fd, "ERR Input too large\n", strlen("ERR Input too large\n"));
+      return 1;
+    }
+    if (conn_read(conn, worker->input.data, len))
+      return 1;
+    worker->input.len = len;
+    name = "(socket)";
+  } else if (strcmp(source, "path") == 0) {
+    if (len >= sizeof(worker->path)) {
+      write_all(conn->fd, "ERR Path too long\n", strlen("ERR Path too long\n"));
+      return 1;
+    }
+    if (conn_read(conn, worker->path, len))
+      return 1;
+    worker->path[len] = 0;
+    if (read_path(worker->path, &worker->input))
+      err = "Cannot read input file";
+    name = worker->path;
+  } else {
+    write_all(conn->fd, "ERR Invalid request\n", strlen("ERR Invalid request\n"));
+    return 1;
+  }
+  if (!err) {
+    hash = hash_data(worker->input.data, worker->input.len);
+    if (cache_get(hash, format, &worker->input, &worker->output) != 0) {
+      if (decompile(name, &worker->input, format, &worker->data, &worker->output) != 0)
+        err = "Cannot decompile input";
+      else
+        cache_put(hash, format, &worker->input, worker->output.data, worker->output.len);
+    }
+  }
+  if (err) {
+    snprintf(line, sizeof(line), "ERR %s\n", err);
+    return write_all(conn->fd, line, strlen(line));
+  }
+  snprintf(line, sizeof(line), "OK %lu\n", (unsigned long)worker->output.len);
+  if (write_all(conn->fd, line, strlen(line)) || write_all(conn->fd, worker->output.data, worker->output.len))
+    return 1;
+  return 0;
+}
+
+/* Accepted connections waiting for worker */
+#define BMFD_QUEUE_SIZE 64
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_not_full = PTHREAD_COND_INITIALIZER;
+static int queue_fds[BMFD_QUEUE_SIZE];
+static unsigned queue_head;
+static unsigned queue_count;
+
+static void queue_push(int fd) {
+  pthread_mutex_lock(&queue_lock);
+  while (queue_count == BMFD_QUEUE_SIZE)
+    pthread_cond_wait(&queue_not_full, &queue_lock);
+  queue_fds[(queue_head + queue_count++) % BMFD_QUEUE_SIZE] = fd;
+  pthread_cond_signal(&queue_not_empty);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+static int queue_pop(void) {
+  int fd;
+  pthread_mutex_lock(&queue_lock);
+  while (queue_count == 0)
+    pthread_cond_wait(&queue_not_empty, &queue_lock);
+  fd = queue_fds[queue_head];
+  queue_head = (queue_head + 1) % BMFD_QUEUE_SIZE;
+  queue_count--;
+  pthread_cond_signal(&queue_not_full);
+  pthread_mutex_unlock(&queue_lock);
+  return fd;
+}
+
+static void *worker_thread(void *arg) {
+  struct bmfd_worker worker;
+  struct bmfd_conn *conn = arg;
+  memset(&worker, 0, sizeof(worker));
+  for (;;) {
+    conn->fd = queue_pop();
+    conn->pos = conn->len = 0;
+    while (serve_request(conn, &worker) == 0);
+    close(conn->fd);
+  }
+  return NULL;
+}
+
+static volatile sig_atomic_t bmfd_stop;
+
+static void bmfd_signal(int sig) {
+  (void)sig;
+  bmfd_stop = 1;
+}
+
+static int socket_address(const char *path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", path);
+    return 1;
+  }
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+static int run_daemon(const char *path, int workers, mode_t mode) {
+  struct timeval timeout = { BMFD_TIMEOUT, 0 };
+  struct sockaddr_un addr;
+  struct sigaction sa;
+  struct stat st;
+  sigset_t mask, old_mask;
+  mode_t old_umask;
+  pthread_t thread;
+  int fd, client;
+  int i;
+  if (socket_address(path, &addr))
+    return 1;
+  if (cache_init()) {
+    fprintf(stderr, "Cannot allocate memory for cache\n");
+    return 1;
+  }
+  /* remove stale socket of previous instance */
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  /* nobody can connect before mode is set */
+  old_umask = umask(0077);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    umask(old_umask);
+    fprintf(stderr, "Cannot listen on socket %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  umask(old_umask);
+  if (chmod(path, mode) != 0 || listen(fd, 64) != 0) {
+    fprintf(stderr, "Cannot listen on socket %s: %s\n", path, strerror(errno));
+    unlink(path);
+    return 1;
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = bmfd_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  /* workers inherit blocked signals, so they interrupt only accept() */
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+  for (i = 0; i < workers; ++i) {
+    struct bmfd_conn *conn = malloc(sizeof(*conn));
+    if (!conn || pthread_create(&thread, NULL, worker_thread, conn) != 0) {
+      fprintf(stderr, "Cannot create worker thread\n");
+      unlink(path);
+      return 1;
+    }
+    pthread_detach(thread);
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  while (!bmfd_stop) {
+    client = accept(fd, NULL, NULL);
+    if (client < 0) {
+      if (errno != EINTR && errno != ECONNABORTED)
+        fprintf(stderr, "Cannot accept connection: %s\n", strerror(errno));
+      continue;
+    }
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    queue_push(client);
+  }
+  close(fd);
+  unlink(path);
+  pthread_mutex_lock(&cache_lock);
+  fprintf(stderr, "Cache hits: %lu, misses: %lu, used: %lu bytes\n", cache_hits, cache_misses, (unsigned long)cache_used);
+  pthread_mutex_unlock(&cache_lock);
+  return 0;
+}
+
+/* Client for scripts and testing, sends files one by one and writes outputs to stdout */
+static int run_client(const char *path, const char *format, int send_path, int count, char *files[]) {
+  struct sockaddr_un addr;
+  struct bmfd_buffer input;
+  struct bmfd_conn conn;
+  char line[128];
+  unsigned long len;
+  char *data;
+  int ret = 0;
+  int i;
+  if (socket_address(path, &addr))
+    return 1;
+  conn.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (conn.fd < 0 || connect(conn.fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    fprintf(stderr, "Cannot connect to socket %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  conn.pos = conn.len = 0;
+  memset(&input, 0, sizeof(input));
+  for (i = 0; i < count; ++i) {
+    if (send_path) {
+      data = files[i];
+      len = strlen(files[i]);
+    } else if (read_path(files[i], &input) == 0) {
+      data = input.data;
+      len = input.len;
+    } else {
+      fprintf(stderr, "Cannot read input file %s\n", files[i]);
+      ret = 1;
+      continue;
+    }
+    snprintf(line, sizeof(line), "%s %s %lu\n", format, send_path ? "path" : "data", len);
+    if (write_all(conn.fd, line, strlen(line)) || write_all(conn.fd, data, len) || conn_read_line(&conn, line, sizeof(line))) {
+      fprintf(stderr, "Connection to socket %s failed\n", path);
+      ret = 1;
+      break;
+    }
+    if (strncmp(line, "ERR ", 4) == 0) {
+      fprintf(stderr, "%s: %s\n", files[i], line+4);
+      ret = 1;
+      continue;
+    }
+    if (sscanf(line, "OK %lu", &len) != 1 || bmfd_buffer_reserve(&input, len+1) || conn_read(&conn, input.data, len)) {
+      fprintf(stderr, "Invalid answer for %s\n", files[i]);
+      ret = 1;
+      break;
+    }
+    if (fwrite(input.data, 1, len, stdout) != len)
+      ret = 1;
+  }
+  free(input.data);
+  close(conn.fd);
+  return ret;
+}
+
+int main(int argc, char *argv[]) {
+  char *socket_path = NULL;
+  char *connect_path = NULL;
+  char *format = "mof";
+  int send_path = 0;
+  int workers = 4;
+  unsigned long mode = 0600;
+  char *end;
+  int argi;
+  for (argi = 1; argi < argc && argv[argi][0] == '-' && argv[argi][1]; ++argi) {
+    if (strncmp(argv[argi], "--socket=", strlen("--socket=")) == 0) {
+      socket_path = argv[argi] + strlen("--socket=");
+    } else if (strncmp(argv[argi], "--connect=", strlen("--connect=")) == 0) {
+      connect_path = argv[argi] + strlen("--connect=");
+    } else if (strncmp(argv[argi], "--format=", strlen("--format=")) == 0) {
+      format = argv[argi] + strlen("--format=");
+      if (bmfd_format_lookup(format) < 0) {
+        argc = 0;
+        break;
+      }
+    } else if (strcmp(argv[argi], "--path") == 0) {
+      send_path = 1;
+    } else if (strncmp(argv[argi], "--workers=", strlen("--workers=")) == 0) {
+      errno = 0;
+      workers = strtol(argv[argi] + strlen("--workers="), &end, 10);
+      if (errno || *end || end == argv[argi] + strlen("--workers=") || workers < 1 || workers > 256) {
+        argc = 0;
+        break;
+      }
+    } else if (strncmp(argv[argi], "--mode=", strlen("--mode=")) == 0) {
+      errno = 0;
+      mode = strtoul(argv[argi] + strlen("--mode="), &end, 8);
+      if (errno || *end || end == argv[argi] + strlen("--mode=") || mode > 0777) {
+        argc = 0;
+        break;
+      }
+    } else if (strncmp(argv[argi], "--cache=", strlen("--cache=")) == 0) {
+      if (parse_size(argv[argi] + strlen("--cache="), &cache_limit)) {
+        argc = 0;
+        break;
+      }
+    } else if (strncmp(argv[argi], "--memory-limit=", strlen("--memory-limit=")) == 0) {
+      if (parse_size(argv[argi] + strlen("--memory-limit="), &memory_limit)) {
+        argc = 0;
+        break;
+      }
+    } else if (strncmp(argv[argi], "--threads=", strlen("--threads=")) == 0) {
+      errno = 0;
+      decompress_threads = strtol(argv[argi] + strlen("--threads="), &end, 10);
+      if (errno || *end || end == argv[argi] + strlen("--threads=") || decompress_threads < 1 || decompress_threads > 256) {
+        argc = 0;
+        break;
+      }
+    } else if (strcmp(argv[argi], "--diag=silent") == 0) {
+      diag_mode = DIAG_SILENT;
+    } else if (strcmp(argv[argi], "--diag=summary") == 0) {
+      diag_mode = DIAG_SUMMARY;
+    } else if (strcmp(argv[argi], "--diag=full") == 0) {
+      diag_mode = DIAG_FULL;
+    } else if (strcmp(argv[argi], "--") == 0) {
+      ++argi;
+      break;
+    } else {
+      argc = 0;
+      break;
+    }
+  }
+  if (argc == 0 || !socket_path == !connect_path || (socket_path && argc-argi != 0) || (connect_path && argc-argi < 1)) {
+    fprintf(stderr, "Usage: %s [options] --socket=path\n", argv[0]);
+    fprintf(stderr, "       %s --connect=path [--format=FORMAT] [--path] input_file...\n", argv[0]);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --workers=N           serve N connections in parallel (default 4)\n");
+    fprintf(stderr, "  --mode=MODE           octal permissions of socket (default 0600)\n");
+    fprintf(stderr, "  --cache=BYTES         size of result cache (K, M or G suffix, default 64M)\n");
+    fprintf(stderr, "  --diag=MODE           warnings: silent, summary or full (default)\n");
+    fprintf(stderr, "  --memory-limit=BYTES  limit memory used for one file (K, M or G suffix)\n");
+    fprintf(stderr, "  --threads=N           decompress large files with N threads\n");
+    fprintf(stderr, "Client options:\n");
+    fprintf(stderr, "  --format=FORMAT       output: mof (default), text, json or raw\n");
+    fprintf(stderr, "  --path                send file names instead of file contents\n");
+    return 1;
+  }
+  if (connect_path)
+    return run_client(connect_path, format, send_path, argc-argi, argv+argi);
+  return run_daemon(socket_path, workers, (mode_t)mode);
+}
@@ -16,11 +16,22 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#define _GNU_SOURCE /* fopencookie() */
+
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
 
 #define INLINE static inline
 
@@ -28,12 +39,267 @@ typedef uint8_t __u8;
 typedef uint32_t __u32;
 typedef uint16_t __u16;
 
+/*
+ * Diagnostics sink. Warnings are recorded as events (kind, offset into
+ * processed data, record and member context) instead of being written to
+ * stderr immediately. Repeated events with same kind and message are
+ * counted only once. diag_flush() writes events of current file in one
+ * write: DIAG_FULL prints every unique event with capped hexdump,
+ * DIAG_SUMMARY prints one line with count per kind and DIAG_SILENT
+ * drops everything.
+ */
+
+enum diag_mode {
+  DIAG_SILENT,
+  DIAG_SUMMARY,
+  DIAG_FULL,
+};
+
+#define DIAG_MAX_EVENTS 64
+#define DIAG_MAX_DUMP 64
+
+struct diag_event {
+  const char *kind;
+  uint32_t offset;
+  uint32_t count;
+  int64_t record;
+  char member[64];
+  char message[128];
+  uint32_t dump_size;
+  unsigned char dump[DIAG_MAX_DUMP];
+};
+
+static enum diag_mode diag_mode = DIAG_FULL;
+static struct diag_event diag_events[DIAG_MAX_EVENTS];
+static uint32_t diag_events_count;
+static uint32_t diag_dropped;
+/* name of processed file, base of processed data and current context */
+static char diag_name[4096];
+static const char *diag_base;
+static uint32_t diag_base_size;
+static int64_t diag_record = -1;
+static char diag_member[64];
+
+static void diag_begin(const char *name) {
+  snprintf(diag_name, sizeof(diag_name), "%s", name);
+}
+
+static void diag_context(int64_t record, const char *member) {
+  diag_record = record;
+  snprintf(diag_member, sizeof(diag_member), "%s", member ? member : "");
+}
+
+static char diag_buf[4096];
+static size_t diag_buf_len;
+
+static void diag_printf(const char *fmt, ...) {
+  va_list ap;
+  int len;
+  va_start(ap, fmt);
+  len = vsnprintf(diag_buf + diag_buf_len, sizeof(diag_buf) - diag_buf_len, fmt, ap);
+  va_end(ap);
+  if (len < 0)
+    return;
+  if ((size_t)len >= sizeof(diag_buf) - diag_buf_len) {
+    fwrite(diag_buf, 1, diag_buf_len, stderr);
+    diag_buf_len = 0;
+    va_start(ap, fmt);
+    len = vsnprintf(diag_buf, sizeof(diag_buf), fmt, ap);
+    va_end(ap);
+    if (len < 0)
+      return;
+    if ((size_t)len >= sizeof(diag_buf))
+      len = sizeof(diag_buf) - 1;
+  }
+  diag_buf_len += len;
+}
+
+static void diag_print_dump(struct diag_event *event) {
+  uint32_t size = event->dump_size < DIAG_MAX_DUMP ? event->dump_size : DIAG_MAX_DUMP;
+  uint32_t i, j;
+  for (i = 0; i < size; i += 16) {
+    diag_printf("  %04X:", (unsigned int)i);
+    for (j = i; j < i+16; ++j) {
+      if (j < size)
+        diag_printf(" %02X", event->dump[j]);
+      else
+        diag_printf("   ");
+    }
+    diag_printf("  |");
+    for (j = i; j < i+16 && j < size; ++j)
+      diag_printf("%c", (event->dump[j] >= 32 && event->dump[j] <= 126) ? event->dump[j] : '.');
+    diag_printf("|\n");
+  }
+  if (event->dump_size > size)
+    diag_printf("  ... %u more bytes\n", (unsigned int)(event->dump_size - size));
+}
+
+static void diag_flush(void) {
+  const char *name = diag_name[0] ? diag_name : "(stdin)";
+  uint32_t i, j;
+  if (diag_mode == DIAG_SUMMARY && diag_events_count) {
+    diag_printf("%s: warnings:", name);
+    for (i = 0; i < diag_events_count; ++i) {
+      uint32_t count = 0;
+      for (j = 0; j < i && strcmp(diag_events[j].kind, diag_events[i].kind) != 0; ++j);
+      if (j != i)
+        continue;
+      for (j = i; j < diag_events_count; ++j)
+        if (strcmp(diag_events[j].kind, diag_events[i].kind) == 0)
+          count += diag_events[j].count;
+      diag_printf(" %s=%u", diag_events[i].kind, (unsigned int)count);
+    }
+    if (diag_dropped)
+      diag_printf(" other=%u", (unsigned int)diag_dropped);
+    diag_printf("\n");
+  } else if (diag_mode == DIAG_FULL) {
+    for (i = 0; i < diag_events_count; ++i) {
+      struct diag_event *event = &diag_events[i];
+      diag_printf("Warning: %s", event->message);
+      if (event->offset != UINT32_MAX)
+        diag_printf(" at offset 0x%x", (unsigned int)event->offset);
+      if (event->record >= 0)
+        diag_printf(" in record %lld", (long long)event->record);
+      if (event->member[0])
+        diag_printf(" member %s", event->member);
+      if (event->count > 1)
+        diag_printf(" (repeated %u times)", (unsigned int)event->count);
+      diag_printf("\n");
+      diag_print_dump(event);
+    }
+    if (diag_dropped)
+      diag_printf("Warning: %u more warnings not shown\n", (unsigned int)diag_dropped);
+  }
+  fwrite(diag_buf, 1, diag_buf_len, stderr);
+  diag_buf_len = 0;
+  diag_events_count = 0;
+  diag_dropped = 0;
+  diag_base = NULL;
+  diag_base_size = 0;
+  diag_context(-1, NULL);
+}
+
 #ifdef DEBUG
 #define LOG_DECOMP(...) fprintf(stderr, __VA_ARGS__)
 #else
 #define LOG_DECOMP(...)
 #endif
 
+/*
+ * Tracepoints, compiled in only with -DTRACE (make CPPFLAGS=-DTRACE).
+ * TRACE_BEGIN() and TRACE_END() fire USDT probe bmfdec:point_begin or
+ * bmfdec:point_end with byte offset and class name as arguments when
+ * <sys/sdt.h> is available, so perf and bpftrace can attach to them. Begin
+ * event carries offset of start of processed data, end event offset of its
+ * end (or of output position for ds_dec, index for printers). With
+ * --trace events are also recorded into ring buffer of last TRACE_EVENTS
+ * events, which is written to stderr at exit. Event without end means that
+ * processing failed there. Without -DTRACE macros expand to nothing and
+ * their arguments are not evaluated.
+ */
+#ifdef TRACE
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE(point, offset, name) DTRACE_PROBE2(bmfdec, point, offset, name)
+#endif
+#endif
+#ifndef TRACE_PROBE
+#define TRACE_PROBE(point, offset, name) do {} while (0)
+#endif
+
+#define TRACE_EVENTS 16384
+
+struct trace_event {
+  uint64_t time;
+  const char *point;
+  int end;
+  uint32_t offset;
+  char name[48];
+};
+
+static struct trace_event trace_events[TRACE_EVENTS];
+static _Atomic uint64_t trace_count;
+static int trace_enabled;
+/* name of class parsed by parse thread, used by events nested in class */
+static const char *trace_class;
+
+static void trace_event(const char *point, int end, uint32_t offset, const char *name) {
+  struct trace_event *event;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  event = &trace_events[atomic_fetch_add_explicit(&trace_count, 1, memory_order_relaxed) % TRACE_EVENTS];
+  event->time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  event->point = point;
+  event->end = end;
+  event->offset = offset;
+  snprintf(event->name, sizeof(event->name), "%s", name ? name : "");
+}
+
+static void trace_flush(void) {
+  uint64_t count = atomic_load(&trace_count);
+  uint64_t i = (count > TRACE_EVENTS) ? count - TRACE_EVENTS : 0;
+  uint64_t start = trace_events[i % TRACE_EVENTS].time;
+  struct trace_event *event;
+  if (count > TRACE_EVENTS)
+    fprintf(stderr, "Trace: %llu older events dropped\n", (unsigned long long)(count - TRACE_EVENTS));
+  for (; i < count; ++i) {
+    event = &trace_events[i % TRACE_EVENTS];
+    fprintf(stderr, "Trace: %12.3f us %-5s %s offset 0x%x", (event->time - start) / 1000.0, event->end ? "end" : "begin", event->point, (unsigned int)event->offset);
+    if (event->name[0])
+      fprintf(stderr, " class %s", event->name);
+    fprintf(stderr, "\n");
+  }
+}
+
+static void trace_start(void) {
+  trace_enabled = 1;
+  atexit(trace_flush);
+}
+
+/* Offset of pointer into processed data (or its end) for events, see diag_vevent() */
+#define trace_offset(ptr) (((ptr) && diag_base && (const char *)(ptr) >= diag_base && (const char *)(ptr) <= diag_base + diag_base_size) ? (uint32_t)((const char *)(ptr) - diag_base) : UINT32_MAX)
+
+#define TRACE_BEGIN(point, offset, name) do { TRACE_PROBE(point##_begin, offset, name); if (trace_enabled) trace_event(#point, 0, offset, name); } while (0)
+#define TRACE_END(point, offset, name) do { TRACE_PROBE(point##_end, offset, name); if (trace_enabled) trace_event(#point, 1, offset, name); } while (0)
+#define TRACE_CLASS(name) (trace_class = (name))
+
+#else
+
+#define TRACE_BEGIN(point, offset, name) do {} while (0)
+#define TRACE_END(point, offset, name) do {} while (0)
+#define TRACE_CLASS(name) do {} while (0)
+
+#endif
+
+/*
+ * Per-file budgets of --batch, zero means no limit. Decode deadline is
+ * checked cooperatively at every sync token, so decoding of stream without
+ * syncs is bounded only by --data-limit. Parser checks parse deadline in
+ * its loops by parse_budget_check(). Deadlines are CLOCK_MONOTONIC times in
+ * ns, decode_deadline is set by decode thread before decoding and
+ * parse_deadline is used only by parse thread.
+ */
+static unsigned long decode_time_limit;
+static unsigned long parse_time_limit;
+static size_t data_limit;
+static size_t output_limit;
+static uint64_t decode_deadline;
+static uint64_t parse_deadline;
+
+static uint64_t budget_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t budget_deadline(unsigned long ms) {
+  return ms ? budget_now() + (uint64_t)ms * 1000000 : 0;
+}
+
+#define decode_budget_exceeded() (decode_deadline && budget_now() > decode_deadline)
+
 /*
 dblspace_dec.c
 
@@ -166,6 +432,7 @@ INLINE int dblb_decrep(bits_t *pbits, __u8 **p, void *pout, __u8 *pend,
     { LOG_DECOMP("DMSDOS: decrb: sync at decompressed pos %d ?\n",pos);
       return -2;
     }
+    if(decode_budget_exceeded()) return -3;
     return 0;
   }
   replen=dblb_rdlen(pbits)+k;
@@ -182,6 +449,9 @@ INLINE int dblb_decrep(bits_t *pbits, __u8 **p, void *pout, __u8 *pend,
 }
 
 /* DS decompression */
+#ifdef TRACE
+#define ds_dec ds_dec_untraced
+#endif
 /* flg=0x4000 is used, when called from stacker_dec.c, because of
    stacker does not store original cluster size and it can mean,
    that last cluster in file can be ended by garbage */
@@ -240,6 +510,508 @@ int ds_dec(void* pin,int lin, void* pout, int lout, int flg)
   return p-(__u8*)pout;
 }
 
+#ifdef TRACE
+#undef ds_dec
+/* end event carries decompressed size, or -1 on error */
+int ds_dec(void* pin,int lin, void* pout, int lout, int flg)
+{
+  int ret;
+  TRACE_BEGIN(ds_dec, 0, NULL);
+  ret = ds_dec_untraced(pin, lin, pout, lout, flg);
+  TRACE_END(ds_dec, ret < 0 ? UINT32_MAX : (uint32_t)ret, NULL);
+  return ret;
+}
+#endif
+
+/*
+ * Parallel DS decompression. Sync token 0x113f (15 one bits) is always at
+ * 512 byte boundary of output, so decoding can continue after it without
+ * knowing output position. Input is split into parts and in each part the
+ * first position which looks like sync and decodes to next aligned sync
+ * becomes start of chunk. Chunks are decoded in parallel into own buffers,
+ * back-references to data not known by chunk are recorded as patches.
+ * Every chunk decodes up to first sync after start of next chunk. Then
+ * chunks are joined in order, chunk is used only when previous chunk
+ * stopped exactly at its start, otherwise it is decoded again from the
+ * correct position. Patches are applied with real output position. When
+ * anything does not match, serial ds_dec() is used, so result is always
+ * same as from ds_dec().
+ */
+
+#define DS_PARALLEL_MIN 0x40000
+
+struct ds_patch {
+  __u32 dst;
+  __u16 off;
+  __u16 len;
+};
+
+struct ds_chunk {
+  __u16 *pin;
+  unsigned lin;
+  size_t start;       /* bit position of first token */
+  size_t search_end;  /* sync candidates are searched below this */
+  size_t sync_run;    /* start of one bits run which contains start sync */
+  size_t target;      /* stop at first sync after this bit position, 0 means end of input */
+  size_t lout;        /* maximal output size */
+  __u8 *out;
+  __u8 *unknown;      /* output byte depends on data before chunk */
+  size_t out_len;
+  size_t out_size;
+  struct ds_patch *patches;
+  size_t patches_count;
+  size_t patches_size;
+  size_t bitpos;      /* bit position where decoding stopped */
+  size_t last_sync;   /* output position of last sync */
+  int last_was_sync;
+  int ret;
+  int phase;
+};
+
+/* set bit reader to position pos (in bits) of input */
+static void ds_bits_at(bits_t *pbits, __u16 *pin, unsigned lin, size_t pos)
+{
+  size_t words = (lin+1)>>1;
+  pbits->pe = pin + words;
+  pbits->pd = pin + pos/16 + 1;
+  pbits->pb = 16 + pos%16;
+  pbits->buf = (pos/16 < words) ? (__u32)le16_to_cpu(pin[pos/16]) << 16 : 0;
+  if (pbits->pd > pbits->pe)
+    pbits->pd = pbits->pe;
+}
+
+static size_t ds_bits_pos(bits_t *pbits, __u16 *pin)
+{
+  return (pbits->pd - pin) * 16 + pbits->pb - 32;
+}
+
+/* find first position in [from, to) where 15 one bits (sync token) start */
+static size_t ds_find_sync(__u16 *pin, unsigned lin, size_t from, size_t to)
+{
+  size_t words = (lin+1)>>1;
+  size_t pos = from;
+  __u32 w;
+  unsigned k, zero;
+  while (pos < to) {
+    k = pos/16;
+    w = (k < words) ? le16_to_cpu(pin[k]) : 0;
+    if (k+1 < words)
+      w |= (__u32)le16_to_cpu(pin[k+1]) << 16;
+    w >>= pos%16;
+    if ((~w & 0x7FFF) == 0)
+      return pos;
+    for (zero = 0; (w >> zero) & 1; ++zero);
+    pos += zero + 1;
+  }
+  return to;
+}
+
+static int ds_chunk_grow(struct ds_chunk *chunk, size_t size)
+{
+  size_t new_size;
+  __u8 *out, *unknown;
+  if (size <= chunk->out_size)
+    return 0;
+  new_size = chunk->out_size ? chunk->out_size : 0x10000;
+  while (new_size < size)
+    new_size *= 2;
+  if (new_size > chunk->lout)
+    new_size = chunk->lout;
+  out = realloc(chunk->out, new_size);
+  if (out)
+    chunk->out = out;
+  unknown = realloc(chunk->unknown, new_size);
+  if (unknown)
+    chunk->unknown = unknown;
+  if (!out || !unknown)
+    return -1;
+  chunk->out_size = new_size;
+  return 0;
+}
+
+/*
+ * Decode tokens like ds_dec(), stops after max_syncs aligned syncs (0 unlimited).
+ * Returns 0 at stop, 1 at unaligned sync, -1 on allocation failure, -2 on
+ * invalid data and -3 when decode time limit was exceeded.
+ */
+static int ds_chunk_decode(struct ds_chunk *chunk, bits_t *pbits, int max_syncs)
+{
+  unsigned u, repoffs;
+  int replen, syncs = 0, patch;
+  long long src;
+  size_t dst;
+  for (;;) {
+    if (!(pbits->pd<pbits->pe||(pbits->pd==pbits->pe&&pbits->pb<16)))
+      return 0;
+    chunk->last_was_sync = 0;
+    RDN_PR(*pbits,u);
+    switch (u&3) {
+    case 0:
+      pbits->pb+=2+6;
+      repoffs=(u>>2)&63;
+      break;
+    case 1:
+    case 2:
+      pbits->pb+=2+7;
+      if (chunk->out_len >= chunk->lout)
+        return -2;
+      if (ds_chunk_grow(chunk, chunk->out_len+1))
+        return -1;
+      chunk->out[chunk->out_len] = (u&3) == 1 ? (u>>2)|128 : (u>>2)&127;
+      chunk->unknown[chunk->out_len++] = 0;
+      continue;
+    default:
+      if (u&4) { pbits->pb+=3+12; repoffs=((u>>3)&4095)+320; }
+      else { pbits->pb+=3+8; repoffs=((u>>3)&255)+64; }
+      break;
+    }
+    if (repoffs == 0)
+      return -2;
+    if (repoffs == 0x113f) {
+      chunk->last_sync = chunk->out_len;
+      chunk->last_was_sync = 1;
+      if (chunk->out_len % 512)
+        return 1;
+      if (decode_budget_exceeded())
+        return -3;
+      if (max_syncs && ++syncs == max_syncs)
+        return 0;
+      if (chunk->target && ds_bits_pos(pbits, chunk->pin) >= chunk->target)
+        return 0;
+      continue;
+    }
+    replen = dblb_rdlen(pbits)-1;
+    if (replen <= 0 || chunk->out_len+replen > chunk->lout)
+      return -2;
+    if (ds_chunk_grow(chunk, chunk->out_len+replen))
+      return -1;
+    patch = 0;
+    for (dst = chunk->out_len; dst < chunk->out_len+replen; ++dst) {
+      src = (long long)dst - repoffs;
+      if (src < 0 || chunk->unknown[src]) {
+        chunk->unknown[dst] = 1;
+        patch = 1;
+      } else {
+        chunk->out[dst] = chunk->out[src];
+        chunk->unknown[dst] = 0;
+      }
+    }
+    if (patch) {
+      if (chunk->patches_count == chunk->patches_size) {
+        struct ds_patch *patches;
+        size_t size = chunk->patches_size ? 2*chunk->patches_size : 256;
+        patches = realloc(chunk->patches, size*sizeof(*patches));
+        if (!patches)
+          return -1;
+        chunk->patches = patches;
+        chunk->patches_size = size;
+      }
+      chunk->patches[chunk->patches_count].dst = chunk->out_len;
+      chunk->patches[chunk->patches_count].off = repoffs;
+      chunk->patches[chunk->patches_count].len = replen;
+      chunk->patches_count++;
+    }
+    chunk->out_len += replen;
+  }
+}
+
+static void ds_chunk_run(struct ds_chunk *chunk, size_t start, int max_syncs)
+{
+  bits_t bits;
+  chunk->out_len = 0;
+  chunk->patches_count = 0;
+  chunk->last_sync = (size_t)-1;
+  chunk->last_was_sync = 0;
+  ds_bits_at(&bits, chunk->pin, chunk->lin, start);
+  chunk->ret = ds_chunk_decode(chunk, &bits, max_syncs);
+  chunk->bitpos = ds_bits_pos(&bits, chunk->pin);
+}
+
+static void *ds_chunk_thread(void *arg)
+{
+  struct ds_chunk *chunk = arg;
+  size_t pos, run = (size_t)-1;
+  if (chunk->phase == 0) {
+    /* find start: candidate which decodes up to next aligned sync */
+    for (pos = chunk->start; (pos = ds_find_sync(chunk->pin, chunk->lin, pos, chunk->search_end)) < chunk->search_end; ++pos) {
+      if (pos != run+1)
+        chunk->sync_run = pos;
+      run = pos;
+      ds_chunk_run(chunk, pos+15, 1);
+      if (chunk->ret == 0 && chunk->last_was_sync)
+        break;
+    }
+    chunk->start = (pos < chunk->search_end) ? pos+15 : (size_t)-1;
+    return NULL;
+  }
+  ds_chunk_run(chunk, chunk->start, 0);
+  return NULL;
+}
+
+static void ds_run_chunks(struct ds_chunk *chunks, int count, int phase)
+{
+  pthread_t *threads;
+  char *started;
+  int i;
+  threads = calloc(count, sizeof(*threads));
+  started = calloc(count, 1);
+  for (i = 0; i < count; ++i) {
+    chunks[i].phase = phase;
+    if (threads && started && pthread_create(&threads[i], NULL, ds_chunk_thread, &chunks[i]) == 0)
+      started[i] = 1;
+    else
+      ds_chunk_thread(&chunks[i]);
+  }
+  for (i = 0; i < count; ++i) {
+    if (started && started[i])
+      pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  free(started);
+}
+
+/* join decoded chunks into pout, returns zero when result is same as from ds_dec() */
+static int ds_join_chunks(struct ds_chunk *chunks, int count, __u8 *pout, size_t lout)
+{
+  size_t base = 0, cursor = chunks[0].start, len, i, j, d;
+  int k;
+  for (k = 0; k < count; ++k) {
+    struct ds_chunk *chunk = &chunks[k];
+    /* previous chunk did not stop at start of this chunk */
+    if (chunk->start != cursor) {
+      chunk->start = cursor;
+      ds_chunk_run(chunk, cursor, 0);
+    }
+    if (k < count-1) {
+      if (chunk->ret != 0 || !chunk->last_was_sync || chunk->bitpos < chunk->target || chunk->out_len > lout-base)
+        return -1;
+      len = chunk->out_len;
+    } else {
+      if (chunk->ret == -1 || chunk->last_sync != lout-base)
+        return -1;
+      len = lout-base;
+    }
+    memcpy(pout+base, chunk->out, len);
+    for (i = 0; i < chunk->patches_count && chunk->patches[i].dst < len; ++i) {
+      d = base + chunk->patches[i].dst;
+      if (d < chunk->patches[i].off)
+        return -1;
+      for (j = 0; j < chunk->patches[i].len; ++j, ++d)
+        pout[d] = pout[d-chunk->patches[i].off];
+    }
+    base += len;
+    cursor = chunk->bitpos;
+  }
+  return (base == lout) ? 0 : -1;
+}
+
+static void ds_free_chunk(struct ds_chunk *chunk)
+{
+  free(chunk->out);
+  free(chunk->unknown);
+  free(chunk->patches);
+  memset(chunk, 0, sizeof(*chunk));
+}
+
+/* Same as ds_dec(), but decodes parts of large input in parallel threads */
+int ds_dec_parallel(void* pin,int lin, void* pout, int lout, int flg, int threads)
+{
+  struct ds_chunk *chunks;
+  size_t part, total;
+  int i, count, ret;
+  if (threads < 2 || flg || lout < DS_PARALLEL_MIN || lin < 4 || le16_to_cpu(((__u16 *)pin)[0]) != 0x5344)
+    return ds_dec(pin, lin, pout, lout, flg);
+  chunks = calloc(threads, sizeof(*chunks));
+  if (!chunks)
+    return ds_dec(pin, lin, pout, lout, flg);
+  total = (size_t)lin*8;
+  part = (total-32) / threads;
+  for (i = 0; i < threads; ++i) {
+    chunks[i].pin = pin;
+    chunks[i].lin = lin;
+    chunks[i].lout = lout;
+    chunks[i].start = 32 + i*part;
+    chunks[i].search_end = (i == threads-1) ? total : 32 + (i+1)*part;
+  }
+  ds_run_chunks(chunks+1, threads-1, 0);
+  /* drop parts without sync, previous chunk continues instead of them */
+  for (i = 1, count = 1; i < threads; ++i) {
+    if (chunks[i].start == (size_t)-1) {
+      ds_free_chunk(&chunks[i]);
+      continue;
+    }
+    if (count != i) {
+      chunks[count] = chunks[i];
+      memset(&chunks[i], 0, sizeof(chunks[i]));
+    }
+    chunks[count-1].target = chunks[count].sync_run + 15;
+    count++;
+  }
+  chunks[count-1].target = 0;
+  ds_run_chunks(chunks, count, 1);
+  ret = ds_join_chunks(chunks, count, pout, lout);
+  for (i = 0; i < count; ++i) {
+    /* serial decoding would exceed time limit too */
+    if (ret != 0 && chunks[i].ret == -3)
+      ret = -3;
+    ds_free_chunk(&chunks[i]);
+  }
+  free(chunks);
+  if (ret == -3)
+    return -3;
+  if (ret != 0)
+    return ds_dec(pin, lin, pout, lout, flg);
+  return lout;
+}
+
+/*
+ * Statistics of DS stream for --analyze. Tokens are literal of 7 bits
+ * (case 2 for 0-127, case 1 for 128-255) or back-reference with 6, 8 or 12
+ * bit offset class followed by length code read by dblb_rdlen(). Sync is
+ * back-reference with offset 0x113f and without length.
+ */
+#define DS_STATS_LENGTHS 10  /* match length 2^i .. 2^(i+1)-1 */
+#define DS_STATS_OFFSETS 13  /* offset 2^i .. 2^(i+1)-1 */
+#define DS_STATS_BLOCK 512  /* output bytes per block of --analyze=blocks, same as sync interval */
+
+/* Token belongs to block where its output starts */
+struct ds_block_stats {
+  uint32_t bytes;
+  uint64_t bits;
+  uint32_t literals;
+  uint32_t matches;
+  uint32_t match_bytes;
+  uint32_t syncs;
+};
+
+struct ds_stats {
+  uint32_t literals[2];
+  uint32_t offset_classes[3];
+  uint32_t syncs;
+  uint32_t lengths[DS_STATS_LENGTHS];
+  uint32_t offsets[DS_STATS_OFFSETS];
+  uint64_t literal_bits;
+  uint64_t match_bits;
+  uint64_t sync_bits;
+  uint64_t match_bytes;
+  uint64_t bits;
+};
+
+static unsigned ds_log2(unsigned val)
+{
+  unsigned i = 0;
+  while (val >>= 1)
+    i++;
+  return i;
+}
+
+static void ds_print_block(FILE *fout, uint32_t index, struct ds_block_stats *block)
+{
+  fprintf(fout, "Block %u: %u bytes, %llu bits (%.2f bits/byte), %u literals, %u matches (%u bytes), %u syncs\n",
+          (unsigned)index, (unsigned)block->bytes, (unsigned long long)block->bits, block->bytes ? (double)block->bits / block->bytes : 0.0,
+          (unsigned)block->literals, (unsigned)block->matches, (unsigned)block->match_bytes, (unsigned)block->syncs);
+  memset(block, 0, sizeof(*block));
+}
+
+/*
+ * Same decoding as ds_dec() with statistics of every token, kept separate
+ * so ds_dec() is not slowed down. When blocks is not NULL, statistics of
+ * every DS_STATS_BLOCK bytes of output are written into it.
+ */
+static int ds_analyze(void* pin,int lin, void* pout, int lout, struct ds_stats *stats, FILE *blocks)
+{
+  struct ds_block_stats block;
+  __u8 *p, *q, *pend;
+  unsigned u, repoffs;
+  uint32_t index = 0;
+  size_t pos;
+  int offset_class;
+  int r;
+  bits_t bits;
+
+  memset(stats, 0, sizeof(*stats));
+  memset(&block, 0, sizeof(block));
+  dblb_rdi(&bits,pin,lin);
+  p=(__u8*)pout;pend=p+lout;
+  if((dblb_rdn(&bits,16))!=0x5344) return -1;
+  dblb_rdn(&bits,16);
+
+  do
+  { r=0;
+    q=p;
+    pos=ds_bits_pos(&bits,pin);
+    offset_class=-1;
+    repoffs=0;
+    RDN_PR(bits,u);
+    switch(u&3)
+    {
+      case 0:
+	bits.pb+=2+6;
+	repoffs=(u>>2)&63;
+	offset_class=0;
+	r=dblb_decrep(&bits,&p,pout,pend,repoffs,-1,0);
+	break;
+      case 1:
+	bits.pb+=2+7;
+	*(p++)=(u>>2)|128;
+	stats->literals[1]++;
+	break;
+      case 2:
+	bits.pb+=2+7;
+	*(p++)=(u>>2)&127;
+	stats->literals[0]++;
+	break;
+      case 3:
+	if(u&4) {  bits.pb+=3+12; repoffs=((u>>3)&4095)+320; offset_class=2; }
+	else  {  bits.pb+=3+8;  repoffs=((u>>3)&255)+64; offset_class=1; };
+	r=dblb_decrep(&bits,&p,pout,pend,repoffs,-1,0);
+	break;
+    }
+    if(r<0) break;
+    if((uint32_t)((q-(__u8*)pout)/DS_STATS_BLOCK)!=index)
+    { if(blocks) ds_print_block(blocks,index,&block);
+      index=(q-(__u8*)pout)/DS_STATS_BLOCK;
+    }
+    pos=ds_bits_pos(&bits,pin)-pos;
+    block.bits+=pos;
+    block.bytes+=p-q;
+    if(offset_class<0)
+    { stats->literal_bits+=pos;
+      block.literals++;
+    }
+    else if(repoffs==0x113f)
+    { stats->syncs++;
+      stats->sync_bits+=pos;
+      block.syncs++;
+    }
+    else
+    { stats->offset_classes[offset_class]++;
+      stats->match_bits+=pos;
+      stats->match_bytes+=p-q;
+      stats->lengths[ds_log2(p-q)]++;
+      stats->offsets[ds_log2(repoffs)]++;
+      block.matches++;
+      block.match_bytes+=p-q;
+    }
+  }while((p<pend)&&(bits.pd<bits.pe||(bits.pd==bits.pe&&bits.pb<16)));
+
+  if(r>=0)
+  { pos=ds_bits_pos(&bits,pin);
+    u=dblb_rdn(&bits,3);if(u==7) u=dblb_rdn(&bits,12)+320;
+    if(u!=0x113f) r=-2;
+    else
+    { stats->syncs++;
+      stats->sync_bits+=ds_bits_pos(&bits,pin)-pos;
+      block.syncs++;
+      block.bits+=ds_bits_pos(&bits,pin)-pos;
+    }
+  }
+  if(blocks && p!=(__u8*)pout) ds_print_block(blocks,index,&block);
+  stats->bits=ds_bits_pos(&bits,pin);
+  if(r<0) return r;
+  return p-(__u8*)pout;
+}
+
 /*
  * BMF file is compressed by DS-01 algorithm with additional header:
  * 4 bytes: 46 4f 4d 42 - 'F' 'O' 'M' 'B'
@@ -258,115 +1030,2093 @@ int ds_dec(void* pin,int lin, void* pout, int lout, int flg)
  * M*8 bytes: second part data
  */
 
-static int process_data(char *data, uint32_t size, FILE *fout) {
-  size_t ret = fwrite(data, 1, size, fout);
-  return (ret == size) ? 0 : 1;
+/*
+ * Memory budget for one processed document, set by --memory-limit option.
+ * Zero means unlimited. All blocks allocated by mem_malloc() are linked
+ * together, so memory of a document can be released at once by
+ * mem_free_all() when processing of the document fails in the middle.
+ */
+static size_t memory_limit;
+static size_t memory_used;
+static size_t memory_peak;
+
+struct mem_block {
+  struct mem_block *prev;
+  struct mem_block *next;
+  size_t size;
+  size_t align; /* keep returned memory 16 bytes aligned */
+};
+
+static struct mem_block mem_blocks = { &mem_blocks, &mem_blocks, 0, 0 };
+
+static int mem_reserve(size_t size) {
+  if (memory_limit && (size > memory_limit || memory_used > memory_limit - size)) {
+    fprintf(stderr, "Memory limit exceeded\n");
+    return 0;
+  }
+  return 1;
 }
 
-#undef process_data
-static int process_data(char *data, uint32_t size, FILE *fout);
+static void *mem_malloc(size_t size) {
+  struct mem_block *block;
+  if (size > SIZE_MAX - sizeof(*block) || !mem_reserve(size))
+    return NULL;
+  block = malloc(sizeof(*block) + size);
+  if (!block)
+    return NULL;
+  block->size = size;
+  block->prev = &mem_blocks;
+  block->next = mem_blocks.next;
+  mem_blocks.next->prev = block;
+  mem_blocks.next = block;
+  memory_used += size;
+  if (memory_used > memory_peak)
+    memory_peak = memory_used;
+  return block + 1;
+}
 
-int main(int argc, char *argv[]) {
-  FILE *fin;
-  FILE *fout;
-  uint32_t *pin;
-  char *pout;
-  long sin;
-  size_t lin;
-  uint32_t lout;
-  int ret;
-  if ((argc != 1 && argc != 2 && argc != 3) || (argc >= 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))) {
-    fprintf(stderr, "Usage: %s [input_file [output_file]]\n", argv[0]);
+static void mem_free(void *ptr) {
+  struct mem_block *block;
+  if (!ptr)
+    return;
+  block = (struct mem_block *)ptr - 1;
+  block->prev->next = block->next;
+  block->next->prev = block->prev;
+  memory_used -= block->size;
+  free(block);
+}
+
+static void mem_free_all(void) {
+  while (mem_blocks.next != &mem_blocks)
+    mem_free(mem_blocks.next + 1);
+}
+
+/* Number of threads for decompression, set by --threads option */
+static int decompress_threads = 1;
+
+/* Check BMF header and read size of decompressed data, returns zero on success */
+static int check_header(uint32_t *pin, size_t lin, uint32_t *lout) {
+  if (lin <= 16 || pin[0] != 0x424D4F46 || pin[1] != 0x00000001 || pin[2] != (uint32_t)lin-16 || pin[3] > 0x2000000) {
+    fprintf(stderr, "Invalid input\n");
     return 1;
   }
-  if (argc >= 2) {
-    fin = fopen(argv[1], "rb");
-    if (!fin) {
-      fprintf(stderr, "Cannot open input file %s: %s\n", argv[1], strerror(errno));
-      return 1;
-    }
-  } else {
-    fin = stdin;
+  *lout = pin[3];
+  return 0;
+}
+
+/*
+ * Check BMF header and decompress data. Returns buffer allocated by
+ * mem_malloc() with decompressed data or NULL on error.
+ */
+static char *decompress_data(uint32_t *pin, size_t lin, uint32_t *lout) {
+  char *pout;
+  int threads;
+  if (check_header(pin, lin, lout))
+    return NULL;
+  pout = mem_malloc(*lout);
+  if (!pout) {
+    fprintf(stderr, "Cannot allocate memory for decompression\n");
+    return NULL;
   }
-  if (fseek(fin, 0, SEEK_END) == 0) {
-    sin = ftell(fin);
-    if (sin < 0) {
-      fprintf(stderr, "Cannot determinate size of input file %s: %s\n", argc >= 2 ? argv[1] : "(stdin)", strerror(errno));
-      if (argc >= 2)
-        fclose(fin);
-      return 1;
-    }
-    ++sin;
-    rewind(fin);
-    if (sin > 0x800000) {
-      fprintf(stderr, "Size of input file %s too large\n", argc >= 2 ? argv[1] : "(stdin)");
-      if (argc >= 2)
-        fclose(fin);
-      return 1;
-    }
-  } else {
-    sin = 0x800000;
+  /* buffers of parallel decoder are not counted, they need about size of output */
+  threads = decompress_threads;
+  if (memory_limit && (memory_used > memory_limit || 2*(size_t)*lout > memory_limit - memory_used))
+    threads = 1;
+  if (ds_dec_parallel((char *)pin+16, lin-16, pout, *lout, 0, threads) != (int)*lout) {
+    fprintf(stderr, "Decompress failed\n");
+    mem_free(pout);
+    return NULL;
   }
-  pin = malloc(sin);
-  if (!pin) {
-    fprintf(stderr, "Cannot allocate memory for input file %s\n", argc >= 2 ? argv[1] : "(stdin)");
-    if (argc >= 2)
-      fclose(fin);
-    return 1;
+  return pout;
+}
+
+/* Seconds from monotonic clock */
+static double time_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void analyze_histogram(FILE *fout, const char *name, uint32_t *counts, unsigned count) {
+  char range[32];
+  unsigned i;
+  fprintf(fout, "%s:\n", name);
+  for (i = 0; i < count; ++i) {
+    if (!counts[i])
+      continue;
+    if (i == 0)
+      snprintf(range, sizeof(range), "1");
+    else
+      snprintf(range, sizeof(range), "%u-%u", 1U << i, (2U << i) - 1);
+    fprintf(fout, "  %-10s %u\n", range, (unsigned)counts[i]);
   }
-  lin = fread(pin, 1, sin, fin);
-  if (ferror(fin)) {
-    fprintf(stderr, "Failed to read data from input file %s\n", argc >= 2 ? argv[1] : "(stdin)");
-    free(pin);
-    if (argc >= 2)
-      fclose(fin);
+}
+
+/*
+ * Write statistics of DS compressed data for --analyze. Decode time is
+ * measured on ds_dec() itself, which is run repeatedly for at least 0.1s.
+ */
+static int analyze_data(uint32_t *pin, size_t lin, FILE *fout, int blocks) {
+  struct ds_stats stats;
+  uint32_t matches;
+  uint32_t lout;
+  double start, elapsed;
+  unsigned runs;
+  char *pout;
+  if (check_header(pin, lin, &lout))
     return 1;
-  } else if (!feof(fin)) {
-    fprintf(stderr, "Data too large in input file %s\n", argc >= 2 ? argv[1] : "(stdin)");
-    free(pin);
-    if (argc >= 2)
-      fclose(fin);
+  pout = mem_malloc(lout ? lout : 1);
+  if (!pout) {
+    fprintf(stderr, "Cannot allocate memory for decompression\n");
     return 1;
   }
-  if (argc >= 2)
-    fclose(fin);
-  if (lin <= 16 || pin[0] != 0x424D4F46 || pin[1] != 0x00000001 || pin[2] != (uint32_t)lin-16) {
-    fprintf(stderr, "Invalid input\n");
-    free(pin);
+  if (ds_analyze((char *)pin+16, lin-16, pout, lout, &stats, blocks ? fout : NULL) != (int)lout) {
+    fprintf(stderr, "Decompress failed\n");
+    mem_free(pout);
     return 1;
   }
-  lout = pin[3];
-  if (lout > 0x2000000) {
-    fprintf(stderr, "Invalid input\n");
-    free(pin);
+  runs = 0;
+  start = time_now();
+  do {
+    ds_dec((char *)pin+16, lin-16, pout, lout, 0);
+    runs++;
+    elapsed = time_now() - start;
+  } while (elapsed < 0.1 && runs < 10000);
+  mem_free(pout);
+  matches = stats.offset_classes[0] + stats.offset_classes[1] + stats.offset_classes[2];
+  fprintf(fout, "Compressed: %lu bytes, decompressed: %u bytes, ratio: %.2f\n", (unsigned long)lin-16, (unsigned)lout, lin > 16 ? (double)lout / (lin-16) : 0.0);
+  fprintf(fout, "Bits per byte: %.3f (%llu bits)\n", lout ? (double)stats.bits / lout : 0.0, (unsigned long long)stats.bits);
+  fprintf(fout, "Decode time: %.3f ms, %.3f ms/MB (%u runs)\n", elapsed * 1e3 / runs, lout ? elapsed * 1e3 / runs / (lout / 1048576.0) : 0.0, runs);
+  fprintf(fout, "Literals: %u (%llu bits), 0-127: %u, 128-255: %u\n", (unsigned)(stats.literals[0] + stats.literals[1]), (unsigned long long)stats.literal_bits, (unsigned)stats.literals[0], (unsigned)stats.literals[1]);
+  fprintf(fout, "Matches: %u (%llu bits, %llu bytes), 6 bit offset: %u, 8 bit offset: %u, 12 bit offset: %u\n", (unsigned)matches, (unsigned long long)stats.match_bits, (unsigned long long)stats.match_bytes, (unsigned)stats.offset_classes[0], (unsigned)stats.offset_classes[1], (unsigned)stats.offset_classes[2]);
+  fprintf(fout, "Syncs: %u (%llu bits)\n", (unsigned)stats.syncs, (unsigned long long)stats.sync_bits);
+  analyze_histogram(fout, "Match lengths", stats.lengths, DS_STATS_LENGTHS);
+  analyze_histogram(fout, "Match offsets", stats.offsets, DS_STATS_OFFSETS);
+  return 0;
+}
+
+/* --stream, parser prints every class as soon as it is parsed, see bmfparse.c */
+static int stream_classes;
+
+/* Raw output has no classes, parser provides --stream */
+static int stream_supported(void) {
+  return 0;
+}
+
+#undef stream_supported
+static int stream_supported(void);
+
+static int process_data(char *data, uint32_t size, FILE *fout) {
+  size_t ret = fwrite(data, 1, size, fout);
+  return (ret == size) ? 0 : 1;
+}
+
+#undef process_data
+static int process_data(char *data, uint32_t size, FILE *fout);
+
+/*
+ * Validate decompressed data without producing any output. Returns zero
+ * for valid data, otherwise stores offset of invalid data into offset.
+ */
+static int check_data(char *data, uint32_t size, uint32_t *offset) {
+  (void)data;
+  (void)size;
+  (void)offset;
+  return 0;
+}
+
+#undef check_data
+static int check_data(char *data, uint32_t size, uint32_t *offset);
+
+/*
+ * Process data like process_data() for --dedupe and store its unique parts
+ * into dir. Returns malloc()ed space separated list of hashes of all parts
+ * or NULL on error.
+ */
+static char *dedupe_data(char *data, uint32_t size, FILE *fout, const char *dir) {
+  (void)dir;
+  if (process_data(data, size, fout) != 0)
+    return NULL;
+  return strdup("");
+}
+
+#undef dedupe_data
+static char *dedupe_data(char *data, uint32_t size, FILE *fout, const char *dir);
+
+/* Output formats which can be written at once by --raw, --mof, --dump and --json */
+enum output_format {
+  OUTPUT_RAW,
+  OUTPUT_MOF,
+  OUTPUT_DUMP,
+  OUTPUT_JSON,
+  OUTPUT_COUNT,
+};
+
+static const struct {
+  const char *name;
+  const char *description;
+} output_formats[OUTPUT_COUNT] = {
+  [OUTPUT_RAW] = { "raw", "decompressed data" },
+  [OUTPUT_MOF] = { "mof", "MOF source" },
+  [OUTPUT_DUMP] = { "dump", "structured dump" },
+  [OUTPUT_JSON] = { "json", "JSON" },
+};
+
+static int output_supported(enum output_format format) {
+  return format == OUTPUT_RAW;
+}
+
+#undef output_supported
+static int output_supported(enum output_format format);
+
+/*
+ * Write decompressed data in every format which has file in outputs (other
+ * are NULL), data are decompressed and parsed only once for all formats.
+ */
+static int process_outputs(char *data, uint32_t size, FILE *outputs[OUTPUT_COUNT]) {
+  if (!outputs[OUTPUT_RAW])
+    return 0;
+  return (fwrite(data, 1, size, outputs[OUTPUT_RAW]) == size) ? 0 : 1;
+}
+
+#undef process_outputs
+static int process_outputs(char *data, uint32_t size, FILE *outputs[OUTPUT_COUNT]);
+
+/* File processed by --batch pipeline, see batch_files() */
+struct batch_item {
+  const char *name;
+  uint32_t *input;
+  size_t input_size;
+  char *data;
+  uint32_t data_size;
+  uint32_t lout;
+  void *parsed;
+  int failed;
+  int end;
+};
+
+/*
+ * Stages of --batch. Decompressed item is parsed by parse_item() in parse
+ * thread, printed by print_item() in print thread and then released by
+ * release_item() in parse thread again, so memory allocated by mem_malloc()
+ * is used only by parse thread.
+ */
+static int parse_item(struct batch_item *item) {
+  (void)item;
+  return 0;
+}
+
+#undef parse_item
+static int parse_item(struct batch_item *item);
+
+static int print_item(struct batch_item *item, FILE *fout) {
+  return (fwrite(item->data, 1, item->lout, fout) == item->lout) ? 0 : 1;
+}
+
+#undef print_item
+static int print_item(struct batch_item *item, FILE *fout);
+
+static void release_item(struct batch_item *item) {
+  (void)item;
+}
+
+#undef release_item
+static void release_item(struct batch_item *item);
+
+/*
+ * Read whole input file into buffer allocated by mem_malloc(). Returns NULL
+ * on error. Name is used only for error messages.
+ */
+static uint32_t *read_input(FILE *fin, const char *name, size_t *lin) {
+  uint32_t *pin;
+  long sin;
+  if (fseek(fin, 0, SEEK_END) == 0) {
+    sin = ftell(fin);
+    if (sin < 0) {
+      fprintf(stderr, "Cannot determinate size of input file %s: %s\n", name, strerror(errno));
+      return NULL;
+    }
+    ++sin;
+    rewind(fin);
+    if (sin > 0x800000) {
+      fprintf(stderr, "Size of input file %s too large\n", name);
+      return NULL;
+    }
+  } else {
+    sin = 0x800000;
+  }
+  pin = mem_malloc(sin);
+  if (!pin) {
+    fprintf(stderr, "Cannot allocate memory for input file %s\n", name);
+    return NULL;
+  }
+  *lin = fread(pin, 1, sin, fin);
+  if (ferror(fin)) {
+    fprintf(stderr, "Failed to read data from input file %s\n", name);
+    mem_free(pin);
+    return NULL;
+  } else if (!feof(fin)) {
+    fprintf(stderr, "Data too large in input file %s\n", name);
+    mem_free(pin);
+    return NULL;
+  }
+  return pin;
+}
+
+/* 64-bit FNV-1a hash, hash_update() continues hash computed so far */
+#define HASH_INIT 0xCBF29CE484222325ULL
+
+static uint64_t hash_update(uint64_t hash, const void *data, size_t size) {
+  const uint8_t *ptr = data;
+  size_t i;
+  for (i = 0; i < size; ++i) {
+    hash ^= ptr[i];
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+static uint64_t hash_data(const void *data, size_t size) {
+  return hash_update(HASH_INIT, data, size);
+}
+
+/* Map from 64-bit hash to malloc()ed string, open addressing */
+struct hash_map_entry {
+  uint64_t hash;
+  char *value;
+  int used;
+};
+
+struct hash_map {
+  size_t count;
+  size_t size;
+  struct hash_map_entry *entries;
+};
+
+static struct hash_map_entry *hash_map_find(struct hash_map *map, uint64_t hash) {
+  size_t i;
+  if (!map->size)
+    return NULL;
+  for (i = hash & (map->size-1); map->entries[i].used; i = (i+1) & (map->size-1)) {
+    if (map->entries[i].hash == hash)
+      return &map->entries[i];
+  }
+  return NULL;
+}
+
+/*
+ * Returns new entry with NULL value, or NULL when hash is already in map or
+ * memory cannot be allocated (use hash_map_find() first to distinguish)
+ */
+static struct hash_map_entry *hash_map_add(struct hash_map *map, uint64_t hash) {
+  struct hash_map_entry *entries;
+  size_t size, i, j;
+  if (hash_map_find(map, hash))
+    return NULL;
+  if (2 * (map->count+1) > map->size) {
+    size = map->size ? 2 * map->size : 64;
+    entries = calloc(size, sizeof(*entries));
+    if (!entries)
+      return NULL;
+    for (i = 0; i < map->size; ++i) {
+      if (!map->entries[i].used)
+        continue;
+      for (j = map->entries[i].hash & (size-1); entries[j].used; j = (j+1) & (size-1));
+      entries[j] = map->entries[i];
+    }
+    free(map->entries);
+    map->entries = entries;
+    map->size = size;
+  }
+  for (i = hash & (map->size-1); map->entries[i].used; i = (i+1) & (map->size-1));
+  map->entries[i].hash = hash;
+  map->entries[i].used = 1;
+  map->count++;
+  return &map->entries[i];
+}
+
+static void hash_map_free(struct hash_map *map) {
+  size_t i;
+  for (i = 0; i < map->size; ++i)
+    free(map->entries[i].value);
+  free(map->entries);
+  memset(map, 0, sizeof(*map));
+}
+
+/*
+ * Seek index for DS compressed data, similar to zran for gzip. Entry is
+ * stored at first sync after every DS_INDEX_STEP bytes of output and has
+ * bit position of next token, output position and DS_WINDOW bytes of
+ * output before it, which back-references after sync can use. Byte range
+ * is then decompressed from the nearest entry instead of start of data.
+ * Index file format (native byte order): u32 magic, u32 version,
+ * u64 hash of BMF file, u32 output size, u32 count and count entries of
+ * u32 bit position, u32 output position and window.
+ */
+#define DS_WINDOW 4415
+#define DS_INDEX_STEP 0x10000
+#define DS_INDEX_MAGIC 0x49464D42
+#define DS_INDEX_VERSION 1
+
+struct ds_index_entry {
+  uint32_t bitpos;
+  uint32_t outpos;
+};
+
+struct ds_index {
+  uint64_t hash;
+  uint32_t lout;
+  uint32_t count;
+  struct ds_index_entry *entries;
+  unsigned char *windows; /* DS_WINDOW bytes for every entry */
+};
+
+static void ds_index_free(struct ds_index *index) {
+  mem_free(index->entries);
+  mem_free(index->windows);
+  memset(index, 0, sizeof(*index));
+}
+
+static int ds_index_alloc(struct ds_index *index, uint32_t count) {
+  index->entries = mem_malloc(count * sizeof(*index->entries));
+  index->windows = mem_malloc((size_t)count * DS_WINDOW);
+  if (!index->entries || !index->windows) {
+    ds_index_free(index);
     return 1;
   }
-  pout = malloc(lout);
+  return 0;
+}
+
+/* Decode whole DS data and build index, returns zero on success */
+static int ds_index_build(void *pin, int lin, uint32_t lout, struct ds_index *index) {
+  struct ds_chunk chunk;
+  struct ds_index_entry *entry;
+  unsigned char *window;
+  bits_t bits;
+  size_t next = DS_INDEX_STEP;
+  size_t size;
+  int ret;
+  index->lout = lout;
+  index->count = 0;
+  if (ds_index_alloc(index, lout / DS_INDEX_STEP + 1))
+    return 1;
+  /* whole output is decoded into chunk buffer, which is not allocated by mem_malloc() */
+  if (!mem_reserve(lout)) {
+    ds_index_free(index);
+    return 1;
+  }
+  memset(&chunk, 0, sizeof(chunk));
+  chunk.pin = pin;
+  chunk.lin = lin;
+  chunk.lout = lout;
+  chunk.last_sync = (size_t)-1;
+  /* first entry is start of data after DS header */
+  index->entries[0].bitpos = 32;
+  index->entries[0].outpos = 0;
+  memset(index->windows, 0, DS_WINDOW);
+  index->count = 1;
+  ds_bits_at(&bits, pin, lin, 32);
+  while ((ret = ds_chunk_decode(&chunk, &bits, 1)) == 0 && chunk.last_was_sync) {
+    if (chunk.out_len < next || chunk.out_len >= lout)
+      continue;
+    entry = &index->entries[index->count];
+    entry->bitpos = ds_bits_pos(&bits, pin);
+    entry->outpos = chunk.out_len;
+    window = index->windows + (size_t)index->count * DS_WINDOW;
+    size = chunk.out_len < DS_WINDOW ? chunk.out_len : DS_WINDOW;
+    memset(window, 0, DS_WINDOW - size);
+    memcpy(window + DS_WINDOW - size, chunk.out + chunk.out_len - size, size);
+    index->count++;
+    next = chunk.out_len + DS_INDEX_STEP;
+  }
+  free(chunk.out);
+  free(chunk.unknown);
+  free(chunk.patches);
+  /* same condition as in ds_dec(): output is full and followed by sync */
+  if (ret == -1 || chunk.last_sync != lout || chunk.patches_count) {
+    ds_index_free(index);
+    return 1;
+  }
+  return 0;
+}
+
+/* Decompress size bytes at offset of output using index, returns zero on success */
+static int ds_dec_range(void *pin, int lin, struct ds_index *index, char *pout, uint32_t offset, uint32_t size) {
+  struct ds_chunk chunk;
+  struct ds_index_entry *entry;
+  unsigned char *buf;
+  size_t i, j, d, len, window;
+  uint32_t lo = 0, hi = index->count;
+  if (offset > index->lout || size > index->lout - offset || index->count == 0)
+    return 1;
+  /* last entry before offset */
+  while (hi - lo > 1) {
+    if (index->entries[(lo + hi) / 2].outpos <= offset)
+      lo = (lo + hi) / 2;
+    else
+      hi = (lo + hi) / 2;
+  }
+  entry = &index->entries[lo];
+  window = entry->outpos < DS_WINDOW ? entry->outpos : DS_WINDOW;
+  len = offset + size - entry->outpos;
+  memset(&chunk, 0, sizeof(chunk));
+  chunk.pin = pin;
+  chunk.lin = lin;
+  /* last token can be longer than needed, copy has at most 512 bytes */
+  chunk.lout = index->lout - entry->outpos;
+  if (chunk.lout > len + 1024)
+    chunk.lout = len + 1024;
+  /* chunk buffer is not allocated by mem_malloc(), check it after buf */
+  buf = mem_malloc(DS_WINDOW + len);
+  if (!buf || !mem_reserve(chunk.lout)) {
+    mem_free(buf);
+    return 1;
+  }
+  ds_chunk_run(&chunk, entry->bitpos, 0);
+  if (chunk.ret == -1 || chunk.out_len < len)
+    goto err;
+  memcpy(buf, index->windows + (size_t)lo * DS_WINDOW, DS_WINDOW);
+  memcpy(buf + DS_WINDOW, chunk.out, len);
+  for (i = 0; i < chunk.patches_count && chunk.patches[i].dst < len; ++i) {
+    d = DS_WINDOW + chunk.patches[i].dst;
+    if (d - chunk.patches[i].off < DS_WINDOW - window)
+      goto err;
+    for (j = 0; j < chunk.patches[i].len && d < DS_WINDOW + len; ++j, ++d)
+      buf[d] = buf[d-chunk.patches[i].off];
+  }
+  memcpy(pout, buf + DS_WINDOW + offset - entry->outpos, size);
+  mem_free(buf);
+  free(chunk.out);
+  free(chunk.unknown);
+  free(chunk.patches);
+  return 0;
+err:
+  mem_free(buf);
+  free(chunk.out);
+  free(chunk.unknown);
+  free(chunk.patches);
+  return 1;
+}
+
+static int ds_index_save(struct ds_index *index, const char *file) {
+  char tmpfile[4096];
+  uint32_t header[6];
+  uint32_t i;
+  FILE *fout;
+  int ret = 0;
+  if ((size_t)snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", file) >= sizeof(tmpfile)) {
+    fprintf(stderr, "Index file name %s too long\n", file);
+    return 1;
+  }
+  fout = fopen(tmpfile, "wb");
+  if (!fout) {
+    fprintf(stderr, "Cannot open index file %s: %s\n", tmpfile, strerror(errno));
+    return 1;
+  }
+  header[0] = DS_INDEX_MAGIC;
+  header[1] = DS_INDEX_VERSION;
+  memcpy(&header[2], &index->hash, sizeof(index->hash));
+  header[4] = index->lout;
+  header[5] = index->count;
+  fwrite(header, sizeof(header), 1, fout);
+  for (i = 0; i < index->count; ++i) {
+    fwrite(&index->entries[i], sizeof(index->entries[i]), 1, fout);
+    fwrite(index->windows + (size_t)i * DS_WINDOW, DS_WINDOW, 1, fout);
+  }
+  if (ferror(fout) | (fclose(fout) != 0) || rename(tmpfile, file) != 0) {
+    fprintf(stderr, "Cannot write index file %s: %s\n", file, strerror(errno));
+    ret = 1;
+  }
+  return ret;
+}
+
+/* Load index, returns zero when it exists and belongs to BMF file with hash */
+static int ds_index_load(struct ds_index *index, const char *file, uint64_t hash, uint32_t lout) {
+  uint32_t header[6];
+  uint32_t i;
+  FILE *fin;
+  int ret = 1;
+  memset(index, 0, sizeof(*index));
+  fin = fopen(file, "rb");
+  if (!fin)
+    return 1;
+  if (fread(header, sizeof(header), 1, fin) != 1 || header[0] != DS_INDEX_MAGIC || header[1] != DS_INDEX_VERSION || header[4] != lout || header[5] == 0 || header[5] > lout / DS_INDEX_STEP + 1)
+    goto out;
+  memcpy(&index->hash, &header[2], sizeof(index->hash));
+  if (index->hash != hash || ds_index_alloc(index, header[5]))
+    goto out;
+  index->lout = lout;
+  index->count = header[5];
+  for (i = 0; i < index->count; ++i) {
+    if (fread(&index->entries[i], sizeof(index->entries[i]), 1, fin) != 1 || fread(index->windows + (size_t)i * DS_WINDOW, DS_WINDOW, 1, fin) != 1)
+      goto out;
+    if (index->entries[i].outpos > lout || (i > 0 && index->entries[i].outpos <= index->entries[i-1].outpos))
+      goto out;
+  }
+  ret = 0;
+out:
+  if (ret)
+    ds_index_free(index);
+  fclose(fin);
+  return ret;
+}
+
+/*
+ * Load index from file or build it when file is missing or belongs to
+ * other BMF file. Returns zero on success.
+ */
+static int load_index(uint32_t *pin, size_t lin, const char *file, struct ds_index *index) {
+  uint32_t lout;
+  uint64_t hash;
+  memset(index, 0, sizeof(*index));
+  if (check_header(pin, lin, &lout))
+    return 1;
+  hash = hash_data(pin, lin);
+  if (ds_index_load(index, file, hash, lout) == 0)
+    return 0;
+  if (ds_index_build((char *)pin+16, lin-16, lout, index)) {
+    fprintf(stderr, "Decompress failed\n");
+    return 1;
+  }
+  index->hash = hash;
+  return ds_index_save(index, file);
+}
+
+/*
+ * Decompress only range of data, with index file when specified. Returns
+ * buffer allocated by mem_malloc() or NULL on error.
+ */
+static char *decompress_range(uint32_t *pin, size_t lin, const char *file, uint32_t offset, uint32_t size) {
+  struct ds_index index;
+  uint32_t lout;
+  char *pout;
+  char *data;
+  if (!file) {
+    data = decompress_data(pin, lin, &lout);
+    if (!data)
+      return NULL;
+    if (offset > lout || size > lout - offset) {
+      fprintf(stderr, "Range is outside of data\n");
+      mem_free(data);
+      return NULL;
+    }
+    memmove(data, data + offset, size);
+    return data;
+  }
+  if (load_index(pin, lin, file, &index))
+    return NULL;
+  if (offset > index.lout || size > index.lout - offset) {
+    fprintf(stderr, "Range is outside of data\n");
+    ds_index_free(&index);
+    return NULL;
+  }
+  pout = mem_malloc(size ? size : 1);
   if (!pout) {
     fprintf(stderr, "Cannot allocate memory for decompression\n");
-    free(pin);
-    return 1;
+    ds_index_free(&index);
+    return NULL;
   }
-  if (ds_dec((char *)pin+16, lin-16, pout, lout, 0) != (int)lout) {
+  if (ds_dec_range((char *)pin+16, lin-16, &index, pout, offset, size)) {
     fprintf(stderr, "Decompress failed\n");
+    mem_free(pout);
+    pout = NULL;
+  }
+  ds_index_free(&index);
+  return pout;
+}
+
+/*
+ * Scanner for WMI devices in sysfs. Every directory entry of root which
+ * contains bmof file is decompressed and processed into file with the
+ * same name in output directory. State file remembers size, mtime and
+ * hash of already processed bmof files, so unchanged devices are skipped
+ * on next run. Line format: size mtime_sec mtime_nsec hash name
+ */
+
+struct scan_entry {
+  char *name;
+  unsigned long long size;
+  long long mtime_sec;
+  long mtime_nsec;
+  uint64_t hash;
+  int seen;
+};
+
+struct scan_state {
+  uint32_t count;
+  uint32_t alloc;
+  struct scan_entry *entries;
+};
+
+static struct scan_entry *scan_state_add(struct scan_state *state, const char *name) {
+  struct scan_entry *entries;
+  if (state->count == state->alloc) {
+    entries = realloc(state->entries, (state->alloc ? 2 * state->alloc : 16) * sizeof(*entries));
+    if (!entries)
+      return NULL;
+    state->alloc = state->alloc ? 2 * state->alloc : 16;
+    state->entries = entries;
+  }
+  entries = &state->entries[state->count];
+  memset(entries, 0, sizeof(*entries));
+  entries->name = strdup(name);
+  if (!entries->name)
+    return NULL;
+  state->count++;
+  return entries;
+}
+
+static struct scan_entry *scan_state_find(struct scan_state *state, const char *name) {
+  uint32_t i;
+  for (i = 0; i < state->count; ++i) {
+    if (strcmp(state->entries[i].name, name) == 0)
+      return &state->entries[i];
+  }
+  return NULL;
+}
+
+static void scan_state_load(struct scan_state *state, const char *file) {
+  struct scan_entry *entry;
+  struct scan_entry tmp;
+  unsigned long long hash;
+  char line[4096];
+  FILE *fin;
+  int pos;
+  fin = fopen(file, "r");
+  if (!fin)
+    return;
+  while (fgets(line, sizeof(line), fin)) {
+    line[strcspn(line, "\n")] = 0;
+    if (sscanf(line, "%llu %lld %ld %llx %n", &tmp.size, &tmp.mtime_sec, &tmp.mtime_nsec, &hash, &pos) != 4 || !line[pos])
+      continue;
+    entry = scan_state_add(state, line + pos);
+    if (!entry)
+      break;
+    entry->size = tmp.size;
+    entry->mtime_sec = tmp.mtime_sec;
+    entry->mtime_nsec = tmp.mtime_nsec;
+    entry->hash = hash;
+  }
+  fclose(fin);
+}
+
+static int scan_state_save(struct scan_state *state, const char *file) {
+  char tmpfile[4096];
+  FILE *fout;
+  uint32_t i;
+  int ret = 0;
+  if ((size_t)snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", file) >= sizeof(tmpfile)) {
+    fprintf(stderr, "State file name %s too long\n", file);
+    return 1;
+  }
+  fout = fopen(tmpfile, "w");
+  if (!fout) {
+    fprintf(stderr, "Cannot open state file %s: %s\n", tmpfile, strerror(errno));
+    return 1;
+  }
+  for (i = 0; i < state->count; ++i) {
+    if (!state->entries[i].seen)
+      continue;
+    fprintf(fout, "%llu %lld %ld %016llx %s\n", state->entries[i].size, state->entries[i].mtime_sec, state->entries[i].mtime_nsec, (unsigned long long)state->entries[i].hash, state->entries[i].name);
+  }
+  if (fclose(fout) != 0 || rename(tmpfile, file) != 0) {
+    fprintf(stderr, "Cannot write state file %s: %s\n", file, strerror(errno));
+    ret = 1;
+  }
+  return ret;
+}
+
+static void scan_state_free(struct scan_state *state) {
+  uint32_t i;
+  for (i = 0; i < state->count; ++i)
+    free(state->entries[i].name);
+  free(state->entries);
+}
+
+static int scan_device(const char *root, const char *name, const char *outdir, struct scan_state *state) {
+  struct scan_entry *entry;
+  struct stat st;
+  char path[4096];
+  FILE *fin;
+  FILE *fout;
+  uint32_t *pin;
+  char *pout;
+  size_t lin;
+  uint32_t lout;
+  uint64_t hash;
+  int ret;
+  if ((size_t)snprintf(path, sizeof(path), "%s/%s/bmof", root, name) >= sizeof(path))
+    return 0;
+  if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+    return 0;
+  entry = scan_state_find(state, name);
+  if (entry && entry->size == (unsigned long long)st.st_size && entry->mtime_sec == (long long)st.st_mtim.tv_sec && entry->mtime_nsec == st.st_mtim.tv_nsec) {
+    entry->seen = 1;
+    return 0;
+  }
+  fin = fopen(path, "rb");
+  if (!fin) {
+    fprintf(stderr, "Cannot open input file %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  diag_begin(path);
+  pin = read_input(fin, path, &lin);
+  fclose(fin);
+  if (!pin)
+    return 1;
+  hash = hash_data(pin, lin);
+  if (!entry || entry->hash != hash) {
+    pout = decompress_data(pin, lin, &lout);
+    mem_free(pin);
+    diag_flush();
+    if (!pout)
+      return 1;
+    if ((size_t)snprintf(path, sizeof(path), "%s/%s", outdir, name) >= sizeof(path)) {
+      mem_free_all();
+      return 1;
+    }
+    fout = fopen(path, "wb");
+    if (!fout) {
+      fprintf(stderr, "Cannot open output file %s: %s\n", path, strerror(errno));
+      mem_free_all();
+      return 1;
+    }
+    ret = process_data(pout, lout, fout);
+    mem_free_all();
+    diag_flush();
+    if (fclose(fout) != 0)
+      ret = 1;
+    if (ret) {
+      fprintf(stderr, "Failed to process %s/%s/bmof\n", root, name);
+      remove(path);
+      return 1;
+    }
+  } else {
+    mem_free(pin);
+  }
+  if (!entry) {
+    entry = scan_state_add(state, name);
+    if (!entry) {
+      fprintf(stderr, "Cannot allocate memory for state\n");
+      return 1;
+    }
+  }
+  entry->size = st.st_size;
+  entry->mtime_sec = st.st_mtim.tv_sec;
+  entry->mtime_nsec = st.st_mtim.tv_nsec;
+  entry->hash = hash;
+  entry->seen = 1;
+  return 0;
+}
+
+static int scan_devices(const char *root, const char *statefile, const char *outdir) {
+  struct scan_state state;
+  struct dirent *dirent;
+  DIR *dir;
+  int ret = 0;
+  memset(&state, 0, sizeof(state));
+  dir = opendir(root);
+  if (!dir) {
+    fprintf(stderr, "Cannot open directory %s: %s\n", root, strerror(errno));
+    return 1;
+  }
+  if (statefile)
+    scan_state_load(&state, statefile);
+  while ((dirent = readdir(dir)) != NULL) {
+    if (dirent->d_name[0] == '.')
+      continue;
+    if (scan_device(root, dirent->d_name, outdir, &state))
+      ret = 1;
+  }
+  closedir(dir);
+  if (statefile && scan_state_save(&state, statefile))
+    ret = 1;
+  scan_state_free(&state);
+  return ret;
+}
+
+/*
+ * Deduplication of input files for --dedupe. Every unique decompressed
+ * file is processed by dedupe_data() into dir/blobs/<hash> and its unique
+ * parts (classes) are stored into dir/classes/<hash>. File dir/manifest
+ * contains for every input file line: name raw_hash data_hash part_hashes...
+ */
+static int dedupe_files(const char *dir, int count, char *files[]) {
+  struct hash_map raw_map;
+  struct hash_map data_map;
+  struct hash_map_entry *entry;
+  char path[4096];
+  FILE *manifest;
+  FILE *fin;
+  FILE *fout;
+  uint32_t *pin;
+  char *pout;
+  char *parts;
+  size_t lin;
+  uint32_t lout;
+  uint64_t raw_hash;
+  uint64_t data_hash;
+  int ret = 0;
+  int i;
+  memset(&raw_map, 0, sizeof(raw_map));
+  memset(&data_map, 0, sizeof(data_map));
+  snprintf(path, sizeof(path), "%s/blobs", dir);
+  if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Cannot create directory %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  snprintf(path, sizeof(path), "%s/classes", dir);
+  if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Cannot create directory %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  snprintf(path, sizeof(path), "%s/manifest", dir);
+  manifest = fopen(path, "w");
+  if (!manifest) {
+    fprintf(stderr, "Cannot open manifest file %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  for (i = 0; i < count; ++i) {
+    fin = fopen(files[i], "rb");
+    if (!fin) {
+      fprintf(stderr, "Cannot open input file %s: %s\n", files[i], strerror(errno));
+      ret = 1;
+      continue;
+    }
+    diag_begin(files[i]);
+    pin = read_input(fin, files[i], &lin);
+    fclose(fin);
+    if (!pin) {
+      ret = 1;
+      continue;
+    }
+    raw_hash = hash_data(pin, lin);
+    entry = hash_map_find(&raw_map, raw_hash);
+    if (entry) {
+      mem_free(pin);
+      fprintf(manifest, "%s %016llx %s\n", files[i], (unsigned long long)raw_hash, entry->value);
+      continue;
+    }
+    pout = decompress_data(pin, lin, &lout);
+    mem_free(pin);
+    diag_flush();
+    if (!pout) {
+      fprintf(manifest, "%s %016llx error\n", files[i], (unsigned long long)raw_hash);
+      ret = 1;
+      continue;
+    }
+    data_hash = hash_data(pout, lout);
+    entry = hash_map_find(&data_map, data_hash);
+    if (entry) {
+      parts = strdup(entry->value);
+      if (!parts) {
+        mem_free_all();
+        fprintf(stderr, "Cannot allocate memory for hash map\n");
+        ret = 1;
+        break;
+      }
+    } else {
+      snprintf(path, sizeof(path), "%s/blobs/%016llx", dir, (unsigned long long)data_hash);
+      fout = fopen(path, "wb");
+      if (!fout) {
+        fprintf(stderr, "Cannot open output file %s: %s\n", path, strerror(errno));
+        parts = NULL;
+      } else {
+        parts = dedupe_data(pout, lout, fout, dir);
+        diag_flush();
+        if (fclose(fout) != 0) {
+          free(parts);
+          parts = NULL;
+        }
+        if (!parts)
+          remove(path);
+      }
+      if (!parts) {
+        mem_free_all();
+        fprintf(stderr, "Failed to process %s\n", files[i]);
+        fprintf(manifest, "%s %016llx error\n", files[i], (unsigned long long)raw_hash);
+        ret = 1;
+        continue;
+      }
+      entry = hash_map_add(&data_map, data_hash);
+      if (entry)
+        entry->value = strdup(parts);
+      if (!entry || !entry->value) {
+        mem_free_all();
+        free(parts);
+        fprintf(stderr, "Cannot allocate memory for hash map\n");
+        ret = 1;
+        break;
+      }
+    }
+    mem_free_all();
+    entry = hash_map_add(&raw_map, raw_hash);
+    if (entry)
+      entry->value = malloc(16 + 1 + strlen(parts) + 1);
+    if (!entry || !entry->value) {
+      free(parts);
+      fprintf(stderr, "Cannot allocate memory for hash map\n");
+      ret = 1;
+      break;
+    }
+    sprintf(entry->value, "%016llx%s%s", (unsigned long long)data_hash, parts[0] ? " " : "", parts);
+    fprintf(manifest, "%s %016llx %s\n", files[i], (unsigned long long)raw_hash, entry->value);
+    free(parts);
+  }
+  if (fclose(manifest) != 0) {
+    fprintf(stderr, "Cannot write manifest file: %s\n", strerror(errno));
+    ret = 1;
+  }
+  hash_map_free(&raw_map);
+  hash_map_free(&data_map);
+  return ret;
+}
+
+/*
+ * Pipeline for --batch. Files are decompressed by decode thread, parsed by
+ * parse thread and printed to stdout by main thread, so while one file is
+ * printed the next ones are parsed and decompressed. Fixed pool of
+ * BATCH_ITEMS items circulates through lock-free single producer single
+ * consumer queues: decode -> parse -> print -> parse (release) -> decode.
+ * Buffers of items are reused for next files and all queues are FIFO, so
+ * output is in order of input files. Memory limit is shared by documents
+ * in flight.
+ */
+#define BATCH_ITEMS 4
+#define BATCH_QUEUE_SIZE 8 /* power of two, at least BATCH_ITEMS */
+
+struct batch_queue {
+  struct batch_item *items[BATCH_QUEUE_SIZE];
+  _Atomic unsigned head; /* written only by consumer */
+  _Atomic unsigned tail; /* written only by producer */
+};
+
+static void batch_queue_push(struct batch_queue *queue, struct batch_item *item) {
+  unsigned tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  /* cannot be full, there are less items than slots */
+  queue->items[tail % BATCH_QUEUE_SIZE] = item;
+  atomic_store_explicit(&queue->tail, tail+1, memory_order_release);
+}
+
+static struct batch_item *batch_queue_pop(struct batch_queue *queue) {
+  unsigned head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  struct batch_item *item;
+  if (head == atomic_load_explicit(&queue->tail, memory_order_acquire))
+    return NULL;
+  item = queue->items[head % BATCH_QUEUE_SIZE];
+  atomic_store_explicit(&queue->head, head+1, memory_order_release);
+  return item;
+}
+
+/* Back off while waiting for other stage, spin first and then sleep */
+static void batch_wait(unsigned *spins) {
+  struct timespec ts = { 0, 50000 };
+  if ((*spins)++ < 64)
+    sched_yield();
+  else
+    nanosleep(&ts, NULL);
+}
+
+static struct batch_item *batch_queue_wait(struct batch_queue *queue) {
+  struct batch_item *item;
+  unsigned spins = 0;
+  while (!(item = batch_queue_pop(queue)))
+    batch_wait(&spins);
+  return item;
+}
+
+/* Result of read_file() */
+enum read_status {
+  READ_OK,
+  READ_OPEN,
+  READ_INVALID,
+  READ_ALLOC,
+  READ_FAILED,
+};
+
+/*
+ * Read whole regular file into malloc() buffer *buf of *size bytes, which is
+ * reallocated when too small. Does not write anything, so it can be called
+ * from reader threads; errors are reported later by read_error().
+ */
+static enum read_status read_file(const char *name, uint32_t **buf, size_t *size, size_t *len, int *err) {
+  struct stat st;
+  ssize_t ret = 0;
+  void *ptr;
+  int fd;
+  *len = 0;
+  fd = open(name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    *err = errno;
+    return READ_OPEN;
+  }
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > 0x4000000) {
+    close(fd);
+    return READ_INVALID;
+  }
+  if ((size_t)st.st_size + 1 > *size) {
+    ptr = realloc(*buf, st.st_size + 1);
+    if (!ptr) {
+      close(fd);
+      return READ_ALLOC;
+    }
+    *buf = ptr;
+    *size = st.st_size + 1;
+  }
+  /* read one byte more to detect file which grew */
+  while (*len < (size_t)st.st_size + 1) {
+    ret = pread(fd, (char *)*buf + *len, st.st_size + 1 - *len, *len);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      break;
+    *len += ret;
+  }
+  close(fd);
+  if (ret < 0 || *len != (size_t)st.st_size)
+    return READ_FAILED;
+  return READ_OK;
+}
+
+static void read_error(const char *name, enum read_status status, int err) {
+  switch (status) {
+  case READ_OK:
+    break;
+  case READ_OPEN:
+    fprintf(stderr, "Cannot open input file %s: %s\n", name, strerror(err));
+    break;
+  case READ_INVALID:
+    fprintf(stderr, "Cannot read input file %s\n", name);
+    break;
+  case READ_ALLOC:
+    fprintf(stderr, "Cannot allocate memory for input file %s\n", name);
+    break;
+  case READ_FAILED:
+    fprintf(stderr, "Failed to read data from input file %s\n", name);
+    break;
+  }
+}
+
+/*
+ * Read ahead for --batch. Pool of reader threads keeps up to queue depth
+ * files read in advance, so decode thread does not wait on I/O latency of
+ * every small file. File i is read into slot i % depth, which is free when
+ * decode thread took file i - depth. Buffers of slots are swapped with
+ * buffers of items, so data are not copied.
+ */
+#define BATCH_QUEUE_DEPTH 16
+#define BATCH_QUEUE_DEPTH_MAX 256
+
+static int batch_queue_depth = BATCH_QUEUE_DEPTH;
+
+struct batch_read {
+  uint32_t *buf;
+  size_t size;
+  size_t len;
+  enum read_status status;
+  int err;
+  int ready;
+};
+
+struct batch_reader {
+  pthread_mutex_t lock;
+  pthread_cond_t space; /* slot became free */
+  pthread_cond_t ready; /* slot was read */
+  struct batch_read *slots;
+  pthread_t *threads;
+  int threads_count;
+  int depth;
+  char **files;
+  int count;
+  int next; /* next file to read */
+  int taken; /* files taken by decode thread */
+};
+
+static void *batch_reader_thread(void *arg) {
+  struct batch_reader *reader = arg;
+  struct batch_read *slot;
+  int i;
+  for (;;) {
+    pthread_mutex_lock(&reader->lock);
+    while (reader->next < reader->count && reader->next >= reader->taken + reader->depth)
+      pthread_cond_wait(&reader->space, &reader->lock);
+    if (reader->next >= reader->count) {
+      pthread_mutex_unlock(&reader->lock);
+      return NULL;
+    }
+    i = reader->next++;
+    /* other waiting readers have nothing more to read */
+    if (reader->next == reader->count)
+      pthread_cond_broadcast(&reader->space);
+    pthread_mutex_unlock(&reader->lock);
+    slot = &reader->slots[i % reader->depth];
+    slot->status = read_file(reader->files[i], &slot->buf, &slot->size, &slot->len, &slot->err);
+    pthread_mutex_lock(&reader->lock);
+    slot->ready = 1;
+    if (i == reader->taken)
+      pthread_cond_signal(&reader->ready);
+    pthread_mutex_unlock(&reader->lock);
+  }
+}
+
+/* Returns NULL when no reader thread could be created, then files are read synchronously */
+static struct batch_reader *batch_reader_start(char **files, int count) {
+  struct batch_reader *reader;
+  int i;
+  reader = calloc(1, sizeof(*reader));
+  if (!reader)
+    return NULL;
+  reader->depth = batch_queue_depth;
+  reader->files = files;
+  reader->count = count;
+  reader->slots = calloc(reader->depth, sizeof(*reader->slots));
+  reader->threads = calloc(reader->depth, sizeof(*reader->threads));
+  if (!reader->slots || !reader->threads) {
+    free(reader->slots);
+    free(reader->threads);
+    free(reader);
+    return NULL;
+  }
+  pthread_mutex_init(&reader->lock, NULL);
+  pthread_cond_init(&reader->space, NULL);
+  pthread_cond_init(&reader->ready, NULL);
+  for (i = 0; i < reader->depth && i < count; ++i) {
+    if (pthread_create(&reader->threads[i], NULL, batch_reader_thread, reader) != 0)
+      break;
+    reader->threads_count++;
+  }
+  if (!reader->threads_count) {
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->space);
+  pthread_cond_destroy(&reader->ready);
+    free(reader->slots);
+    free(reader->threads);
+    free(reader);
+    return NULL;
+  }
+  return reader;
+}
+
+/* Wait until file i is read and swap its buffer with buffer of item */
+static enum read_status batch_reader_take(struct batch_reader *reader, int i, struct batch_item *item, size_t *lin, int *err) {
+  struct batch_read *slot = &reader->slots[i % reader->depth];
+  enum read_status status;
+  uint32_t *buf;
+  size_t size;
+  pthread_mutex_lock(&reader->lock);
+  while (!slot->ready)
+    pthread_cond_wait(&reader->ready, &reader->lock);
+  pthread_mutex_unlock(&reader->lock);
+  buf = item->input;
+  size = item->input_size;
+  item->input = slot->buf;
+  item->input_size = slot->size;
+  slot->buf = buf;
+  slot->size = size;
+  *lin = slot->len;
+  *err = slot->err;
+  status = slot->status;
+  pthread_mutex_lock(&reader->lock);
+  slot->ready = 0;
+  reader->taken++;
+  pthread_cond_signal(&reader->space);
+  pthread_mutex_unlock(&reader->lock);
+  return status;
+}
+
+static void batch_reader_stop(struct batch_reader *reader) {
+  int i;
+  if (!reader)
+    return;
+  for (i = 0; i < reader->threads_count; ++i)
+    pthread_join(reader->threads[i], NULL);
+  for (i = 0; i < reader->depth; ++i)
+    free(reader->slots[i].buf);
+  pthread_mutex_destroy(&reader->lock);
+  pthread_cond_destroy(&reader->space);
+  pthread_cond_destroy(&reader->ready);
+  free(reader->slots);
+  free(reader->threads);
+  free(reader);
+}
+
+struct batch {
+  struct batch_item items[BATCH_ITEMS];
+  struct batch_queue free;
+  struct batch_queue decoded;
+  struct batch_queue parsed;
+  struct batch_queue printed;
+  struct batch_reader *reader;
+  char **files;
+  int count;
+  int in_print;
+};
+
+/* Read file i (or take it from reader) and decompress it into item buffers, uses only malloc() */
+static void decode_item(struct batch *batch, int i, struct batch_item *item) {
+  enum read_status status;
+  void *ptr;
+  int ret;
+  size_t lin = 0;
+  int err = 0;
+  item->name = batch->files[i];
+  item->failed = 1;
+  if (batch->reader)
+    status = batch_reader_take(batch->reader, i, item, &lin, &err);
+  else
+    status = read_file(item->name, &item->input, &item->input_size, &lin, &err);
+  if (status != READ_OK) {
+    read_error(item->name, status, err);
+    return;
+  }
+  if (check_header(item->input, lin, &item->lout))
+    return;
+  if (memory_limit && item->lout > memory_limit) {
+    fprintf(stderr, "Memory limit exceeded\n");
+    return;
+  }
+  if (data_limit && item->lout > data_limit) {
+    fprintf(stderr, "Data limit exceeded\n");
+    return;
+  }
+  if (item->lout > item->data_size || !item->data) {
+    ptr = realloc(item->data, item->lout ? item->lout : 1);
+    if (!ptr) {
+      fprintf(stderr, "Cannot allocate memory for decompression\n");
+      return;
+    }
+    item->data = ptr;
+    item->data_size = item->lout;
+  }
+  decode_deadline = budget_deadline(decode_time_limit);
+  ret = ds_dec_parallel((char *)item->input+16, lin-16, item->data, item->lout, 0, decompress_threads);
+  if (ret != (int)item->lout) {
+    /* only decoder knows whether it stopped because of time limit */
+    fprintf(stderr, ret == -3 ? "Decompress time limit exceeded\n" : "Decompress failed\n");
+    decode_deadline = 0;
+    return;
+  }
+  decode_deadline = 0;
+  item->failed = 0;
+}
+
+static void *batch_decode_thread(void *arg) {
+  struct batch *batch = arg;
+  struct batch_item *item;
+  int i;
+  for (i = 0; i <= batch->count; ++i) {
+    item = batch_queue_wait(&batch->free);
+    item->end = (i == batch->count);
+    if (!item->end)
+      decode_item(batch, i, item);
+    batch_queue_push(&batch->decoded, item);
+  }
+  return NULL;
+}
+
+/* Release printed items, returns 1 when end marker came back */
+static int batch_release(struct batch *batch) {
+  struct batch_item *item;
+  while ((item = batch_queue_pop(&batch->printed))) {
+    batch->in_print--;
+    if (item->end)
+      return 1;
+    release_item(item);
+    batch_queue_push(&batch->free, item);
+  }
+  return 0;
+}
+
+static void *batch_parse_thread(void *arg) {
+  struct batch *batch = arg;
+  struct batch_item *item;
+  unsigned spins = 0;
+  for (;;) {
+    if (batch_release(batch))
+      return NULL;
+    item = batch_queue_pop(&batch->decoded);
+    if (!item) {
+      batch_wait(&spins);
+      continue;
+    }
+    spins = 0;
+    if (!item->end && !item->failed) {
+      diag_begin(item->name);
+      parse_deadline = budget_deadline(parse_time_limit);
+      if (parse_item(item) != 0) {
+        /* memory of failed document is mixed with documents in flight */
+        while (batch->in_print > 0) {
+          if (batch_release(batch))
+            return NULL;
+          batch_wait(&spins);
+        }
+        mem_free_all();
+        item->parsed = NULL;
+        item->failed = 1;
+      }
+      parse_deadline = 0;
+      diag_flush();
+    }
+    batch->in_print++;
+    batch_queue_push(&batch->parsed, item);
+  }
+}
+
+/*
+ * With --output-limit output of item is printed into memory by stream which
+ * fails when limit is exceeded, so printing stops early and nothing of
+ * failed item is written to stdout. Buffer is reused for next items.
+ */
+struct batch_output {
+  char *data;
+  size_t len;
+  size_t size;
+  int exceeded;
+};
+
+static struct batch_output batch_output_buffer;
+
+static ssize_t batch_output_write(void *cookie, const char *buf, size_t size) {
+  struct batch_output *out = cookie;
+  size_t new_size;
+  void *ptr;
+  if (size > output_limit - out->len) {
+    out->exceeded = 1;
+    return 0;
+  }
+  if (size > out->size - out->len) {
+    new_size = out->size ? out->size : 65536;
+    while (size > new_size - out->len)
+      new_size *= 2;
+    ptr = realloc(out->data, new_size);
+    if (!ptr)
+      return 0;
+    out->data = ptr;
+    out->size = new_size;
+  }
+  memcpy(out->data + out->len, buf, size);
+  out->len += size;
+  return size;
+}
+
+static int batch_output(struct batch_item *item) {
+  static const cookie_io_functions_t functions = { NULL, batch_output_write, NULL, NULL };
+  struct batch_output *out = &batch_output_buffer;
+  FILE *fout;
+  int ret;
+  if (!output_limit)
+    return print_item(item, stdout);
+  out->len = 0;
+  out->exceeded = 0;
+  fout = fopencookie(out, "w", functions);
+  if (!fout)
+    return 1;
+  ret = print_item(item, fout);
+  if (fclose(fout) != 0)
+    ret = 1;
+  if (out->exceeded) {
+    fprintf(stderr, "Output limit exceeded\n");
+    return 1;
+  }
+  if (ret == 0 && fwrite(out->data, 1, out->len, stdout) != out->len)
+    ret = 1;
+  return ret;
+}
+
+static int batch_print(struct batch *batch) {
+  struct batch_item *item;
+  int ret = 0;
+  for (;;) {
+    item = batch_queue_wait(&batch->parsed);
+    if (item->end) {
+      batch_queue_push(&batch->printed, item);
+      break;
+    }
+    if (item->failed || batch_output(item) != 0) {
+      fprintf(stderr, "Processing of input file %s failed\n", item->name);
+      ret = 1;
+    }
+    batch_queue_push(&batch->printed, item);
+  }
+  return ret;
+}
+
+/* Parse, print and release item in one thread, used when threads cannot be created */
+static int batch_process(struct batch_item *item) {
+  int ret = 0;
+  if (!item->failed) {
+    diag_begin(item->name);
+    parse_deadline = budget_deadline(parse_time_limit);
+    if (parse_item(item) != 0) {
+      mem_free_all();
+      item->parsed = NULL;
+      item->failed = 1;
+    }
+    parse_deadline = 0;
+    diag_flush();
+  }
+  if (item->failed || batch_output(item) != 0) {
+    fprintf(stderr, "Processing of input file %s failed\n", item->name);
+    ret = 1;
+  }
+  release_item(item);
+  return ret;
+}
+
+static int batch_files(int count, char *files[]) {
+  struct batch *batch;
+  struct batch_item *item;
+  pthread_t decode_thread, parse_thread;
+  int ret = 0;
+  int i;
+  batch = calloc(1, sizeof(*batch));
+  if (!batch) {
+    fprintf(stderr, "Cannot allocate memory for batch\n");
+    return 1;
+  }
+  batch->files = files;
+  batch->count = count;
+  for (i = 0; i < BATCH_ITEMS; ++i)
+    batch_queue_push(&batch->free, &batch->items[i]);
+  batch->reader = batch_reader_start(files, count);
+  if (pthread_create(&decode_thread, NULL, batch_decode_thread, batch) != 0) {
+    for (i = 0; i < count; ++i) {
+      decode_item(batch, i, &batch->items[0]);
+      ret |= batch_process(&batch->items[0]);
+    }
+  } else if (pthread_create(&parse_thread, NULL, batch_parse_thread, batch) != 0) {
+    while (!(item = batch_queue_wait(&batch->decoded))->end) {
+      ret |= batch_process(item);
+      batch_queue_push(&batch->free, item);
+    }
+    pthread_join(decode_thread, NULL);
+  } else {
+    ret = batch_print(batch);
+    pthread_join(parse_thread, NULL);
+    pthread_join(decode_thread, NULL);
+  }
+  batch_reader_stop(batch->reader);
+  if (fflush(stdout) != 0)
+    ret = 1;
+  for (i = 0; i < BATCH_ITEMS; ++i) {
+    free(batch->items[i].input);
+    free(batch->items[i].data);
+  }
+  free(batch_output_buffer.data);
+  free(batch);
+  return ret;
+}
+
+/*
+ * Extraction of BMF blobs embedded in firmware images or ACPI table dumps
+ * for --extract. Image is searched for FOMB header by memmem(), candidates
+ * with plausible sizes and DS signature are decompressed by pool of threads
+ * (few candidates are decompressed by ds_dec_parallel() instead). Every
+ * blob which decompresses to exactly its declared size is listed as line:
+ * offset compressed_size decompressed_size [file], file is written only
+ * with output directory and contains blob with header as <offset>.bmof.
+ */
+
+struct extract_blob {
+  size_t offset;
+  uint32_t lin;   /* compressed size without header */
+  uint32_t lout;
+  int valid;
+};
+
+struct extract {
+  char *image;
+  struct extract_blob *blobs;
+  uint32_t count;
+  _Atomic uint32_t next;
+  int threads;    /* threads of ds_dec_parallel() for one blob */
+};
+
+/* Collect candidates with valid header fields, returns NULL on error */
+static struct extract_blob *extract_find(char *image, size_t size, uint32_t *count) {
+  struct extract_blob *blobs = NULL;
+  struct extract_blob *ptr;
+  uint32_t header[4];
+  uint32_t alloc = 0;
+  char *pos = image;
+  char *end = image + size;
+  *count = 0;
+  while (end - pos > 16 && (pos = memmem(pos, end - pos - 16, "FOMB", 4)) != NULL) {
+    memcpy(header, pos, sizeof(header));
+    if (header[1] == 0x00000001 && header[2] >= 4 && header[2] <= (size_t)(end - pos - 16) && header[3] && header[3] <= 0x2000000 && pos[16] == 'D' && pos[17] == 'S') {
+      if (*count == alloc) {
+        ptr = realloc(blobs, (alloc ? 2 * alloc : 16) * sizeof(*blobs));
+        if (!ptr) {
+          free(blobs);
+          return NULL;
+        }
+        alloc = alloc ? 2 * alloc : 16;
+        blobs = ptr;
+      }
+      blobs[*count].offset = pos - image;
+      blobs[*count].lin = header[2];
+      blobs[*count].lout = header[3];
+      blobs[*count].valid = 0;
+      (*count)++;
+    }
+    /* real blob can start inside data of false candidate */
+    ++pos;
+  }
+  return blobs ? blobs : malloc(sizeof(*blobs));
+}
+
+static void *extract_thread(void *arg) {
+  struct extract *extract = arg;
+  struct extract_blob *blob;
+  char *pin;
+  char *pout;
+  uint32_t i;
+  while ((i = atomic_fetch_add(&extract->next, 1)) < extract->count) {
+    blob = &extract->blobs[i];
+    /* blob in image does not have to be aligned for 16 bit reads of ds_dec() */
+    pin = malloc(blob->lin);
+    pout = malloc(blob->lout);
+    if (pin && pout) {
+      memcpy(pin, extract->image + blob->offset + 16, blob->lin);
+      blob->valid = ds_dec_parallel(pin, blob->lin, pout, blob->lout, 0, extract->threads) == (int)blob->lout;
+    }
     free(pin);
     free(pout);
+  }
+  return NULL;
+}
+
+static int extract_write(const char *dir, char *image, struct extract_blob *blob, char *path, size_t size) {
+  FILE *fout;
+  int ret;
+  if ((size_t)snprintf(path, size, "%s/%08lx.bmof", dir, (unsigned long)blob->offset) >= size) {
+    fprintf(stderr, "Output file name too long\n");
+    return 1;
+  }
+  fout = fopen(path, "wb");
+  if (!fout) {
+    fprintf(stderr, "Cannot open output file %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  ret = (fwrite(image + blob->offset, 1, (size_t)blob->lin + 16, fout) == (size_t)blob->lin + 16) ? 0 : 1;
+  if (fclose(fout) != 0)
+    ret = 1;
+  if (ret) {
+    fprintf(stderr, "Cannot write output file %s\n", path);
+    remove(path);
+  }
+  return ret;
+}
+
+static int extract_blobs(const char *name, const char *dir) {
+  struct extract extract;
+  pthread_t *threads;
+  char *started;
+  char path[4096];
+  uint32_t *image = NULL;
+  size_t size = 0;
+  size_t len;
+  enum read_status status;
+  uint32_t found = 0;
+  uint32_t i;
+  int count;
+  int err = 0;
+  int ret = 0;
+  status = read_file(name, &image, &size, &len, &err);
+  if (status != READ_OK) {
+    read_error(name, status, err);
+    free(image);
     return 1;
   }
-  free(pin);
-  if (argc >= 3) {
-    fout = fopen(argv[2], "wb");
+  memset(&extract, 0, sizeof(extract));
+  extract.image = (char *)image;
+  extract.blobs = extract_find(extract.image, len, &extract.count);
+  if (!extract.blobs) {
+    fprintf(stderr, "Cannot allocate memory for blobs\n");
+    free(image);
+    return 1;
+  }
+  /* threads are split between blobs, single blob gets all of them */
+  count = (extract.count < (uint32_t)decompress_threads) ? (int)extract.count : decompress_threads;
+  extract.threads = count ? decompress_threads / count : 1;
+  threads = calloc(count ? count : 1, sizeof(*threads));
+  started = calloc(count ? count : 1, 1);
+  for (i = 1; i < (uint32_t)count; ++i) {
+    if (threads && started && pthread_create(&threads[i], NULL, extract_thread, &extract) == 0)
+      started[i] = 1;
+  }
+  extract_thread(&extract);
+  for (i = 1; i < (uint32_t)count; ++i) {
+    if (started && started[i])
+      pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  free(started);
+  for (i = 0; i < extract.count; ++i) {
+    if (!extract.blobs[i].valid)
+      continue;
+    found++;
+    printf("0x%08lx %u %u", (unsigned long)extract.blobs[i].offset, extract.blobs[i].lin + 16, extract.blobs[i].lout);
+    if (dir) {
+      if (extract_write(dir, extract.image, &extract.blobs[i], path, sizeof(path)) == 0)
+        printf(" %s", path);
+      else
+        ret = 1;
+    }
+    printf("\n");
+  }
+  if (!found) {
+    fprintf(stderr, "No BMF found in %s\n", name);
+    ret = 1;
+  }
+  if (fflush(stdout) != 0)
+    ret = 1;
+  free(extract.blobs);
+  free(image);
+  return ret;
+}
+
+/* Parse size with optional K, M or G suffix, returns nonzero on error */
+static int parse_size(const char *str, size_t *size) {
+  char *end;
+  errno = 0;
+  *size = strtoul(str, &end, 10);
+  if (*end == 'k' || *end == 'K')
+    *size <<= 10, ++end;
+  else if (*end == 'm' || *end == 'M')
+    *size <<= 20, ++end;
+  else if (*end == 'g' || *end == 'G')
+    *size <<= 30, ++end;
+  return (errno || *end || end == str) ? 1 : 0;
+}
+
+/* Returns format of --FORMAT=file option or -1 */
+static int output_option(const char *arg) {
+  size_t len;
+  int i;
+  if (strncmp(arg, "--", 2) != 0)
+    return -1;
+  for (i = 0; i < OUTPUT_COUNT; ++i) {
+    len = strlen(output_formats[i].name);
+    if (strncmp(arg+2, output_formats[i].name, len) == 0 && arg[2+len] == '=')
+      return i;
+  }
+  return -1;
+}
+
+/* Open files named by --FORMAT=file options ("-" is stdout) and write outputs into them */
+static int write_outputs(char *data, uint32_t size, char *names[OUTPUT_COUNT]) {
+  FILE *outputs[OUTPUT_COUNT];
+  int ret = 0;
+  int i;
+  for (i = 0; i < OUTPUT_COUNT; ++i) {
+    outputs[i] = NULL;
+    if (!names[i])
+      continue;
+    outputs[i] = strcmp(names[i], "-") == 0 ? stdout : fopen(names[i], "wb");
+    if (!outputs[i]) {
+      fprintf(stderr, "Cannot open output file %s: %s\n", names[i], strerror(errno));
+      ret = 1;
+    }
+  }
+  if (ret == 0)
+    ret = process_outputs(data, size, outputs);
+  for (i = 0; i < OUTPUT_COUNT; ++i) {
+    if (outputs[i] && outputs[i] != stdout && fclose(outputs[i]) != 0)
+      ret = 1;
+  }
+  return ret;
+}
+
+int main(int argc, char *argv[]) {
+  FILE *fin;
+  FILE *fout;
+  uint32_t *pin;
+  char *pout;
+  char *input;
+  char *output;
+  char *scan = NULL;
+  char *state = NULL;
+  char *dedupe = NULL;
+  char *index = NULL;
+  char *extract_dir = NULL;
+  int extract = 0;
+  struct ds_index ds_index;
+  char *outputs[OUTPUT_COUNT] = { NULL };
+  int outputs_count = 0;
+  int format;
+  unsigned long range_offset = 0;
+  unsigned long range_size = 0;
+  int range = 0;
+  size_t lin;
+  uint32_t lout;
+  uint32_t offset;
+  char *end;
+  int check = 0;
+  int batch = 0;
+  int queue_depth = 0;
+  int budget = 0;
+  int analyze = 0;
+  int argi;
+  int ret;
+  for (argi = 1; argi < argc && argv[argi][0] == '-' && argv[argi][1]; ++argi) {
+    if (strcmp(argv[argi], "--check") == 0) {
+      check = 1;
+    } else if (strcmp(argv[argi], "--batch") == 0) {
+      batch = 1;
+    } else if (strcmp(argv[argi], "--stream") == 0 && stream_supported()) {
+      stream_classes = 1;
+    } else if (strcmp(argv[argi], "--analyze") == 0) {
+      analyze = 1;
+    } else if (strcmp(argv[argi], "--analyze=blocks") == 0) {
+      analyze = 2;
+#ifdef TRACE
+    } else if (strcmp(argv[argi], "--trace") == 0) {
+      trace_start();
+#endif
+    } else if (strcmp(argv[argi], "--scan") == 0) {
+      scan = "/sys/bus/wmi/devices";
+    } else if (strncmp(argv[argi], "--scan=", strlen("--scan=")) == 0) {
+      scan = argv[argi] + strlen("--scan=");
+    } else if (strcmp(argv[argi], "--extract") == 0) {
+      extract = 1;
+    } else if (strncmp(argv[argi], "--extract=", strlen("--extract=")) == 0) {
+      extract = 1;
+      extract_dir = argv[argi] + strlen("--extract=");
+    } else if (strncmp(argv[argi], "--dedupe=", strlen("--dedupe=")) == 0) {
+      dedupe = argv[argi] + strlen("--dedupe=");
+    } else if (strncmp(argv[argi], "--state=", strlen("--state=")) == 0) {
+      state = argv[argi] + strlen("--state=");
+    } else if (strcmp(argv[argi], "--diag=silent") == 0) {
+      diag_mode = DIAG_SILENT;
+    } else if (strcmp(argv[argi], "--diag=summary") == 0) {
+      diag_mode = DIAG_SUMMARY;
+    } else if (strcmp(argv[argi], "--diag=full") == 0) {
+      diag_mode = DIAG_FULL;
+    } else if (strncmp(argv[argi], "--memory-limit=", strlen("--memory-limit=")) == 0) {
+      if (parse_size(argv[argi] + strlen("--memory-limit="), &memory_limit)) {
+        argc = 0;
+        break;
+      }
+    } else if (strncmp(argv[argi], "--data-limit=", strlen("--data-limit=")) == 0) {
+      if (parse_size(argv[argi] + strlen("--data-limit="), &data_limit)) {
+        argc = 0;
+        break;
+      }
+      budget = 1;
+    } else if (strncmp(argv[argi], "--output-limit=", strlen("--output-limit=")) == 0) {
+      if (parse_size(argv[argi] + strlen("--output-limit="), &output_limit)) {
+        argc = 0;
+        break;
+      }
+      budget = 1;
+    } else if (strncmp(argv[argi], "--decode-time=", strlen("--decode-time=")) == 0) {
+      errno = 0;
+      decode_time_limit = strtoul(argv[argi] + strlen("--decode-time="), &end, 10);
+      if (errno || *end || end == argv[argi] + strlen("--decode-time=")) {
+        argc = 0;
+        break;
+      }
+      budget = 1;
+    } else if (strncmp(argv[argi], "--parse-time=", strlen("--parse-time=")) == 0) {
+      errno = 0;
+      parse_time_limit = strtoul(argv[argi] + strlen("--parse-time="), &end, 10);
+      if (errno || *end || end == argv[argi] + strlen("--parse-time=")) {
+        argc = 0;
+        break;
+      }
+      budget = 1;
+    } else if (strncmp(argv[argi], "--threads=", strlen("--threads=")) == 0) {
+      errno = 0;
+      decompress_threads = strtol(argv[argi] + strlen("--threads="), &end, 10);
+      if (errno || *end || end == argv[argi] + strlen("--threads=") || decompress_threads < 1 || decompress_threads > 256) {
+        argc = 0;
+        break;
+      }
+    } else if (strncmp(argv[argi], "--queue-depth=", strlen("--queue-depth=")) == 0) {
+      errno = 0;
+      batch_queue_depth = strtol(argv[argi] + strlen("--queue-depth="), &end, 10);
+      if (errno || *end || end == argv[argi] + strlen("--queue-depth=") || batch_queue_depth < 1 || batch_queue_depth > BATCH_QUEUE_DEPTH_MAX) {
+        argc = 0;
+        break;
+      }
+      queue_depth = 1;
+    } else if (strncmp(argv[argi], "--index=", strlen("--index=")) == 0) {
+      index = argv[argi] + strlen("--index=");
+    } else if (strncmp(argv[argi], "--range=", strlen("--range=")) == 0) {
+      errno = 0;
+      range_offset = strtoul(argv[argi] + strlen("--range="), &end, 0);
+      if (*end == ':')
+        range_size = strtoul(end + 1, &end, 0);
+      if (errno || *end || end == argv[argi] + strlen("--range=") || range_offset > 0x2000000 || range_size > 0x2000000) {
+        argc = 0;
+        break;
+      }
+      range = 1;
+    } else if ((format = output_option(argv[argi])) >= 0) {
+      if (!output_supported(format)) {
+        argc = 0;
+        break;
+      }
+      outputs[format] = strchr(argv[argi], '=') + 1;
+      outputs_count++;
+    } else if (strcmp(argv[argi], "--") == 0) {
+      ++argi;
+      break;
+    } else {
+      argc = 0;
+      break;
+    }
+  }
+  if (dedupe && !check && !scan && !extract && !outputs_count && !batch && argc-argi >= 1)
+    return dedupe_files(dedupe, argc-argi, argv+argi);
+  /* valid --dedupe was handled above, every mode checks its conflicts */
+  if (dedupe)
+    argc = 0;
+  if (argc-argi > 2 && !batch)
+    argc = 0;
+  if (check && argc-argi > 1)
+    argc = 0;
+  if (scan && (check || argc-argi != 1))
+    argc = 0;
+  if (state && !scan)
+    argc = 0;
+  if (range && (check || scan))
+    argc = 0;
+  if (index && scan)
+    argc = 0;
+  if (outputs_count && (argc-argi > 1 || check || scan || range))
+    argc = 0;
+  if (batch && (argc-argi < 1 || check || scan || range || index || outputs_count))
+    argc = 0;
+  if ((queue_depth || budget) && !batch)
+    argc = 0;
+  if (analyze && (check || scan || range || index || outputs_count || batch))
+    argc = 0;
+  if (stream_classes && (check || range || outputs_count || batch || analyze))
+    argc = 0;
+  if (extract && (argc-argi != 1 || check || scan || range || index || outputs_count || batch || analyze || stream_classes))
+    argc = 0;
+  if (argc == 0) {
+    fprintf(stderr, "Usage: %s [options] [input_file [output_file]]\n", argv[0]);
+    fprintf(stderr, "       %s [options] --check [input_file]\n", argv[0]);
+    fprintf(stderr, "       %s [options] --scan[=root] [--state=file] output_dir\n", argv[0]);
+    fprintf(stderr, "       %s [options] --dedupe=output_dir input_file...\n", argv[0]);
+    fprintf(stderr, "       %s [options] --FORMAT=output_file... [input_file]\n", argv[0]);
+    fprintf(stderr, "       %s [options] --batch input_file...\n", argv[0]);
+    fprintf(stderr, "       %s [options] --extract[=output_dir] image_file\n", argv[0]);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --diag=MODE           warnings: silent, summary or full (default)\n");
+    fprintf(stderr, "  --memory-limit=BYTES  limit memory used for one file (K, M or G suffix)\n");
+    fprintf(stderr, "  --threads=N           decompress large files with N threads\n");
+    fprintf(stderr, "  --index=file          create seek index of input file or use existing one\n");
+    fprintf(stderr, "  --range=OFFSET:SIZE   write only raw decompressed bytes of range\n");
+    fprintf(stderr, "  --scan[=root]         process root/*/bmof files (default root is /sys/bus/wmi/devices)\n");
+    fprintf(stderr, "  --state=file          skip bmof files which did not change since last scan\n");
+    fprintf(stderr, "  --dedupe=output_dir   store every unique input file and class only once\n");
+    fprintf(stderr, "  --batch               process all input files to stdout in pipeline\n");
+    fprintf(stderr, "  --queue-depth=N       read up to N files ahead in --batch (default %d)\n", BATCH_QUEUE_DEPTH);
+    fprintf(stderr, "  --decode-time=MS      fail file of --batch when decompression takes longer\n");
+    fprintf(stderr, "  --parse-time=MS       fail file of --batch when parsing takes longer\n");
+    fprintf(stderr, "  --data-limit=BYTES    fail file of --batch with larger decompressed data\n");
+    fprintf(stderr, "  --output-limit=BYTES  fail file of --batch with larger output\n");
+    fprintf(stderr, "  --analyze[=blocks]    write statistics of compressed data (and of every 512 byte block)\n");
+    if (stream_supported())
+      fprintf(stderr, "  --stream              print every class as soon as it is parsed\n");
+    fprintf(stderr, "  --extract[=dir]       list BMF blobs in firmware image (and write them into dir)\n");
+#ifdef TRACE
+    fprintf(stderr, "  --trace               write last trace events to stderr at exit\n");
+#endif
+    for (format = 0; format < OUTPUT_COUNT; ++format) {
+      if (output_supported(format))
+        fprintf(stderr, "  --%s=file%*s write %s into file (- is stdout)\n", output_formats[format].name, (int)(14-strlen(output_formats[format].name)), "", output_formats[format].description);
+    }
+    return 1;
+  }
+  if (scan)
+    return scan_devices(scan, state, argv[argi]);
+  if (batch)
+    return batch_files(argc-argi, argv+argi);
+  if (extract)
+    return extract_blobs(argv[argi], extract_dir);
+  input = (argc-argi >= 1) ? argv[argi] : NULL;
+  output = (argc-argi >= 2) ? argv[argi+1] : NULL;
+  /* warnings are written also when error() exits */
+  atexit(diag_flush);
+  if (input)
+    diag_begin(input);
+  if (input) {
+    fin = fopen(input, "rb");
+    if (!fin) {
+      fprintf(stderr, "Cannot open input file %s: %s\n", input, strerror(errno));
+      return 1;
+    }
+  } else {
+    fin = stdin;
+  }
+  pin = read_input(fin, input ? input : "(stdin)", &lin);
+  if (input)
+    fclose(fin);
+  if (!pin)
+    return 1;
+  if (analyze) {
+    fout = output ? fopen(output, "w") : stdout;
+    if (!fout) {
+      fprintf(stderr, "Cannot open output file %s: %s\n", output, strerror(errno));
+      mem_free(pin);
+      return 1;
+    }
+    ret = analyze_data(pin, lin, fout, analyze == 2);
+    mem_free(pin);
+    if (output)
+      fclose(fout);
+    return ret;
+  }
+  if (range) {
+    pout = decompress_range(pin, lin, index, range_offset, range_size);
+    lout = range_size;
+  } else {
+    pout = decompress_data(pin, lin, &lout);
+    if (pout && index) {
+      if (load_index(pin, lin, index, &ds_index)) {
+        mem_free(pout);
+        pout = NULL;
+      }
+      ds_index_free(&ds_index);
+    }
+  }
+  mem_free(pin);
+  if (!pout)
+    return 1;
+  if (check) {
+    offset = 0;
+    ret = check_data(pout, lout, &offset);
+    if (ret)
+      fprintf(stderr, "Invalid data at offset 0x%x\n", (unsigned int)offset);
+    mem_free(pout);
+    return ret ? 1 : 0;
+  }
+  if (outputs_count) {
+    ret = write_outputs(pout, lout, outputs);
+    mem_free(pout);
+    return ret;
+  }
+  if (output) {
+    fout = fopen(output, "wb");
     if (!fout) {
-      fprintf(stderr, "Cannot open output file %s: %s\n", argv[2], strerror(errno));
-      free(pout);
+      fprintf(stderr, "Cannot open output file %s: %s\n", output, strerror(errno));
+      mem_free(pout);
       return 1;
     }
   } else {
     fout = stdout;
   }
-  ret = process_data(pout, lout, fout);
-  free(pout);
-  if (argc >= 3)
+  if (range)
+    ret = (fwrite(pout, 1, lout, fout) == lout) ? 0 : 1;
+  else
+    ret = process_data(pout, lout, fout);
+  mem_free(pout);
+  if (output)
     fclose(fout);
   return ret;
 }
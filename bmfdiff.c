@@ -0,0 +1,407 @@
+/*
+    bmfdiff.c - Compare structure of two binary MOF files (BMF)
+    Copyright (C) 2017  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; version 2.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#define main bmf2mof_main
+#include "bmf2mof.c"
+#undef main
+
+/*
+ * Classes are matched by namespace and name, variables and qualifiers by
+ * name, methods by name and method parameters by their ID. Output lists
+ * added (+), removed (-) and changed (~) items sorted by name, so order of
+ * items in input files does not matter. Classes with same hash are equal
+ * and are skipped without comparing their content.
+ */
+
+static int diff_strcmp(const char *a, const char *b) {
+  if (!a || !b)
+    return (a ? 1 : 0) - (b ? 1 : 0);
+  return strcmp(a, b);
+}
+
+static int diff_cmp_class(const void *a, const void *b) {
+  const struct mof_class *ca = *(const struct mof_class * const *)a;
+  const struct mof_class *cb = *(const struct mof_class * const *)b;
+  int ret = diff_strcmp(ca->namespace, cb->namespace);
+  if (ret)
+    return ret;
+  return diff_strcmp(ca->name, cb->name);
+}
+
+static int diff_cmp_qualifier(const void *a, const void *b) {
+  return diff_strcmp((*(const struct mof_qualifier * const *)a)->name, (*(const struct mof_qualifier * const *)b)->name);
+}
+
+static int diff_cmp_variable(const void *a, const void *b) {
+  return diff_strcmp((*(const struct mof_variable * const *)a)->name, (*(const struct mof_variable * const *)b)->name);
+}
+
+static int diff_cmp_method(const void *a, const void *b) {
+  return diff_strcmp((*(const struct mof_method * const *)a)->name, (*(const struct mof_method * const *)b)->name);
+}
+
+/* Returns array of pointers to count items of size bytes sorted by cmp */
+static void **diff_sort(void *items, uint32_t count, size_t size, int (*cmp)(const void *, const void *)) {
+  void **out = mem_calloc(count, sizeof(*out));
+  uint32_t i;
+  if (!out) error("calloc failed");
+  for (i = 0; i < count; ++i)
+    out[i] = (char *)items + i * size;
+  qsort(out, count, sizeof(*out), cmp);
+  return out;
+}
+
+static int diff_qualifier_changed(struct mof_qualifier *a, struct mof_qualifier *b) {
+  if (cmp_qualifiers(a, b) != 0)
+    return 1;
+  return a->toinstance != b->toinstance || a->tosubclass != b->tosubclass || a->disableoverride != b->disableoverride || a->amended != b->amended;
+}
+
+/* Print differences of qualifiers, when header is set print it before first difference */
+static int diff_qualifiers(FILE *fout, struct mof_qualifier *a, uint32_t count_a, struct mof_qualifier *b, uint32_t count_b, int indent, const char **header) {
+  struct mof_qualifier **sa, **sb;
+  uint32_t i = 0, j = 0;
+  int cmp, changed = 0;
+  sa = (struct mof_qualifier **)diff_sort(a, count_a, sizeof(*a), diff_cmp_qualifier);
+  sb = (struct mof_qualifier **)diff_sort(b, count_b, sizeof(*b), diff_cmp_qualifier);
+  while (i < count_a || j < count_b) {
+    if (i == count_a)
+      cmp = 1;
+    else if (j == count_b)
+      cmp = -1;
+    else
+      cmp = diff_strcmp(sa[i]->name, sb[j]->name);
+    if (cmp == 0 && !diff_qualifier_changed(sa[i], sb[j])) {
+      ++i;
+      ++j;
+      continue;
+    }
+    if (header && *header) {
+      fprintf(fout, "%s\n", *header);
+      *header = NULL;
+    }
+    changed = 1;
+    if (cmp < 0) {
+      fprintf(fout, "%*.s-qualifier ", indent, "");
+      print_qualifiers(fout, sa[i++], 1, NULL);
+    } else if (cmp > 0) {
+      fprintf(fout, "%*.s+qualifier ", indent, "");
+      print_qualifiers(fout, sb[j++], 1, NULL);
+    } else {
+      fprintf(fout, "%*.s~qualifier ", indent, "");
+      print_qualifiers(fout, sa[i++], 1, NULL);
+      fprintf(fout, " -> ");
+      print_qualifiers(fout, sb[j++], 1, NULL);
+    }
+    fprintf(fout, "\n");
+  }
+  mem_free(sa);
+  mem_free(sb);
+  return changed;
+}
+
+static void diff_print_variable_type(FILE *fout, struct mof_variable *variable) {
+  print_variable_type(fout, variable);
+  if (variable->variable_type == MOF_VARIABLE_BASIC_ARRAY || variable->variable_type == MOF_VARIABLE_OBJECT_ARRAY) {
+    fprintf(fout, "[");
+    if (variable->has_array_max)
+      fprintf(fout, "%d", variable->array_max);
+    fprintf(fout, "]");
+  }
+}
+
+static int diff_values_changed(struct mof_variable *a, struct mof_variable *b) {
+  uint32_t i;
+  if (a->has_value != b->has_value || a->values_count != b->values_count)
+    return 1;
+  for (i = 0; i < a->values_count; ++i) {
+    if (a->type.basic == MOF_BASIC_TYPE_STRING || a->type.basic == MOF_BASIC_TYPE_DATETIME) {
+      if (strcmp(a->values[i].string, b->values[i].string) != 0)
+        return 1;
+    } else if (a->values[i].uint != b->values[i].uint) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void diff_print_value(FILE *fout, struct mof_variable *variable) {
+  if (variable->has_value)
+    print_variable_value(fout, variable);
+  else
+    fprintf(fout, "(none)");
+}
+
+static int diff_variable(FILE *fout, struct mof_variable *a, struct mof_variable *b, const char *kind, int indent) {
+  struct mof_variable b_type = *b;
+  char header[512];
+  const char *header_ptr = header;
+  int changed = 0;
+  /* parameters are matched by ID, compare only type */
+  b_type.name = a->name;
+  snprintf(header, sizeof(header), "%*.s~%s %s", indent, "", kind, a->name ? a->name : "(null)");
+  if (!a->variable_type != !b->variable_type || (a->variable_type && cmp_variables(a, &b_type) != 0)) {
+    fprintf(fout, "%s: ", header);
+    diff_print_variable_type(fout, a);
+    fprintf(fout, " -> ");
+    diff_print_variable_type(fout, b);
+    fprintf(fout, "\n");
+    header_ptr = NULL;
+    changed = 1;
+  }
+  if (!changed && a->variable_type == b->variable_type && diff_values_changed(a, b)) {
+    fprintf(fout, "%s\n", header);
+    fprintf(fout, "%*.s~value ", indent+2, "");
+    diff_print_value(fout, a);
+    fprintf(fout, " -> ");
+    diff_print_value(fout, b);
+    fprintf(fout, "\n");
+    header_ptr = NULL;
+    changed = 1;
+  }
+  if (diff_qualifiers(fout, a->qualifiers, a->qualifiers_count, b->qualifiers, b->qualifiers_count, indent+2, &header_ptr))
+    changed = 1;
+  return changed;
+}
+
+static void diff_variables(FILE *fout, struct mof_variable *a, uint32_t count_a, struct mof_variable *b, uint32_t count_b) {
+  struct mof_variable **sa, **sb;
+  uint32_t i = 0, j = 0;
+  int cmp;
+  sa = (struct mof_variable **)diff_sort(a, count_a, sizeof(*a), diff_cmp_variable);
+  sb = (struct mof_variable **)diff_sort(b, count_b, sizeof(*b), diff_cmp_variable);
+  while (i < count_a || j < count_b) {
+    if (i == count_a)
+      cmp = 1;
+    else if (j == count_b)
+      cmp = -1;
+    else
+      cmp = diff_strcmp(sa[i]->name, sb[j]->name);
+    if (cmp < 0) {
+      fprintf(fout, "  -variable %s\n", sa[i++]->name);
+    } else if (cmp > 0) {
+      fprintf(fout, "  +variable %s\n", sb[j++]->name);
+    } else {
+      diff_variable(fout, sa[i++], sb[j++], "variable", 2);
+    }
+  }
+  mem_free(sa);
+  mem_free(sb);
+}
+
+static const char *diff_direction(enum mof_parameter_direction direction) {
+  switch (direction) {
+  case MOF_PARAMETER_IN:
+    return "in";
+  case MOF_PARAMETER_OUT:
+    return "out";
+  case MOF_PARAMETER_IN_OUT:
+    return "in, out";
+  default:
+    return "unknown";
+  }
+}
+
+static void diff_method(FILE *fout, struct mof_method *a, struct mof_method *b) {
+  char header[512];
+  const char *header_ptr = header;
+  uint32_t i;
+  snprintf(header, sizeof(header), "  ~method %s", a->name);
+  diff_qualifiers(fout, a->qualifiers, a->qualifiers_count, b->qualifiers, b->qualifiers_count, 4, &header_ptr);
+  for (i = 0; i < a->parameters_count || i < b->parameters_count; ++i) {
+    if (i < a->parameters_count && i < b->parameters_count) {
+      if (a->parameters_direction[i] == b->parameters_direction[i] && !diff_strcmp(a->parameters[i].name, b->parameters[i].name) && hash_variable(HASH_INIT, &a->parameters[i]) == hash_variable(HASH_INIT, &b->parameters[i]))
+        continue;
+    }
+    if (header_ptr) {
+      fprintf(fout, "%s\n", header_ptr);
+      header_ptr = NULL;
+    }
+    if (i >= b->parameters_count) {
+      fprintf(fout, "    -parameter %u [%s] %s\n", i, diff_direction(a->parameters_direction[i]), a->parameters[i].name);
+    } else if (i >= a->parameters_count) {
+      fprintf(fout, "    +parameter %u [%s] %s\n", i, diff_direction(b->parameters_direction[i]), b->parameters[i].name);
+    } else {
+      snprintf(header, sizeof(header), "    ~parameter %u", i);
+      if (a->parameters_direction[i] != b->parameters_direction[i] || diff_strcmp(a->parameters[i].name, b->parameters[i].name))
+        fprintf(fout, "%s: [%s] %s -> [%s] %s\n", header, diff_direction(a->parameters_direction[i]), a->parameters[i].name, diff_direction(b->parameters_direction[i]), b->parameters[i].name);
+      diff_variable(fout, &a->parameters[i], &b->parameters[i], "parameter", 4);
+    }
+  }
+  if (hash_variable(HASH_INIT, &a->return_value) != hash_variable(HASH_INIT, &b->return_value)) {
+    if (header_ptr) {
+      fprintf(fout, "%s\n", header_ptr);
+      header_ptr = NULL;
+    }
+    fprintf(fout, "    ~return value: ");
+    if (a->return_value.variable_type)
+      diff_print_variable_type(fout, &a->return_value);
+    else
+      fprintf(fout, "void");
+    fprintf(fout, " -> ");
+    if (b->return_value.variable_type)
+      diff_print_variable_type(fout, &b->return_value);
+    else
+      fprintf(fout, "void");
+    fprintf(fout, "\n");
+  }
+}
+
+static void diff_methods(FILE *fout, struct mof_method *a, uint32_t count_a, struct mof_method *b, uint32_t count_b) {
+  struct mof_method **sa, **sb;
+  uint32_t i = 0, j = 0;
+  int cmp;
+  sa = (struct mof_method **)diff_sort(a, count_a, sizeof(*a), diff_cmp_method);
+  sb = (struct mof_method **)diff_sort(b, count_b, sizeof(*b), diff_cmp_method);
+  while (i < count_a || j < count_b) {
+    if (i == count_a)
+      cmp = 1;
+    else if (j == count_b)
+      cmp = -1;
+    else
+      cmp = diff_strcmp(sa[i]->name, sb[j]->name);
+    if (cmp < 0) {
+      fprintf(fout, "  -method %s\n", sa[i++]->name);
+    } else if (cmp > 0) {
+      fprintf(fout, "  +method %s\n", sb[j++]->name);
+    } else {
+      if (hash_method(HASH_INIT, sa[i]) != hash_method(HASH_INIT, sb[j]))
+        diff_method(fout, sa[i], sb[j]);
+      ++i;
+      ++j;
+    }
+  }
+  mem_free(sa);
+  mem_free(sb);
+}
+
+static void diff_print_class_name(FILE *fout, struct mof_class *class) {
+  if (class->namespace)
+    fprintf(fout, "%s:", class->namespace);
+  fprintf(fout, "%s", class->name);
+}
+
+static void diff_class(FILE *fout, struct mof_class *a, struct mof_class *b) {
+  fprintf(fout, "~class ");
+  diff_print_class_name(fout, a);
+  fprintf(fout, "\n");
+  if (diff_strcmp(a->superclassname, b->superclassname))
+    fprintf(fout, "  ~superclass %s -> %s\n", a->superclassname ? a->superclassname : "(none)", b->superclassname ? b->superclassname : "(none)");
+  if (a->classflags != b->classflags)
+    fprintf(fout, "  ~classflags %d -> %d\n", (int)a->classflags, (int)b->classflags);
+  diff_qualifiers(fout, a->qualifiers, a->qualifiers_count, b->qualifiers, b->qualifiers_count, 2, NULL);
+  diff_variables(fout, a->variables, a->variables_count, b->variables, b->variables_count);
+  diff_methods(fout, a->methods, a->methods_count, b->methods, b->methods_count);
+}
+
+/* Returns number of different classes */
+static uint32_t diff_classes(FILE *fout, struct mof_classes *a, struct mof_classes *b) {
+  struct mof_class **sa, **sb;
+  uint32_t count_a = 0, count_b = 0;
+  uint32_t i = 0, j = 0;
+  uint32_t changed = 0;
+  int cmp;
+  sa = (struct mof_class **)diff_sort(a->classes, a->count, sizeof(*a->classes), diff_cmp_class);
+  sb = (struct mof_class **)diff_sort(b->classes, b->count, sizeof(*b->classes), diff_cmp_class);
+  /* classes without name (unsupported records) are sorted first, skip them */
+  while (count_a < a->count && !sa[count_a]->name)
+    ++count_a;
+  while (count_b < b->count && !sb[count_b]->name)
+    ++count_b;
+  i = count_a;
+  j = count_b;
+  count_a = a->count;
+  count_b = b->count;
+  while (i < count_a || j < count_b) {
+    if (i == count_a)
+      cmp = 1;
+    else if (j == count_b)
+      cmp = -1;
+    else
+      cmp = diff_cmp_class(&sa[i], &sb[j]);
+    if (cmp < 0) {
+      fprintf(fout, "-class ");
+      diff_print_class_name(fout, sa[i++]);
+      fprintf(fout, "\n");
+      ++changed;
+    } else if (cmp > 0) {
+      fprintf(fout, "+class ");
+      diff_print_class_name(fout, sb[j++]);
+      fprintf(fout, "\n");
+      ++changed;
+    } else {
+      if (hash_class(sa[i]) != hash_class(sb[j])) {
+        diff_class(fout, sa[i], sb[j]);
+        ++changed;
+      }
+      ++i;
+      ++j;
+    }
+  }
+  mem_free(sa);
+  mem_free(sb);
+  return changed;
+}
+
+static int diff_load(const char *name, struct mof_classes *classes) {
+  FILE *fin;
+  uint32_t *pin;
+  char *pout;
+  size_t lin;
+  uint32_t lout;
+  fin = fopen(name, "rb");
+  if (!fin) {
+    fprintf(stderr, "Cannot open input file %s: %s\n", name, strerror(errno));
+    return 1;
+  }
+  diag_begin(name);
+  pin = read_input(fin, name, &lin);
+  fclose(fin);
+  if (!pin)
+    return 1;
+  pout = decompress_data(pin, lin, &lout);
+  mem_free(pin);
+  if (!pout)
+    return 1;
+  *classes = parse_bmf(pout, lout);
+  mem_free(pout);
+  diag_flush();
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  struct mof_classes classes_a;
+  struct mof_classes classes_b;
+  uint32_t changed;
+  jmp_buf jmp;
+  if (argc != 3 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+    fprintf(stderr, "Usage: %s old_file new_file\n", argv[0]);
+    fprintf(stderr, "Exit status is 0 if files are same, 1 if different, 2 on error.\n");
+    return 2;
+  }
+  if (setjmp(jmp) != 0)
+    return 2;
+  error_jmp = &jmp;
+  if (diff_load(argv[1], &classes_a) || diff_load(argv[2], &classes_b))
+    return 2;
+  error_jmp = NULL;
+  changed = diff_classes(stdout, &classes_a, &classes_b);
+  free_classes(classes_a.classes, classes_a.count);
+  free_classes(classes_b.classes, classes_b.count);
+  return changed ? 1 : 0;
+}
@@ -0,0 +1,144 @@
+/*
+    bmffuzz.c - Fuzzing harness for binary MOF file (BMF) decompressor and parser
+    Copyright (C) 2017  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; version 2.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * Build for libFuzzer (or AFL++ with afl-clang-fast -fsanitize=fuzzer):
+ *   clang -g -fsanitize=fuzzer,address -o bmffuzz_dec bmffuzz.c
+ *   clang -g -fsanitize=fuzzer,address -DFUZZ_PARSE -o bmffuzz_parse bmffuzz.c
+ * Build standalone runner which processes files from command line:
+ *   cc -g -DFUZZ_MAIN -o bmffuzz bmffuzz.c
+ *
+ * Without FUZZ_PARSE input is whole BMF file which is decompressed by
+ * ds_dec() and then walked by visit_bmf() and parsed. With FUZZ_PARSE input
+ * is already decompressed data passed directly to visit_bmf() and
+ * parse_bmf(). Seed corpus and dictionary are in fuzz/ directory.
+ *
+ * Environment variables BMFFUZZ_TIME_LIMIT (milliseconds) and
+ * BMFFUZZ_MEMORY_LIMIT (bytes) enable budget mode: input which needs
+ * more time or peak memory than specified is reported as crash.
+ */
+
+#define main bmfparse_main
+#include "bmfparse.c"
+#undef main
+
+#include <time.h>
+
+static unsigned long fuzz_time_limit;
+static size_t fuzz_memory_limit;
+
+static void fuzz_init(void) {
+  static int initialized;
+  char *env;
+  if (initialized)
+    return;
+  initialized = 1;
+  diag_mode = DIAG_SILENT;
+  env = getenv("BMFFUZZ_TIME_LIMIT");
+  if (env)
+    fuzz_time_limit = strtoul(env, NULL, 10);
+  env = getenv("BMFFUZZ_MEMORY_LIMIT");
+  if (env)
+    fuzz_memory_limit = strtoul(env, NULL, 10);
+}
+
+static unsigned long fuzz_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+static void fuzz_parse(char *data, uint32_t size) {
+  struct mof_classes classes;
+  struct mof_visitor visitor = { NULL, NULL, NULL, NULL, NULL, NULL };
+  jmp_buf jmp;
+  visit_bmf(data, size, &visitor);
+  if (setjmp(jmp) == 0) {
+    error_jmp = &jmp;
+    classes = parse_bmf(data, size);
+    free_classes(classes.classes, classes.count);
+  }
+  error_jmp = NULL;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  unsigned long start;
+  uint32_t *pin;
+  char *pout;
+  uint32_t lout;
+  fuzz_init();
+  if (size > 0x800000)
+    return 0;
+  start = fuzz_time();
+  memory_peak = 0;
+  /* copy input, parser modifies buffer and needs aligned data */
+  pin = mem_malloc(size);
+  if (!pin)
+    return 0;
+  memcpy(pin, data, size);
+#ifdef FUZZ_PARSE
+  pout = (char *)pin;
+  lout = size;
+#else
+  pout = decompress_data(pin, size, &lout);
+#endif
+  if (pout)
+    fuzz_parse(pout, lout);
+  mem_free_all();
+  if (fuzz_time_limit && fuzz_time() - start > fuzz_time_limit) {
+    fprintf(stderr, "Time limit %lu ms exceeded: %lu ms\n", fuzz_time_limit, fuzz_time() - start);
+    abort();
+  }
+  if (fuzz_memory_limit && memory_peak > fuzz_memory_limit) {
+    fprintf(stderr, "Memory limit %lu exceeded: %lu\n", (unsigned long)fuzz_memory_limit, (unsigned long)memory_peak);
+    abort();
+  }
+  return 0;
+}
+
+#ifdef FUZZ_MAIN
+int main(int argc, char *argv[]) {
+  FILE *fin;
+  char *buf;
+  size_t len;
+  int i;
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s input_file...\n", argv[0]);
+    return 1;
+  }
+  buf = malloc(0x800000);
+  if (!buf) {
+    fprintf(stderr, "Cannot allocate memory for input file\n");
+    return 1;
+  }
+  for (i = 1; i < argc; ++i) {
+    fin = fopen(argv[i], "rb");
+    if (!fin) {
+      fprintf(stderr, "Cannot open input file %s: %s\n", argv[i], strerror(errno));
+      continue;
+    }
+    len = fread(buf, 1, 0x800000, fin);
+    fclose(fin);
+    LLVMFuzzerTestOneInput((uint8_t *)buf, len);
+  }
+  free(buf);
+  return 0;
+}
+#endif
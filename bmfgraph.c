@@ -0,0 +1,476 @@
+/*
+    bmfgraph.c - Class graph of many binary MOF files (BMF)
+    Copyright (C) 2017  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; version 2.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#define main bmfparse_main
+#include "bmfparse.c"
+#undef main
+
+#include <ctype.h>
+
+/*
+ * Classes of all input files are indexed by namespace and name (WMI names
+ * are case insensitive, class without namespace is in root\default). When
+ * the same class is defined in more files, the first definition is used.
+ * Superclass of class is looked up in its namespace, so is class of object
+ * property, parameter and return value. Names starting with __ are system
+ * classes which are never defined in BMF and are not reported as dangling.
+ *
+ * Index keys without namespace collect entries of all namespaces, so name
+ * in query does not need namespace. Every class has list of its direct
+ * subclasses and methods are indexed by return type, so queries do not
+ * walk whole graph.
+ */
+
+struct graph_class {
+  const char *namespace;
+  const char *file;
+  struct mof_class *class;
+  struct graph_class *superclass;
+  uint32_t subclasses_count;
+  struct graph_class **subclasses;
+  uint32_t mark;
+};
+
+struct graph_method {
+  struct graph_class *class;
+  struct mof_method *method;
+};
+
+/* Map from namespace and name to list of items, open addressing */
+struct graph_entry {
+  uint64_t hash;
+  const char *namespace;  /* NULL for key of all namespaces */
+  const char *name;
+  uint32_t count;
+  void **items;
+};
+
+struct graph_map {
+  uint32_t count;
+  uint32_t size;
+  struct graph_entry *entries;
+};
+
+struct graph {
+  struct graph_map classes;   /* items are struct graph_class */
+  struct graph_map returns;   /* items are struct graph_method */
+  uint32_t classes_count;
+  struct graph_class **classes_list;  /* in order of input files */
+  uint32_t definitions_count;
+  uint32_t mark;
+};
+
+static const char *graph_default_namespace = "root\\default";
+
+static uint64_t graph_hash(const char *namespace, const char *name) {
+  uint64_t hash = HASH_INIT;
+  uint8_t c;
+  if (namespace) {
+    for (; *namespace; ++namespace) {
+      c = tolower((unsigned char)*namespace);
+      hash = hash_update(hash, &c, 1);
+    }
+  }
+  hash = hash_update(hash, "\xFF", 1);
+  for (; *name; ++name) {
+    c = tolower((unsigned char)*name);
+    hash = hash_update(hash, &c, 1);
+  }
+  return hash;
+}
+
+static int graph_key_equal(struct graph_entry *entry, uint64_t hash, const char *namespace, const char *name) {
+  if (entry->hash != hash || !entry->namespace != !namespace)
+    return 0;
+  return (!namespace || strcasecmp(entry->namespace, namespace) == 0) && strcasecmp(entry->name, name) == 0;
+}
+
+static struct graph_entry *graph_map_find(struct graph_map *map, const char *namespace, const char *name) {
+  uint64_t hash = graph_hash(namespace, name);
+  uint32_t i;
+  if (!map->size)
+    return NULL;
+  for (i = hash & (map->size-1); map->entries[i].name; i = (i+1) & (map->size-1)) {
+    if (graph_key_equal(&map->entries[i], hash, namespace, name))
+      return &map->entries[i];
+  }
+  return NULL;
+}
+
+/* Append item to list of key, key strings must live as long as map */
+static void graph_map_add(struct graph_map *map, const char *namespace, const char *name, void *item) {
+  struct graph_entry *entries;
+  struct graph_entry *entry;
+  uint64_t hash = graph_hash(namespace, name);
+  uint32_t size, i, j;
+  entry = graph_map_find(map, namespace, name);
+  if (!entry) {
+    if (2 * (map->count+1) > map->size) {
+      if (map->size > UINT32_MAX/4) error("Too many keys");
+      size = map->size ? 2 * map->size : 64;
+      entries = mem_calloc(size, sizeof(*entries));
+      if (!entries) error("calloc failed");
+      for (i = 0; i < map->size; ++i) {
+        if (!map->entries[i].name)
+          continue;
+        for (j = map->entries[i].hash & (size-1); entries[j].name; j = (j+1) & (size-1));
+        entries[j] = map->entries[i];
+      }
+      mem_free(map->entries);
+      map->entries = entries;
+      map->size = size;
+    }
+    for (i = hash & (map->size-1); map->entries[i].name; i = (i+1) & (map->size-1));
+    entry = &map->entries[i];
+    entry->hash = hash;
+    entry->namespace = namespace;
+    entry->name = name;
+    map->count++;
+  }
+  /* capacity doubles when count is power of two */
+  if (!(entry->count & (entry->count-1))) {
+    if (entry->count > UINT32_MAX/2) error("Too many items");
+    entry->items = mem_realloc(entry->items, (entry->count ? 2*entry->count : 1) * sizeof(*entry->items));
+    if (!entry->items) error("realloc failed");
+  }
+  entry->items[entry->count++] = item;
+}
+
+static struct graph_class *graph_find_class(struct graph *graph, const char *namespace, const char *name) {
+  struct graph_entry *entry = graph_map_find(&graph->classes, namespace, name);
+  return entry ? entry->items[0] : NULL;
+}
+
+static void graph_add_classes(struct graph *graph, struct mof_classes *classes, const char *file) {
+  struct graph_class *node;
+  struct graph_method *method;
+  struct mof_variable *ret;
+  const char *namespace;
+  const char *type;
+  uint32_t i, j;
+  for (i = 0; i < classes->count; ++i) {
+    if (!classes->classes[i].name)
+      continue;
+    graph->definitions_count++;
+    namespace = classes->classes[i].namespace ? classes->classes[i].namespace : graph_default_namespace;
+    if (graph_find_class(graph, namespace, classes->classes[i].name))
+      continue;
+    node = mem_calloc(1, sizeof(*node));
+    if (!node) error("calloc failed");
+    node->namespace = namespace;
+    node->file = file;
+    node->class = &classes->classes[i];
+    graph_map_add(&graph->classes, namespace, node->class->name, node);
+    graph_map_add(&graph->classes, NULL, node->class->name, node);
+    if (!(graph->classes_count & (graph->classes_count-1))) {
+      graph->classes_list = mem_realloc(graph->classes_list, (graph->classes_count ? 2*graph->classes_count : 1) * sizeof(*graph->classes_list));
+      if (!graph->classes_list) error("realloc failed");
+    }
+    graph->classes_list[graph->classes_count++] = node;
+    for (j = 0; j < node->class->methods_count; ++j) {
+      ret = &node->class->methods[j].return_value;
+      if (!ret->variable_type)
+        type = "void";
+      else if (ret->variable_type == MOF_VARIABLE_OBJECT || ret->variable_type == MOF_VARIABLE_OBJECT_ARRAY)
+        type = ret->type.object;
+      else
+        type = mof_basic_type_valid(ret->type.basic) ? mof_basic_types[ret->type.basic].mof_name : NULL;
+      if (!type || !*type)
+        continue;
+      method = mem_malloc(sizeof(*method));
+      if (!method) error("malloc failed");
+      method->class = node;
+      method->method = &node->class->methods[j];
+      graph_map_add(&graph->returns, namespace, type, method);
+      graph_map_add(&graph->returns, NULL, type, method);
+    }
+  }
+}
+
+/* Resolve superclasses and fill lists of direct subclasses */
+static void graph_resolve(struct graph *graph) {
+  struct graph_class *node;
+  struct graph_class *super;
+  uint32_t i;
+  for (i = 0; i < graph->classes_count; ++i) {
+    node = graph->classes_list[i];
+    if (!node->class->superclassname)
+      continue;
+    super = graph_find_class(graph, node->namespace, node->class->superclassname);
+    if (!super)
+      continue;
+    node->superclass = super;
+    if (!(super->subclasses_count & (super->subclasses_count-1))) {
+      super->subclasses = mem_realloc(super->subclasses, (super->subclasses_count ? 2*super->subclasses_count : 1) * sizeof(*super->subclasses));
+      if (!super->subclasses) error("realloc failed");
+    }
+    super->subclasses[super->subclasses_count++] = node;
+  }
+}
+
+static void graph_print_class(FILE *fout, struct graph_class *node) {
+  fprintf(fout, "%s:%s", node->namespace, node->class->name);
+}
+
+static int graph_is_system(const char *name) {
+  return name[0] == '_' && name[1] == '_';
+}
+
+/* Returns 1 and prints reference when class of object type is not defined */
+static int graph_dangling_variable(FILE *fout, struct graph *graph, struct graph_class *node, struct mof_variable *variable, const char *method, const char *name, const char *kind) {
+  if (variable->variable_type != MOF_VARIABLE_OBJECT && variable->variable_type != MOF_VARIABLE_OBJECT_ARRAY)
+    return 0;
+  if (!variable->type.object || !*variable->type.object || graph_is_system(variable->type.object) || graph_find_class(graph, node->namespace, variable->type.object))
+    return 0;
+  graph_print_class(fout, node);
+  if (method)
+    fprintf(fout, ".%s", method);
+  if (name)
+    fprintf(fout, ".%s", name);
+  fprintf(fout, " %s %s %s\n", kind, variable->type.object, node->file);
+  return 1;
+}
+
+/* Print superclasses and object references to classes which are not defined, returns their count */
+static uint32_t graph_dangling(FILE *fout, struct graph *graph) {
+  struct graph_class *node;
+  struct graph_class *super;
+  struct mof_method *method;
+  uint32_t count = 0;
+  uint32_t i, j, k;
+  for (i = 0; i < graph->classes_count; ++i) {
+    node = graph->classes_list[i];
+    if (node->class->superclassname && !node->superclass && !graph_is_system(node->class->superclassname)) {
+      graph_print_class(fout, node);
+      fprintf(fout, " superclass %s %s\n", node->class->superclassname, node->file);
+      count++;
+    }
+    /* cycle is found by walking from every class, mark stops at visited class */
+    ++graph->mark;
+    for (super = node->superclass; super && super->mark != graph->mark && super != node; super = super->superclass)
+      super->mark = graph->mark;
+    if (super == node) {
+      graph_print_class(fout, node);
+      fprintf(fout, " cycle %s %s\n", node->class->superclassname, node->file);
+      count++;
+    }
+    for (j = 0; j < node->class->variables_count; ++j)
+      count += graph_dangling_variable(fout, graph, node, &node->class->variables[j], NULL, node->class->variables[j].name, "reference");
+    for (j = 0; j < node->class->methods_count; ++j) {
+      method = &node->class->methods[j];
+      for (k = 0; k < method->parameters_count; ++k)
+        count += graph_dangling_variable(fout, graph, node, &method->parameters[k], method->name, method->parameters[k].name, "reference");
+      count += graph_dangling_variable(fout, graph, node, &method->return_value, method->name, NULL, "return");
+    }
+  }
+  return count;
+}
+
+/* Split "namespace:name" query, name without namespace matches all namespaces */
+static const char *graph_query_name(char *query, const char **namespace) {
+  char *sep = strrchr(query, ':');
+  if (!sep) {
+    *namespace = NULL;
+    return query;
+  }
+  *sep = 0;
+  *namespace = query;
+  return sep + 1;
+}
+
+static void graph_print_subclasses(FILE *fout, struct graph *graph, struct graph_class *node) {
+  uint32_t i;
+  node->mark = graph->mark;
+  for (i = 0; i < node->subclasses_count; ++i) {
+    if (node->subclasses[i]->mark == graph->mark)
+      continue;
+    graph_print_class(fout, node->subclasses[i]);
+    fprintf(fout, " %s\n", node->subclasses[i]->file);
+    graph_print_subclasses(fout, graph, node->subclasses[i]);
+  }
+}
+
+/* Print all (also indirect) subclasses of class, returns zero when class is defined */
+static int graph_subclasses(FILE *fout, struct graph *graph, char *query) {
+  struct graph_entry *entry;
+  const char *namespace;
+  const char *name;
+  uint32_t i;
+  name = graph_query_name(query, &namespace);
+  entry = graph_map_find(&graph->classes, namespace, name);
+  if (!entry) {
+    fprintf(stderr, "Class %s not found\n", name);
+    return 1;
+  }
+  ++graph->mark;
+  for (i = 0; i < entry->count; ++i)
+    graph_print_subclasses(fout, graph, entry->items[i]);
+  return 0;
+}
+
+/* Print methods which return type (basic type or class), returns zero when any was found */
+static int graph_returning(FILE *fout, struct graph *graph, char *query) {
+  struct graph_entry *entry;
+  struct graph_method *method;
+  const char *namespace;
+  const char *name;
+  uint32_t i;
+  name = graph_query_name(query, &namespace);
+  entry = graph_map_find(&graph->returns, namespace, name);
+  if (!entry) {
+    fprintf(stderr, "No method returns %s\n", name);
+    return 1;
+  }
+  for (i = 0; i < entry->count; ++i) {
+    method = entry->items[i];
+    graph_print_class(fout, method->class);
+    fprintf(fout, ".%s %s\n", method->method->name, method->class->file);
+  }
+  return 0;
+}
+
+/* Parse error of one file is not fatal, error() jumps back here */
+static int graph_load(const char *name, struct mof_classes *classes) {
+  jmp_buf *prev_jmp = error_jmp;
+  jmp_buf jmp;
+  FILE *fin;
+  uint32_t *pin;
+  char *pout;
+  size_t lin;
+  uint32_t lout;
+  fin = fopen(name, "rb");
+  if (!fin) {
+    fprintf(stderr, "Cannot open input file %s: %s\n", name, strerror(errno));
+    return 1;
+  }
+  diag_begin(name);
+  pin = read_input(fin, name, &lin);
+  fclose(fin);
+  if (!pin)
+    return 1;
+  pout = decompress_data(pin, lin, &lout);
+  mem_free(pin);
+  if (!pout)
+    return 1;
+  error_jmp = &jmp;
+  if (setjmp(jmp) != 0) {
+    error_jmp = prev_jmp;
+    mem_free(pout);
+    diag_flush();
+    return 1;
+  }
+  *classes = parse_bmf(pout, lout);
+  error_jmp = prev_jmp;
+  mem_free(pout);
+  diag_flush();
+  return 0;
+}
+
+/* Load files into graph, returns 2 when some file failed */
+static int graph_load_files(struct graph *graph, struct mof_classes *classes, int count, char *files[], uint32_t *loaded) {
+  int ret = 0;
+  int i;
+  for (i = 0; i < count; ++i) {
+    if (graph_load(files[i], &classes[i])) {
+      fprintf(stderr, "Loading of input file %s failed\n", files[i]);
+      ret = 2;
+      continue;
+    }
+    graph_add_classes(graph, &classes[i], files[i]);
+    (*loaded)++;
+  }
+  graph_resolve(graph);
+  return ret;
+}
+
+/* Error of graph itself is fatal, error() jumps back here and -1 is returned */
+static int graph_build(struct graph *graph, struct mof_classes *classes, int count, char *files[], uint32_t *loaded) {
+  jmp_buf jmp;
+  int ret;
+  if (setjmp(jmp) != 0) {
+    error_jmp = NULL;
+    return -1;
+  }
+  error_jmp = &jmp;
+  ret = graph_load_files(graph, classes, count, files, loaded);
+  error_jmp = NULL;
+  return ret;
+}
+
+int main(int argc, char *argv[]) {
+  struct mof_classes *classes;
+  struct graph graph;
+  uint32_t loaded = 0;
+  int queries = 0;
+  int stats = 0;
+  int ret = 0;
+  int argi, i;
+  for (argi = 1; argi < argc && argv[argi][0] == '-' && argv[argi][1]; ++argi) {
+    if (strncmp(argv[argi], "--subclasses=", strlen("--subclasses=")) == 0 || strncmp(argv[argi], "--returning=", strlen("--returning=")) == 0 || strcmp(argv[argi], "--dangling") == 0) {
+      queries++;
+    } else if (strcmp(argv[argi], "--stats") == 0) {
+      stats = 1;
+    } else if (strcmp(argv[argi], "--") == 0) {
+      ++argi;
+      break;
+    } else {
+      argc = 0;
+      break;
+    }
+  }
+  if (argc == 0 || argi >= argc || (!queries && !stats)) {
+    fprintf(stderr, "Usage: %s query... input_file...\n", argv[0]);
+    fprintf(stderr, "Queries:\n");
+    fprintf(stderr, "  --subclasses=[NS:]CLASS  list all direct and indirect subclasses of class\n");
+    fprintf(stderr, "  --returning=[NS:]TYPE    list methods which return type or class\n");
+    fprintf(stderr, "  --dangling               list references to classes which are not defined\n");
+    fprintf(stderr, "  --stats                  write number of files, classes and definitions\n");
+    fprintf(stderr, "Exit status is 0 on success, 1 if query found nothing or dangling reference, 2 on error.\n");
+    return 2;
+  }
+  memset(&graph, 0, sizeof(graph));
+  classes = calloc(argc-argi, sizeof(*classes));
+  if (!classes) {
+    fprintf(stderr, "Cannot allocate memory for classes\n");
+    return 2;
+  }
+  ret = graph_build(&graph, classes, argc-argi, argv+argi, &loaded);
+  if (ret < 0)
+    return 2;
+  if (stats)
+    printf("files %u classes %u definitions %u\n", loaded, graph.classes_count, graph.definitions_count);
+  for (i = 1; i < argi; ++i) {
+    if (strncmp(argv[i], "--subclasses=", strlen("--subclasses=")) == 0) {
+      if (graph_subclasses(stdout, &graph, argv[i] + strlen("--subclasses=")) && !ret)
+        ret = 1;
+    } else if (strncmp(argv[i], "--returning=", strlen("--returning=")) == 0) {
+      if (graph_returning(stdout, &graph, argv[i] + strlen("--returning=")) && !ret)
+        ret = 1;
+    } else if (strcmp(argv[i], "--dangling") == 0) {
+      if (graph_dangling(stdout, &graph) && !ret)
+        ret = 1;
+    }
+  }
+  if (fflush(stdout) != 0)
+    ret = 2;
+  for (i = argi; i < argc; ++i)
+    free_classes(classes[i-argi].classes, classes[i-argi].count);
+  free(classes);
+  mem_free_all();
+  return ret;
+}
@@ -17,22 +17,135 @@
 */
 
 #define process_data bmfdec_process_data
+#define check_data bmfdec_check_data
+#define dedupe_data bmfdec_dedupe_data
+#define output_supported bmfdec_output_supported
+#define process_outputs bmfdec_process_outputs
+#define parse_item bmfdec_parse_item
+#define print_item bmfdec_print_item
+#define release_item bmfdec_release_item
+#define stream_supported bmfdec_stream_supported
 #include "bmfdec.c"
 #undef process_data
+#undef check_data
+#undef dedupe_data
+#undef output_supported
+#undef process_outputs
+#undef parse_item
+#undef print_item
+#undef release_item
+#undef stream_supported
 
+#include <setjmp.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 
-#define error(str) do { fprintf(stderr, "error %s at %s:%d\n", str, __func__, __LINE__); exit(1); } while (0)
+/* when set, error() jumps there instead of exiting the program */
+static jmp_buf *error_jmp;
+
+#define error(str) do { fprintf(stderr, "error %s at %s:%d\n", str, __func__, __LINE__); if (error_jmp) longjmp(*error_jmp, 1); exit(1); } while (0)
+
+/* clock is read only every BUDGET_TICKS checks, see parse_deadline */
+#define BUDGET_TICKS 1024
+static unsigned parse_ticks;
+
+#define parse_budget_check() do { if (parse_deadline && ++parse_ticks % BUDGET_TICKS == 0 && budget_now() > parse_deadline) error("Parse time limit exceeded"); } while (0)
 
 #define check_sum(a, b, sum) (UINT32_MAX - (uint32_t)(a) >= (uint32_t)(b) && (uint32_t)(a)+(uint32_t)(b) <= (uint32_t)(sum))
 
+/* count records each at least min bytes long can fit into size bytes */
+#define check_count(count, size, min) ((uint32_t)(count) <= (uint32_t)(size) / (uint32_t)(min))
+
+static void *mem_calloc(size_t count, size_t size) {
+  void *ptr;
+  if (size && count > SIZE_MAX / size)
+    return NULL;
+  ptr = mem_malloc(count * size);
+  if (ptr)
+    memset(ptr, 0, count * size);
+  return ptr;
+}
+
+static void *mem_realloc(void *ptr, size_t size) {
+  struct mem_block *block;
+  void *out = mem_malloc(size);
+  if (!out || !ptr)
+    return out;
+  block = (struct mem_block *)ptr - 1;
+  memcpy(out, ptr, block->size < size ? block->size : size);
+  mem_free(ptr);
+  return out;
+}
+
+static char *mem_strdup(const char *str) {
+  char *out = mem_malloc(strlen(str)+1);
+  if (out)
+    strcpy(out, str);
+  return out;
+}
+
+/*
+ * Events of diagnostics sink (see bmfdec.c) are recorded only by parser.
+ * Recording is muted while already validated data are parsed again for
+ * printing, so every warning is counted once.
+ */
+static int diag_muted;
+
+static void diag_vevent(const char *kind, const char *ptr, const char *dump, uint32_t dump_size, const char *fmt, va_list ap) {
+  struct diag_event *event;
+  char message[128];
+  uint32_t i;
+  size_t len;
+  if (diag_mode == DIAG_SILENT || diag_muted)
+    return;
+  vsnprintf(message, sizeof(message), fmt, ap);
+  len = strlen(message);
+  if (len && message[len-1] == '\n')
+    message[len-1] = 0;
+  for (i = 0; i < diag_events_count; ++i) {
+    if (strcmp(diag_events[i].kind, kind) == 0 && strcmp(diag_events[i].message, message) == 0) {
+      diag_events[i].count++;
+      return;
+    }
+  }
+  if (diag_events_count == DIAG_MAX_EVENTS) {
+    diag_dropped++;
+    return;
+  }
+  event = &diag_events[diag_events_count++];
+  event->kind = kind;
+  event->count = 1;
+  event->offset = (ptr && diag_base && ptr >= diag_base && ptr < diag_base + diag_base_size) ? (uint32_t)(ptr - diag_base) : UINT32_MAX;
+  event->record = diag_record;
+  memcpy(event->member, diag_member, sizeof(event->member));
+  memcpy(event->message, message, sizeof(event->message));
+  event->dump_size = dump ? dump_size : 0;
+  if (dump)
+    memcpy(event->dump, dump, dump_size < DIAG_MAX_DUMP ? dump_size : DIAG_MAX_DUMP);
+}
+
+static void diag(const char *kind, const char *ptr, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  diag_vevent(kind, ptr, NULL, 0, fmt, ap);
+  va_end(ap);
+}
+
+/* Same as diag() with hexdump of data */
+static void diag_dump(const char *kind, const char *ptr, uint32_t size, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  diag_vevent(kind, ptr, ptr, size, fmt, ap);
+  va_end(ap);
+}
+
 enum mof_qualifier_type {
   MOF_QUALIFIER_UNKNOWN,
   MOF_QUALIFIER_BOOLEAN,
   MOF_QUALIFIER_SINT32,
   MOF_QUALIFIER_STRING,
+  MOF_QUALIFIER_STRING_ARRAY,
 };
 
 enum mof_variable_type {
@@ -68,6 +181,98 @@ enum mof_parameter_direction {
   MOF_PARAMETER_IN_OUT,
 };
 
+/* Names of basic types, name is used in CIMTYPE qualifier, mof_name in MOF */
+static const struct {
+  const char *name;
+  const char *mof_name;
+} mof_basic_types[] = {
+  [MOF_BASIC_TYPE_UNKNOWN] = { "unknown", NULL },
+  [MOF_BASIC_TYPE_STRING] = { "String", "string" },
+  [MOF_BASIC_TYPE_REAL64] = { "Real64", "real64" },
+  [MOF_BASIC_TYPE_REAL32] = { "Real32", "real32" },
+  [MOF_BASIC_TYPE_SINT32] = { "SInt32", "sint32" },
+  [MOF_BASIC_TYPE_UINT32] = { "UInt32", "uint32" },
+  [MOF_BASIC_TYPE_SINT16] = { "SInt16", "sint16" },
+  [MOF_BASIC_TYPE_UINT16] = { "UInt16", "uint16" },
+  [MOF_BASIC_TYPE_SINT64] = { "SInt64", "sint64" },
+  [MOF_BASIC_TYPE_UINT64] = { "UInt64", "uint64" },
+  [MOF_BASIC_TYPE_SINT8] = { "SInt8", "sint8" },
+  [MOF_BASIC_TYPE_UINT8] = { "UInt8", "uint8" },
+  [MOF_BASIC_TYPE_DATETIME] = { "Datetime", "datetime" },
+  [MOF_BASIC_TYPE_CHAR16] = { "Char16", "char16" },
+  [MOF_BASIC_TYPE_BOOLEAN] = { "Boolean", "boolean" },
+};
+
+#define mof_basic_type_valid(type) ((unsigned)(type) < sizeof(mof_basic_types)/sizeof(mof_basic_types[0]))
+
+/* Well-known qualifier and property names */
+enum mof_name {
+  MOF_NAME_UNKNOWN,
+  MOF_NAME_CIMTYPE,
+  MOF_NAME_MAX,
+  MOF_NAME_ID,
+  MOF_NAME_IN,
+  MOF_NAME_OUT,
+  MOF_NAME_RETURN_VALUE,
+  MOF_NAME_PARAMETERS,
+  MOF_NAME_CLASS,
+  MOF_NAME_NAMESPACE,
+  MOF_NAME_SUPERCLASS,
+  MOF_NAME_CLASSFLAGS,
+};
+
+/*
+ * Perfect hash of name from its length, first and two last characters
+ * (lower case for letters). Multipliers and table sizes below were found
+ * by search so that every name in table has its own slot, lookup then
+ * needs only one string compare.
+ */
+static inline unsigned mof_name_hash(const char *name, size_t len, unsigned a, unsigned b, unsigned c, unsigned size) {
+  if (len < 2)
+    return size;
+  return ((unsigned char)(name[0] | 0x20) * a + (unsigned char)(name[len-2] | 0x20) * b + (unsigned char)(name[len-1] | 0x20) + len * c) % size;
+}
+
+/* Type name from CIMTYPE qualifier (case insensitive) to basic type */
+static enum mof_basic_type mof_basic_type_lookup(const char *name) {
+  static const unsigned char slots[32] = {
+    [1] = MOF_BASIC_TYPE_UINT16, [2] = MOF_BASIC_TYPE_REAL32, [3] = MOF_BASIC_TYPE_SINT32,
+    [4] = MOF_BASIC_TYPE_STRING, [5] = MOF_BASIC_TYPE_UINT32, [9] = MOF_BASIC_TYPE_BOOLEAN,
+    [10] = MOF_BASIC_TYPE_SINT8, [12] = MOF_BASIC_TYPE_UINT8, [15] = MOF_BASIC_TYPE_CHAR16,
+    [16] = MOF_BASIC_TYPE_REAL64, [17] = MOF_BASIC_TYPE_SINT64, [19] = MOF_BASIC_TYPE_UINT64,
+    [21] = MOF_BASIC_TYPE_DATETIME, [31] = MOF_BASIC_TYPE_SINT16,
+  };
+  unsigned slot = mof_name_hash(name, strlen(name), 1, 4, 3, 32);
+  if (slot >= 32 || !slots[slot] || strcasecmp(name, mof_basic_types[slots[slot]].name) != 0)
+    return MOF_BASIC_TYPE_UNKNOWN;
+  return slots[slot];
+}
+
+/* Well-known name to enum, only "in" and "out" are case insensitive */
+static enum mof_name mof_name_lookup(const char *name) {
+  static const struct {
+    const char *name;
+    enum mof_name value;
+  } slots[16] = {
+    [2] = { "CIMTYPE", MOF_NAME_CIMTYPE }, [3] = { "out", MOF_NAME_OUT },
+    [4] = { "__CLASSFLAGS", MOF_NAME_CLASSFLAGS }, [6] = { "__PARAMETERS", MOF_NAME_PARAMETERS },
+    [7] = { "ReturnValue", MOF_NAME_RETURN_VALUE }, [8] = { "__NAMESPACE", MOF_NAME_NAMESPACE },
+    [9] = { "in", MOF_NAME_IN }, [12] = { "__SUPERCLASS", MOF_NAME_SUPERCLASS },
+    [13] = { "MAX", MOF_NAME_MAX }, [14] = { "__CLASS", MOF_NAME_CLASS },
+    [15] = { "ID", MOF_NAME_ID },
+  };
+  unsigned slot = mof_name_hash(name, strlen(name), 1, 6, 6, 16);
+  if (slot >= 16 || !slots[slot].name)
+    return MOF_NAME_UNKNOWN;
+  if (slots[slot].value == MOF_NAME_IN || slots[slot].value == MOF_NAME_OUT) {
+    if (strcasecmp(name, slots[slot].name) != 0)
+      return MOF_NAME_UNKNOWN;
+  } else if (strcmp(name, slots[slot].name) != 0) {
+    return MOF_NAME_UNKNOWN;
+  }
+  return slots[slot].value;
+}
+
 struct mof_qualifier {
   enum mof_qualifier_type type;
   char *name;
@@ -79,9 +284,21 @@ struct mof_qualifier {
     uint8_t boolean;
     int32_t sint32;
     char *string;
+    struct {
+      uint32_t count;
+      char **values; /* pointers followed by string data in one block */
+    } strings;
   } value;
 };
 
+/* Default value of basic type, boolean and char16 are stored in uint */
+union mof_value {
+  int64_t sint;
+  uint64_t uint;
+  double real;
+  char *string;
+};
+
 struct mof_variable {
   uint32_t qualifiers_count;
   struct mof_qualifier *qualifiers;
@@ -93,6 +310,9 @@ struct mof_variable {
   } type;
   int32_t array_max;
   uint8_t has_array_max;
+  uint8_t has_value;
+  uint32_t values_count;
+  union mof_value *values;
 };
 
 struct mof_method {
@@ -123,11 +343,9 @@ struct mof_classes {
   struct mof_class *classes;
 };
 
-static char *parse_string(char *buf, uint32_t size) {
+/* Convert UTF-16 to UTF-8, out needs size/2*3+1 bytes, returns length */
+static uint32_t convert_string(char *out, char *buf, uint32_t size) {
   uint16_t *buf2 = (uint16_t *)buf;
-  if (size % 2 != 0) error("Invalid size");
-  char *out = malloc(size+1);
-  if (!out) error("malloc failed");
   uint32_t i, j;
   for (i=0, j=0; i<size/2; ++i) {
     if (buf2[i] == 0) {
@@ -151,38 +369,15 @@ static char *parse_string(char *buf, uint32_t size) {
     }
   }
   out[j] = 0;
-  return out;
-}
-
-static char to_ascii(char c) {
-  if (c >= 32 && c <= 126)
-    return c;
-  return '.';
+  return j;
 }
 
-static void dump_bytes(char *buf, uint32_t size) {
-  uint32_t i, ascii_cnt = 0;
-  char ascii[17] = { 0, };
-  for (i=0; i<size; i++) {
-    if (i % 16 == 0) {
-      if (i != 0) {
-        fprintf(stderr, "  |%s|\n", ascii);
-        ascii[0] = 0;
-        ascii_cnt = 0;
-      }
-      fprintf(stderr, "%04X:", (unsigned int)i);
-    }
-    fprintf(stderr, " %02X", buf[i] & 0xFF);
-    ascii[ascii_cnt] = to_ascii(buf[i]);
-    ascii[ascii_cnt + 1] = 0;
-    ascii_cnt++;
-  }
-  if (ascii[0]) {
-    if (size % 16)
-      for (i=0; i<16-(size%16); i++)
-        fprintf(stderr, "   ");
-    fprintf(stderr, "  |%s|\n", ascii);
-  }
+static char *parse_string(char *buf, uint32_t size) {
+  if (size % 2 != 0) error("Invalid size");
+  char *out = mem_malloc(size/2*3+1);
+  if (!out) error("malloc failed");
+  convert_string(out, buf, size);
+  return out;
 }
 
 static struct mof_qualifier parse_qualifier_boolean(char *buf, uint32_t size, uint32_t val) {
@@ -213,6 +408,199 @@ static struct mof_qualifier parse_qualifier_string(char *buf, uint32_t size, cha
   return out;
 }
 
+/* Size of one element of value of given type, 0 for UTF-16 strings */
+static uint32_t value_size(uint32_t type) {
+  switch (type & 0xFF) {
+  case 0x10: case 0x11:
+    return 1;
+  case 0x02: case 0x0B: case 0x12: case 0x67:
+    return 2;
+  case 0x03: case 0x04: case 0x13:
+    return 4;
+  case 0x05: case 0x14: case 0x15:
+    return 8;
+  default:
+    return 0;
+  }
+}
+
+/*
+ * Scalar value is stored directly (strings are NUL terminated UTF-16).
+ * Array (type 0x20xx) is u32 length (with header), u32 count and packed
+ * elements. Returns 1 when value is invalid, otherwise first element
+ * and count of elements.
+ */
+static int check_value(char *buf, uint32_t size, uint32_t type, char **start, uint32_t *count) {
+  uint32_t esize = value_size(type);
+  uint32_t len, i, j;
+  uint16_t *str;
+  if ((type >> 8) != 0x20) {
+    if (esize ? size < esize : size % 2 != 0)
+      return 1;
+    *start = buf;
+    *count = 1;
+    return 0;
+  }
+  if (size < 8)
+    return 1;
+  len = ((uint32_t *)buf)[0];
+  *count = ((uint32_t *)buf)[1];
+  *start = buf+8;
+  if (len < 8 || len > size)
+    return 1;
+  if (esize)
+    return check_count(*count, len-8, esize) ? 0 : 1;
+  if (len % 2 != 0 || !check_count(*count, len-8, 2))
+    return 1;
+  str = (uint16_t *)(buf+8);
+  for (i=0, j=0; i<*count; ++i, ++j) {
+    while (j < (len-8)/2 && str[j] != 0)
+      ++j;
+    if (j == (len-8)/2)
+      return 1;
+  }
+  return 0;
+}
+
+static struct mof_qualifier parse_qualifier_string_array(char *buf, uint32_t size, char *buf2, uint32_t size2) {
+  struct mof_qualifier out;
+  memset(&out, 0, sizeof(out));
+  char *str;
+  uint32_t count, i, len;
+  if (check_value(buf2, size2, 0x2008, &str, &count)) error("Invalid string array");
+  out.type = MOF_QUALIFIER_STRING_ARRAY;
+  out.name = parse_string(buf, size);
+  out.value.strings.count = count;
+  out.value.strings.values = mem_malloc(count*sizeof(char *) + (((uint32_t *)buf2)[0]-8)/2*3);
+  if (!out.value.strings.values) error("malloc failed");
+  char *data = (char *)(out.value.strings.values + count);
+  for (i=0; i<count; ++i) {
+    for (len=0; ((uint16_t *)str)[len] != 0; ++len);
+    out.value.strings.values[i] = data;
+    data += convert_string(data, str, len*2) + 1;
+    str += (len+1)*2;
+  }
+  return out;
+}
+
+static void parse_class_variable_value(char *buf, uint32_t size, uint32_t type, struct mof_variable *out) {
+  uint32_t esize = value_size(type);
+  uint32_t count, i, len;
+  char *tmp;
+  if (check_value(buf, size, type, &tmp, &count)) error("Invalid value");
+  out->values = mem_calloc(count, sizeof(*out->values));
+  if (!out->values) error("calloc failed");
+  out->values_count = count;
+  out->has_value = 1;
+  for (i=0; i<count; ++i) {
+    parse_budget_check();
+    switch (type & 0xFF) {
+    case 0x10: out->values[i].sint = *(int8_t *)tmp; break;
+    case 0x11: out->values[i].uint = *(uint8_t *)tmp; break;
+    case 0x02: out->values[i].sint = *(int16_t *)tmp; break;
+    case 0x12: out->values[i].uint = *(uint16_t *)tmp; break;
+    case 0x03: out->values[i].sint = *(int32_t *)tmp; break;
+    case 0x13: out->values[i].uint = *(uint32_t *)tmp; break;
+    case 0x14: out->values[i].sint = *(int64_t *)tmp; break;
+    case 0x15: out->values[i].uint = *(uint64_t *)tmp; break;
+    case 0x04: out->values[i].real = *(float *)tmp; break;
+    case 0x05: out->values[i].real = *(double *)tmp; break;
+    case 0x0B: out->values[i].uint = *(uint16_t *)tmp ? 1 : 0; break;
+    case 0x67: out->values[i].uint = *(uint16_t *)tmp; break;
+    default:
+      for (len=0; len < (buf+size-tmp)/2 && ((uint16_t *)tmp)[len] != 0; ++len);
+      out->values[i].string = parse_string(tmp, len*2);
+      esize = (len+1)*2;
+      break;
+    }
+    tmp += esize;
+  }
+}
+
+/*
+ * Second part of BMF (offsets of qualifiers with their flavors) sorted by
+ * offset, so qualifier finds its entries by binary search instead of scan
+ * of whole second part. Used entries are marked in used, buffer is not
+ * modified. Offset can be repeated, then qualifier uses all its entries.
+ */
+struct flavor_entry {
+  uint32_t offset;
+  uint32_t flavors;
+  uint32_t index;  /* in second part */
+};
+
+struct flavor_table {
+  uint32_t count;
+  struct flavor_entry *entries;
+  uint8_t *used;
+};
+
+static int cmp_flavor_entry(const void *a, const void *b) {
+  const struct flavor_entry *ea = a;
+  const struct flavor_entry *eb = b;
+  if (ea->offset != eb->offset)
+    return (ea->offset < eb->offset) ? -1 : 1;
+  return (ea->index < eb->index) ? -1 : (ea->index > eb->index);
+}
+
+/* Index count pairs of second part, returns nonzero when allocation failed */
+static int flavor_table_init(struct flavor_table *table, char *part, uint32_t count) {
+  uint32_t i;
+  memset(table, 0, sizeof(*table));
+  if (!count)
+    return 0;
+  table->entries = malloc(count * sizeof(*table->entries));
+  table->used = calloc(count, 1);
+  if (!table->entries || !table->used) {
+    free(table->entries);
+    free(table->used);
+    memset(table, 0, sizeof(*table));
+    return 1;
+  }
+  for (i=0; i<count; ++i) {
+    table->entries[i].offset = ((uint32_t *)part)[2*i];
+    table->entries[i].flavors = ((uint32_t *)part)[2*i+1];
+    table->entries[i].index = i;
+  }
+  qsort(table->entries, count, sizeof(*table->entries), cmp_flavor_entry);
+  table->count = count;
+  return 0;
+}
+
+static void flavor_table_free(struct flavor_table *table) {
+  free(table->entries);
+  free(table->used);
+  memset(table, 0, sizeof(*table));
+}
+
+/* Returns position of first entry with offset, number of such entries is stored into n */
+static uint32_t flavor_table_find(struct flavor_table *table, uint32_t offset, uint32_t *n) {
+  uint32_t lo = 0, hi = table->count, mid;
+  while (lo < hi) {
+    mid = lo + (hi-lo)/2;
+    if (table->entries[mid].offset < offset)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  for (*n = 0; lo+*n < table->count && table->entries[lo+*n].offset == offset; ++*n);
+  return lo;
+}
+
+/* Returns index in second part of first entry which was not used, or count when all were used */
+static uint32_t flavor_table_unused(struct flavor_table *table) {
+  uint32_t first = table->count;
+  uint32_t i;
+  for (i=0; i<table->count; ++i) {
+    if (!table->used[i] && table->entries[i].index < first)
+      first = table->entries[i].index;
+  }
+  return first;
+}
+
+/* Second part of document parsed by parse_bmf_classes() and parse_bmf_instances() */
+static struct flavor_table parse_flavors;
+
 static struct mof_qualifier parse_qualifier(char *buf, uint32_t size, uint32_t offset) {
   struct mof_qualifier out;
   memset(&out, 0, sizeof(out));
@@ -234,28 +622,18 @@ static struct mof_qualifier parse_qualifier(char *buf, uint32_t size, uint32_t o
     out = parse_qualifier_string(buf+16, len, buf+16+len, size-len-16);
     break;
   case 0x2008:
-    fprintf(stderr, "Warning: ValueMap and Values qualifiers are not supported yet\n");
+    out = parse_qualifier_string_array(buf+16, len, buf+16+len, size-len-16);
     break;
   default:
-    fprintf(stderr, "Warning: Unknown qualifier type 0x%x\n", type);
-    fprintf(stderr, "Hexdump:\n");
-    dump_bytes(buf+16, len);
-    if (len+16 < size) {
-      fprintf(stderr, "...continue...\n");
-      dump_bytes(buf+16+len, size-len-16);
-    }
+    diag_dump("qualifier-type", buf, size, "Unknown qualifier type 0x%x", type);
     break;
   }
   if (offset) {
-    uint32_t i;
-    uint32_t olen = ((uint32_t *)(buf-offset))[1];
-    uint32_t count = ((uint32_t *)(buf-offset+olen+16))[0];
-    for (i=0; i<count; ++i) {
-      uint32_t *offset_addr = (uint32_t *)(buf-offset+olen+16+4) + 2*i;
-      if (*offset_addr != offset)
-        continue;
-      *offset_addr = 0;
-      uint32_t flavors = ((uint32_t *)(buf-offset+olen+16+4))[2*i+1];
+    TRACE_BEGIN(qualifier_flavors, trace_offset(buf), trace_class);
+    uint32_t i, n;
+    for (i = flavor_table_find(&parse_flavors, offset, &n); n > 0; ++i, --n) {
+      uint32_t flavors = parse_flavors.entries[i].flavors;
+      parse_flavors.used[i] = 1;
       if (flavors & (1U << 0))
         out.toinstance = 1;
       if (flavors & (1U << 1))
@@ -265,8 +643,9 @@ static struct mof_qualifier parse_qualifier(char *buf, uint32_t size, uint32_t o
       if (flavors & (1U << 7))
         out.amended = 1;
       if (flavors & ~((1U << 0) | (1U << 1) | (1U << 4) | (1U << 7)))
-        fprintf(stderr, "Warning: Unknown qualifier flavors 0x%x in second part for %s\n", flavors, out.name);
+        diag("qualifier-flavors", buf, "Unknown qualifier flavors 0x%x in second part for %s", flavors, out.name);
     }
+    TRACE_END(qualifier_flavors, trace_offset(buf+size), trace_class);
   }
   return out;
 }
@@ -286,9 +665,7 @@ static struct mof_variable parse_class_variable(char *buf, uint32_t size, uint32
     is_array = 1;
     break;
   default:
-    fprintf(stderr, "Warning: unknown variable type 0x%x\n", type);
-    fprintf(stderr, "Hexdump:\n");
-    dump_bytes(buf, size);
+    diag_dump("variable-type", buf, size, "Unknown variable type 0x%x", type);
     return out;
   }
   switch (type & 0xFF) {
@@ -338,9 +715,7 @@ static struct mof_variable parse_class_variable(char *buf, uint32_t size, uint32
     /* object */
     break;
   default:
-    fprintf(stderr, "Warning: unknown variable type 0x%x\n", type);
-    fprintf(stderr, "Hexdump:\n");
-    dump_bytes(buf, size);
+    diag_dump("variable-type", buf, size, "Unknown variable type 0x%x", type);
     return out;
   }
   if ((type & 0xFF) == 0x0D) {
@@ -361,10 +736,14 @@ static struct mof_variable parse_class_variable(char *buf, uint32_t size, uint32
   if (slen != 0xFFFFFFFF) {
     if (!check_sum(20, slen, size) || slen > len) error("Invalid size");
     out.name = parse_string(buf+20, slen);
-    fprintf(stderr, "Warning: Variable value is not supported yet\n");
-    dump_bytes(buf+20+slen, len-slen);
+    diag_context(diag_record, out.name);
+    if ((type & 0xFF) == 0x0D)
+      diag("variable-value", buf+20+slen, "Object variable value is not supported yet");
+    else
+      parse_class_variable_value(buf+20+slen, len-slen, type, &out);
   } else {
     out.name = parse_string(buf+20, len);
+    diag_context(diag_record, out.name);
   }
   if (!check_sum(20+8, len, size)) error("Invalid size");
   buf2 = (uint32_t *)(buf+20+len);
@@ -373,7 +752,8 @@ static struct mof_variable parse_class_variable(char *buf, uint32_t size, uint32
   uint32_t count = buf2[1];
   uint32_t i;
   char *tmp = buf+20+len+8;
-  out.qualifiers = calloc(count, sizeof(*out.qualifiers));
+  if (!check_count(count, len1, 16)) error("Invalid count");
+  out.qualifiers = mem_calloc(count, sizeof(*out.qualifiers));
   if (!out.qualifiers) error("calloc failed");
   for (i=0; i<count; ++i) {
     if (tmp-buf <= 20+8 || tmp-buf >= UINT32_MAX) error("Invalid size");
@@ -383,54 +763,26 @@ static struct mof_variable parse_class_variable(char *buf, uint32_t size, uint32
     if (!check_sum(tmp-buf, len2, 20+len+8+len1)) error("Invalid size"); /* if (tmp+len2 > buf+20+len+8+len1) */
     out.qualifiers[out.qualifiers_count] = parse_qualifier(tmp, len2, offset ? offset+tmp-buf : 0);
     if (out.qualifiers[out.qualifiers_count].name) {
-      if (out.qualifiers[out.qualifiers_count].type == MOF_QUALIFIER_STRING && strcmp(out.qualifiers[out.qualifiers_count].name, "CIMTYPE") == 0) {
+      if (out.qualifiers[out.qualifiers_count].type == MOF_QUALIFIER_STRING && mof_name_lookup(out.qualifiers[out.qualifiers_count].name) == MOF_NAME_CIMTYPE) {
         if (out.variable_type == MOF_VARIABLE_OBJECT || out.variable_type == MOF_VARIABLE_OBJECT_ARRAY) {
           if (strncmp(out.qualifiers[out.qualifiers_count].value.string, "object:", strlen("object:")) != 0)
             error("object without 'object:' in CIMTYPE");
-          out.type.object = strdup(out.qualifiers[out.qualifiers_count].value.string + strlen("object:"));
-          free(out.qualifiers[out.qualifiers_count].name);
-          free(out.qualifiers[out.qualifiers_count].value.string);
+          out.type.object = mem_strdup(out.qualifiers[out.qualifiers_count].value.string + strlen("object:"));
+          if (!out.type.object) error("strdup failed");
+          mem_free(out.qualifiers[out.qualifiers_count].name);
+          mem_free(out.qualifiers[out.qualifiers_count].value.string);
         } else {
-          char *strtype = out.qualifiers[out.qualifiers_count].value.string;
-          enum mof_basic_type basic_type;
-          if (strcasecmp(strtype, "String") == 0)
-            basic_type = MOF_BASIC_TYPE_STRING;
-          else if (strcasecmp(strtype, "Real64") == 0)
-            basic_type = MOF_BASIC_TYPE_REAL64;
-          else if (strcasecmp(strtype, "Real32") == 0)
-            basic_type = MOF_BASIC_TYPE_REAL32;
-          else if (strcasecmp(strtype, "SInt32") == 0)
-            basic_type = MOF_BASIC_TYPE_SINT32;
-          else if (strcasecmp(strtype, "UInt32") == 0)
-            basic_type = MOF_BASIC_TYPE_UINT32;
-          else if (strcasecmp(strtype, "SInt16") == 0)
-            basic_type = MOF_BASIC_TYPE_SINT16;
-          else if (strcasecmp(strtype, "UInt16") == 0)
-            basic_type = MOF_BASIC_TYPE_UINT16;
-          else if (strcasecmp(strtype, "SInt64") == 0)
-            basic_type = MOF_BASIC_TYPE_SINT64;
-          else if (strcasecmp(strtype, "UInt64") == 0)
-            basic_type = MOF_BASIC_TYPE_UINT64;
-          else if (strcasecmp(strtype, "SInt8") == 0)
-            basic_type = MOF_BASIC_TYPE_SINT8;
-          else if (strcasecmp(strtype, "UInt8") == 0)
-            basic_type = MOF_BASIC_TYPE_UINT8;
-          else if (strcasecmp(strtype, "Datetime") == 0)
-            basic_type = MOF_BASIC_TYPE_DATETIME;
-          else if (strcasecmp(strtype, "Char16") == 0)
-            basic_type = MOF_BASIC_TYPE_CHAR16;
-          else if (strcasecmp(strtype, "Boolean") == 0)
-            basic_type = MOF_BASIC_TYPE_BOOLEAN;
-          else
+          enum mof_basic_type basic_type = mof_basic_type_lookup(out.qualifiers[out.qualifiers_count].value.string);
+          if (basic_type == MOF_BASIC_TYPE_UNKNOWN)
             error("unknown basic type");
-          free(out.qualifiers[out.qualifiers_count].value.string);
-          free(out.qualifiers[out.qualifiers_count].name);
+          mem_free(out.qualifiers[out.qualifiers_count].value.string);
+          mem_free(out.qualifiers[out.qualifiers_count].name);
           if (basic_type != out.type.basic) error("basic type does not match");
         }
-      } else if (out.qualifiers[out.qualifiers_count].type == MOF_QUALIFIER_SINT32 && strcmp(out.qualifiers[out.qualifiers_count].name, "MAX") == 0 && is_array) {
+      } else if (out.qualifiers[out.qualifiers_count].type == MOF_QUALIFIER_SINT32 && mof_name_lookup(out.qualifiers[out.qualifiers_count].name) == MOF_NAME_MAX && is_array) {
         out.array_max = out.qualifiers[out.qualifiers_count].value.sint32;
         out.has_array_max = 1;
-        free(out.qualifiers[out.qualifiers_count].name);
+        mem_free(out.qualifiers[out.qualifiers_count].name);
       } else {
         out.qualifiers_count++;
       }
@@ -454,6 +806,15 @@ static int cmp_qualifiers(struct mof_qualifier *a, struct mof_qualifier *b) {
     return (a->value.sint32 != b->value.sint32) ? 1 : 0;
   case MOF_QUALIFIER_STRING:
     return strcmp(a->value.string, b->value.string) ? 1 : 0;
+  case MOF_QUALIFIER_STRING_ARRAY: {
+    uint32_t i;
+    if (a->value.strings.count != b->value.strings.count)
+      return 1;
+    for (i = 0; i < a->value.strings.count; ++i)
+      if (strcmp(a->value.strings.values[i], b->value.strings.values[i]) != 0)
+        return 1;
+    return 0;
+  }
   default:
     return 1;
   }
@@ -479,6 +840,7 @@ static int cmp_variables(struct mof_variable *a, struct mof_variable *b) {
 static void parse_class_method_parameters(char *buf, uint32_t size, struct mof_method *out, uint32_t offset) {
   struct mof_class *parameters;
   uint32_t *buf2 = (uint32_t *)buf;
+  TRACE_BEGIN(parse_class_method_parameters, trace_offset(buf), trace_class);
   if (size < 16) error("Invalid size");
   if (buf2[1] != 0x1) error("Invalid unknown");
   uint32_t count = buf2[2];
@@ -487,9 +849,11 @@ static void parse_class_method_parameters(char *buf, uint32_t size, struct mof_m
   if (len+12 != size) error("Invalid size?");
   uint32_t i;
   char *tmp = buf+16;
-  parameters = calloc(count, sizeof(*parameters));
+  if (!check_count(count, len, 20)) error("Invalid count");
+  parameters = mem_calloc(count, sizeof(*parameters));
   if (!parameters) error("calloc failed");
   for (i=0; i<count; ++i) {
+    parse_budget_check();
     buf2 = (uint32_t *)tmp;
     if (tmp-buf >= UINT32_MAX) error("Invalid size");
     if (!check_sum(4, tmp-buf, len)) error("Invalid size");
@@ -502,23 +866,24 @@ static void parse_class_method_parameters(char *buf, uint32_t size, struct mof_m
     if (len2 >= len || !check_sum(tmp-buf, 20-16, len-len2)) error("Invalid size"); /* if (tmp+len2+20 > buf+16+len) */
     if (buf2[4] != 0x1) error("Invalid unknown");
     parameters[i] = parse_class_data(tmp+20, len2, len2, 0, offset ? offset+tmp+20-buf : 0);
-    if (strcmp(parameters[i].name, "__PARAMETERS") != 0) error("Invalid parameters class name");
+    if (!parameters[i].name || mof_name_lookup(parameters[i].name) != MOF_NAME_PARAMETERS) error("Invalid parameters class name");
     tmp += len1;
   }
   uint32_t variables_count = 0;
   for (i=0; i<count; ++i) {
     variables_count += parameters[i].variables_count;
   }
-  uint8_t *parameters_map = calloc(variables_count, sizeof(uint8_t));
+  uint8_t *parameters_map = mem_calloc(variables_count, sizeof(uint8_t));
   if (!parameters_map) error("calloc failed");
   uint32_t j, k;
   for (i=0; i<count; ++i) {
     for (j=0; j<parameters[i].variables_count; ++j) {
       int processed = 0;
+      if (!parameters[i].variables[j].name) error("Invalid parameter");
       for (k=0; k<parameters[i].variables[j].qualifiers_count; ++k) {
         if (parameters[i].variables[j].qualifiers[k].type != MOF_QUALIFIER_SINT32)
           continue;
-        if (strcmp(parameters[i].variables[j].qualifiers[k].name, "ID") != 0)
+        if (mof_name_lookup(parameters[i].variables[j].qualifiers[k].name) != MOF_NAME_ID)
           continue;
         if (processed) error("parameter has more IDs");
         int32_t id = parameters[i].variables[j].qualifiers[k].value.sint32;
@@ -526,7 +891,7 @@ static void parse_class_method_parameters(char *buf, uint32_t size, struct mof_m
         parameters_map[id] = 1;
         processed = 1;
       }
-      int return_value = (strcmp(parameters[i].variables[j].name, "ReturnValue") == 0) ? 1 : 0;
+      int return_value = (mof_name_lookup(parameters[i].variables[j].name) == MOF_NAME_RETURN_VALUE) ? 1 : 0;
       if (!(processed ^ return_value)) error("variable is not parameter nor return value");
     }
   }
@@ -538,9 +903,9 @@ static void parse_class_method_parameters(char *buf, uint32_t size, struct mof_m
     }
   }
   out->parameters_count = parameters_count;
-  out->parameters = calloc(parameters_count, sizeof(*out->parameters));
-  out->parameters_direction = calloc(parameters_count, sizeof(*out->parameters_direction));
-  if (!out->parameters) error("calloc failed");
+  out->parameters = mem_calloc(parameters_count, sizeof(*out->parameters));
+  out->parameters_direction = mem_calloc(parameters_count, sizeof(*out->parameters_direction));
+  if (!out->parameters || !out->parameters_direction) error("calloc failed");
   int has_return_value = 0;
   for (i=0; i<count; ++i) {
     for (j=0; j<parameters[i].variables_count; ++j) {
@@ -549,7 +914,7 @@ static void parse_class_method_parameters(char *buf, uint32_t size, struct mof_m
       for (k=0; k<variable.qualifiers_count; ++k) {
         if (variable.qualifiers[k].type != MOF_QUALIFIER_SINT32)
           continue;
-        if (strcmp(variable.qualifiers[k].name, "ID") != 0)
+        if (mof_name_lookup(variable.qualifiers[k].name) != MOF_NAME_ID)
           continue;
         id = variable.qualifiers[k].value.sint32;
         break;
@@ -557,12 +922,13 @@ static void parse_class_method_parameters(char *buf, uint32_t size, struct mof_m
       if (id != -1) {
         if (parameters_map[id] == 2) {
           if (cmp_variables(&out->parameters[id], &variable) != 0) error("two variables at same position");
-          out->parameters[id].qualifiers = realloc(out->parameters[id].qualifiers, (out->parameters[id].qualifiers_count+variable.qualifiers_count-1)*sizeof(*out->parameters[id].qualifiers));
+          out->parameters[id].qualifiers = mem_realloc(out->parameters[id].qualifiers, (out->parameters[id].qualifiers_count+variable.qualifiers_count-1)*sizeof(*out->parameters[id].qualifiers));
           if (!out->parameters[id].qualifiers) error("realloc failed");
         } else {
           out->parameters[id] = variable;
           out->parameters[id].qualifiers_count = 0;
-          out->parameters[id].qualifiers = calloc(variable.qualifiers_count-1, sizeof(*out->parameters[id].qualifiers));
+          out->parameters[id].qualifiers = mem_calloc(variable.qualifiers_count-1, sizeof(*out->parameters[id].qualifiers));
+          if (!out->parameters[id].qualifiers) error("calloc failed");
           parameters_map[id] = 2;
           memset(&parameters[i].variables[j], 0, sizeof(parameters[i].variables[j]));
           parameters[i].variables[j].qualifiers_count = variable.qualifiers_count;
@@ -570,16 +936,16 @@ static void parse_class_method_parameters(char *buf, uint32_t size, struct mof_m
         }
         for (k=0; k<variable.qualifiers_count; ++k) {
           if (variable.qualifiers[k].type == MOF_QUALIFIER_SINT32 &&
-              strcmp(variable.qualifiers[k].name, "ID") == 0)
+              mof_name_lookup(variable.qualifiers[k].name) == MOF_NAME_ID)
             continue;
           if (variable.qualifiers[k].type == MOF_QUALIFIER_BOOLEAN) {
-            if (strcasecmp(variable.qualifiers[k].name, "in") == 0) {
+            if (mof_name_lookup(variable.qualifiers[k].name) == MOF_NAME_IN) {
               if (!out->parameters_direction[id])
                 out->parameters_direction[id] = MOF_PARAMETER_IN;
               else
                 out->parameters_direction[id] = MOF_PARAMETER_IN_OUT;
               continue;
-            } else if (strcasecmp(variable.qualifiers[k].name, "out") == 0) {
+            } else if (mof_name_lookup(variable.qualifiers[k].name) == MOF_NAME_OUT) {
               if (!out->parameters_direction[id])
                 out->parameters_direction[id] = MOF_PARAMETER_OUT;
               else
@@ -600,7 +966,7 @@ static void parse_class_method_parameters(char *buf, uint32_t size, struct mof_m
           out->parameters[id].qualifiers[out->parameters[id].qualifiers_count++] = variable.qualifiers[k];
           memset(&parameters[i].variables[j].qualifiers[k], 0, sizeof(parameters[i].variables[j].qualifiers[k]));
         }
-      } else if (strcmp(variable.name, "ReturnValue") == 0) {
+      } else if (mof_name_lookup(variable.name) == MOF_NAME_RETURN_VALUE) {
         if (has_return_value) error("multiple return values");
         out->return_value = variable;
         has_return_value = 1;
@@ -610,13 +976,14 @@ static void parse_class_method_parameters(char *buf, uint32_t size, struct mof_m
       }
     }
   }
-  free(parameters_map);
+  mem_free(parameters_map);
   free_classes(parameters, count);
   for (i=0; i<out->parameters_count; ++i) {
     if (out->parameters_direction[i] != MOF_PARAMETER_IN &&
         out->parameters_direction[i] != MOF_PARAMETER_OUT &&
         out->parameters_direction[i] != MOF_PARAMETER_IN_OUT) error("parameter is not input nor output");
   }
+  TRACE_END(parse_class_method_parameters, trace_offset(buf+size), trace_class);
 }
 
 static struct mof_method parse_class_method(char *buf, uint32_t size, uint32_t offset) {
@@ -625,9 +992,7 @@ static struct mof_method parse_class_method(char *buf, uint32_t size, uint32_t o
   uint32_t *buf2 = (uint32_t *)buf;
   if (size < 20) error("Invalid size");
   if (buf2[1] != 0x00 && buf2[1] != 0x200D) {
-    fprintf(stderr, "Warning: unknown method type 0x%x\n", ((uint32_t *)buf)[1]);
-    fprintf(stderr, "Hexdump:\n");
-    dump_bytes(buf, size);
+    diag_dump("method-type", buf, size, "Unknown method type 0x%x", buf2[1]);
     return out;
   }
   if (buf2[2] != 0x0) error("Invalid unknown");
@@ -640,6 +1005,7 @@ static struct mof_method parse_class_method(char *buf, uint32_t size, uint32_t o
   }
   if (!check_sum(20, len, size)) error("Invalid size");
   out.name = parse_string(buf+20, len);
+  diag_context(diag_record, out.name);
   len = buf2[4];
   buf2 = (uint32_t *)(buf+20+len);
   uint32_t len1 = buf2[0];
@@ -647,8 +1013,9 @@ static struct mof_method parse_class_method(char *buf, uint32_t size, uint32_t o
   uint32_t count = buf2[1];
   uint32_t i;
   char *tmp = buf+20+len+8;
+  if (!check_count(count, len1, 16)) error("Invalid count");
   out.qualifiers_count = count;
-  out.qualifiers = calloc(count, sizeof(*out.qualifiers));
+  out.qualifiers = mem_calloc(count, sizeof(*out.qualifiers));
   if (!out.qualifiers) error("calloc failed");
   for (i=0; i<count; ++i) {
     if (tmp-buf >= UINT32_MAX || !check_sum(20+8, len+len1, UINT32_MAX) || !check_sum(tmp-buf, 4, 20+len+8+len1)) error("Invalid size"); /* if (tmp+4 > buf+20+len+8+len1) */
@@ -673,28 +1040,28 @@ static void parse_class_property(char *buf, uint32_t size, struct mof_class *out
   char *name = parse_string(buf+20, slen);
   if (type == 0x08) {
     char *value = parse_string(buf+20+slen, size-slen-20);
-    if (strcmp(name, "__CLASS") == 0) {
+    if (mof_name_lookup(name) == MOF_NAME_CLASS) {
       out->name = value;
-    } else if (strcmp(name, "__NAMESPACE") == 0) {
+    } else if (mof_name_lookup(name) == MOF_NAME_NAMESPACE) {
       out->namespace = value;
-    } else if (strcmp(name, "__SUPERCLASS") == 0) {
+    } else if (mof_name_lookup(name) == MOF_NAME_SUPERCLASS) {
       out->superclassname = value;
     } else {
-      fprintf(stderr, "Warning: Unknown class property name %s\n", name);
-      free(value);
+      diag("class-property", buf, "Unknown class property name %s", name);
+      mem_free(value);
     }
   } else if (type == 0x03) {
     if (size-slen-20 != 4) error("Invalid size");
     int32_t value = *((int32_t *)(buf+20+slen));
-    if (strcmp(name, "__CLASSFLAGS") == 0) {
+    if (mof_name_lookup(name) == MOF_NAME_CLASSFLAGS) {
       out->classflags = value;
     } else {
-      fprintf(stderr, "Warning: Unknown class property name %s\n", name);
+      diag("class-property", buf, "Unknown class property name %s", name);
     }
   } else {
-    fprintf(stderr, "Warning: Unknown class property type 0x%x for name %s\n", type, name);
+    diag("class-property", buf, "Unknown class property type 0x%x for name %s", type, name);
   }
-  free(name);
+  mem_free(name);
 }
 
 static struct mof_class parse_class_data(char *buf, uint32_t size, uint32_t size1, int with_qualifiers, uint32_t offset) {
@@ -709,10 +1076,12 @@ static struct mof_class parse_class_data(char *buf, uint32_t size, uint32_t size
   uint32_t i;
   char *tmp = buf + 8;
   if (with_qualifiers) {
+    if (!check_count(count1, len1 < 8 ? 0 : len1-8, 16)) error("Invalid count");
     out.qualifiers_count = count1;
-    out.qualifiers = calloc(count1, sizeof(*out.qualifiers));
+    out.qualifiers = mem_calloc(count1, sizeof(*out.qualifiers));
     if (!out.qualifiers) error("calloc failed");
     for (i=0; i<count1; ++i) {
+      parse_budget_check();
       if (tmp-buf >= UINT32_MAX || !check_sum(tmp-buf, 4, len1)) error("Invalid size");
       uint32_t len = ((uint32_t *)tmp)[0];
       if (len == 0 || !check_sum(tmp-buf, len, len1)) error("Invalid size");
@@ -729,9 +1098,11 @@ static struct mof_class parse_class_data(char *buf, uint32_t size, uint32_t size
   uint32_t count2 = buf2[1];
   if (!check_sum(len1, len2, size)) error("Invalid size");
   tmp += 8;
-  out.variables = calloc(count2, sizeof(*out.variables));
+  if (!check_count(count2, len2, 20)) error("Invalid count");
+  out.variables = mem_calloc(count2, sizeof(*out.variables));
   if (!out.variables) error("calloc failed");
   for (i=0; i<count2; ++i) {
+    parse_budget_check();
     if (tmp-buf >= UINT32_MAX || !check_sum(len1, len2, UINT32_MAX)) error("Invalid size");
     if (!check_sum(tmp-buf, 4, len1+len2)) error("Invalid size");
     uint32_t len = ((uint32_t *)tmp)[0];
@@ -758,24 +1129,25 @@ static struct mof_class parse_class(char *buf, uint32_t size, uint32_t offset) {
   struct mof_class out;
   memset(&out, 0, sizeof(out));
   uint32_t *buf2 = (uint32_t *)buf;
+  TRACE_BEGIN(parse_class, trace_offset(buf), NULL);
   if (size < 8) error("Invalid size");
   if (buf2[1] != 0x0) error("Invalid unknown");
   if (size < 20) {
-    fprintf(stderr, "Warning: no class defined\n");
+    diag("class-empty", buf, "No class defined");
+    TRACE_END(parse_class, trace_offset(buf+size), NULL);
     return out;
   }
   uint32_t len1 = buf2[2];
   uint32_t len = buf2[3];
   if (!check_sum(20, len, size)) error("Invalid size");
   if (len1 > len) error("Invalid size");
-  if (buf2[4] == 0x1) {
-    fprintf(stderr, "Warning: Instance of class is not supported yet\n");
-    return out;
-  } else if (buf2[4] != 0x0) {
-    fprintf(stderr, "Warning: Class has unknown value 0x%x\n", buf2[4]);
+  if (buf2[4] != 0x0) {
+    diag("class-type", buf, "Class has unknown value 0x%x", buf2[4]);
+    TRACE_END(parse_class, trace_offset(buf+size), NULL);
     return out;
   }
   out = parse_class_data(buf+20, len, len1, 1, offset ? offset+20 : 0);
+  TRACE_CLASS(out.name);
   buf += 20 + len;
   size -= 20 + len;
   if (offset)
@@ -790,10 +1162,12 @@ static struct mof_class parse_class(char *buf, uint32_t size, uint32_t offset) {
   size -= 8;
   if (offset)
     offset += 8;
+  if (!check_count(count, size, 20)) error("Invalid count");
   out.methods_count = count;
-  out.methods = calloc(count, sizeof(*out.methods));
+  out.methods = mem_calloc(count, sizeof(*out.methods));
   if (!out.methods) error("calloc failed");
   for (i=0; i<count; ++i) {
+    parse_budget_check();
     if (size < 4) error("Invalid size");
     uint32_t len1 = ((uint32_t *)buf)[0];
     if (len1 == 0 || len1 > size) error("Invalid size");
@@ -803,63 +1177,72 @@ static struct mof_class parse_class(char *buf, uint32_t size, uint32_t offset) {
     if (offset)
       offset += len1;
   }
+  TRACE_END(parse_class, trace_offset(buf), out.name);
   return out;
 }
 
 static void free_qualifier(struct mof_qualifier *qualifier) {
   if (!qualifier)
     return;
-  free(qualifier->name);
+  mem_free(qualifier->name);
   if (qualifier->type == MOF_QUALIFIER_STRING)
-    free(qualifier->value.string);
+    mem_free(qualifier->value.string);
+  else if (qualifier->type == MOF_QUALIFIER_STRING_ARRAY)
+    mem_free(qualifier->value.strings.values);
 }
 
 static void free_qualifiers(struct mof_qualifier *qualifiers, uint32_t count) {
   uint32_t i;
   for (i=0; i<count; ++i)
     free_qualifier(&qualifiers[i]);
-  free(qualifiers);
+  mem_free(qualifiers);
 }
 
 static void free_variable(struct mof_variable *variable) {
   if (!variable)
     return;
-  free(variable->name);
+  mem_free(variable->name);
   free_qualifiers(variable->qualifiers, variable->qualifiers_count);
   if (variable->variable_type == MOF_VARIABLE_OBJECT || variable->variable_type == MOF_VARIABLE_OBJECT_ARRAY)
-    free(variable->type.object);
+    mem_free(variable->type.object);
+  if (variable->values && (variable->type.basic == MOF_BASIC_TYPE_STRING || variable->type.basic == MOF_BASIC_TYPE_DATETIME)) {
+    uint32_t i;
+    for (i=0; i<variable->values_count; ++i)
+      mem_free(variable->values[i].string);
+  }
+  mem_free(variable->values);
 }
 
 static void free_variables(struct mof_variable *variables, uint32_t count) {
   uint32_t i;
   for (i=0; i<count; ++i)
     free_variable(&variables[i]);
-  free(variables);
+  mem_free(variables);
 }
 
 static void free_method(struct mof_method *method) {
   if (!method)
     return;
   free_qualifiers(method->qualifiers, method->qualifiers_count);
-  free(method->name);
+  mem_free(method->name);
   free_variables(method->parameters, method->parameters_count);
   free_variable(&method->return_value);
-  free(method->parameters_direction);
+  mem_free(method->parameters_direction);
 }
 
 static void free_methods(struct mof_method *methods, uint32_t count) {
   uint32_t i;
   for (i=0; i<count; ++i)
     free_method(&methods[i]);
-  free(methods);
+  mem_free(methods);
 }
 
 static void free_class(struct mof_class *class) {
   if (!class)
     return;
-  free(class->name);
-  free(class->namespace);
-  free(class->superclassname);
+  mem_free(class->name);
+  mem_free(class->namespace);
+  mem_free(class->superclassname);
   free_qualifiers(class->qualifiers, class->qualifiers_count);
   free_variables(class->variables, class->variables_count);
   free_methods(class->methods, class->methods_count);
@@ -869,38 +1252,192 @@ static void free_classes(struct mof_class *classes, uint32_t count) {
   uint32_t i;
   for (i=0; i<count; ++i)
     free_class(&classes[i]);
-  free(classes);
+  mem_free(classes);
+}
+
+/* Canonical hash of parsed class, equal classes have equal hashes */
+
+static uint64_t hash_string(uint64_t hash, const char *str) {
+  if (!str)
+    return hash_update(hash, "\xFF", 1);
+  return hash_update(hash, str, strlen(str)+1);
+}
+
+static uint64_t hash_int(uint64_t hash, int64_t val) {
+  uint8_t buf[8];
+  int i;
+  for (i = 0; i < 8; ++i)
+    buf[i] = (uint64_t)val >> (8*i);
+  return hash_update(hash, buf, sizeof(buf));
 }
 
-static struct mof_classes parse_root(char *buf, uint32_t size, uint32_t offset) {
+static uint64_t hash_qualifiers(uint64_t hash, struct mof_qualifier *qualifiers, uint32_t count) {
+  uint32_t i, j;
+  hash = hash_int(hash, count);
+  for (i = 0; i < count; ++i) {
+    hash = hash_string(hash, qualifiers[i].name);
+    hash = hash_int(hash, qualifiers[i].type);
+    hash = hash_int(hash, qualifiers[i].toinstance | qualifiers[i].tosubclass << 1 | qualifiers[i].disableoverride << 2 | qualifiers[i].amended << 3);
+    switch (qualifiers[i].type) {
+    case MOF_QUALIFIER_BOOLEAN:
+      hash = hash_int(hash, qualifiers[i].value.boolean);
+      break;
+    case MOF_QUALIFIER_SINT32:
+      hash = hash_int(hash, qualifiers[i].value.sint32);
+      break;
+    case MOF_QUALIFIER_STRING:
+      hash = hash_string(hash, qualifiers[i].value.string);
+      break;
+    case MOF_QUALIFIER_STRING_ARRAY:
+      hash = hash_int(hash, qualifiers[i].value.strings.count);
+      for (j = 0; j < qualifiers[i].value.strings.count; ++j)
+        hash = hash_string(hash, qualifiers[i].value.strings.values[j]);
+      break;
+    default:
+      break;
+    }
+  }
+  return hash;
+}
+
+static uint64_t hash_variable(uint64_t hash, struct mof_variable *variable) {
+  uint32_t i;
+  hash = hash_string(hash, variable->name);
+  hash = hash_int(hash, variable->variable_type);
+  if (variable->variable_type == MOF_VARIABLE_OBJECT || variable->variable_type == MOF_VARIABLE_OBJECT_ARRAY)
+    hash = hash_string(hash, variable->type.object);
+  else
+    hash = hash_int(hash, variable->type.basic);
+  hash = hash_int(hash, variable->has_array_max ? variable->array_max : -1);
+  hash = hash_int(hash, variable->has_value ? (int64_t)variable->values_count : -1);
+  for (i = 0; i < variable->values_count; ++i) {
+    if (variable->type.basic == MOF_BASIC_TYPE_STRING || variable->type.basic == MOF_BASIC_TYPE_DATETIME)
+      hash = hash_string(hash, variable->values[i].string);
+    else
+      hash = hash_int(hash, variable->values[i].uint);
+  }
+  return hash_qualifiers(hash, variable->qualifiers, variable->qualifiers_count);
+}
+
+static uint64_t hash_method(uint64_t hash, struct mof_method *method) {
+  uint32_t i;
+  hash = hash_string(hash, method->name);
+  hash = hash_qualifiers(hash, method->qualifiers, method->qualifiers_count);
+  hash = hash_int(hash, method->parameters_count);
+  for (i = 0; i < method->parameters_count; ++i) {
+    hash = hash_int(hash, method->parameters_direction[i]);
+    hash = hash_variable(hash, &method->parameters[i]);
+  }
+  return hash_variable(hash, &method->return_value);
+}
+
+static uint64_t hash_class(struct mof_class *class) {
+  uint64_t hash = HASH_INIT;
+  uint32_t i;
+  hash = hash_string(hash, class->name);
+  hash = hash_string(hash, class->namespace);
+  hash = hash_string(hash, class->superclassname);
+  hash = hash_int(hash, class->classflags);
+  hash = hash_qualifiers(hash, class->qualifiers, class->qualifiers_count);
+  hash = hash_int(hash, class->variables_count);
+  for (i = 0; i < class->variables_count; ++i)
+    hash = hash_variable(hash, &class->variables[i]);
+  hash = hash_int(hash, class->methods_count);
+  for (i = 0; i < class->methods_count; ++i)
+    hash = hash_method(hash, &class->methods[i]);
+  return hash;
+}
+
+#define is_instance(buf, size) ((size) >= 20 && ((uint32_t *)(buf))[4] == 0x1)
+
+/* Instance has same data as class (properties with values) and no methods */
+static struct mof_class parse_instance(char *buf, uint32_t size, uint32_t offset) {
+  struct mof_class out;
+  uint32_t *buf2 = (uint32_t *)buf;
+  if (buf2[1] != 0x0) error("Invalid unknown");
+  uint32_t len1 = buf2[2];
+  uint32_t len = buf2[3];
+  if (!check_sum(20, len, size)) error("Invalid size");
+  if (len1 > len) error("Invalid size");
+  out = parse_class_data(buf+20, len, len1, 1, offset ? offset+20 : 0);
+  if (size != 20+len) {
+    buf2 = (uint32_t *)(buf+20+len);
+    if (size-20-len != 8 || buf2[0] != 8 || buf2[1] != 0) error("Invalid size");
+  }
+  if (!out.name) error("Instance without class name");
+  return out;
+}
+
+/*
+ * Classes are parsed into array, or with callback passed to callback one
+ * at a time and freed. Instances are parsed one at a time in second pass,
+ * passed to callback and freed, so they are not accumulated.
+ */
+static struct mof_classes parse_root(char *buf, uint32_t size, uint32_t offset, int instances, void (*callback)(struct mof_class *record, uint32_t index, void *data), void *data) {
   struct mof_classes out;
+  struct mof_class record;
   memset(&out, 0, sizeof(out));
   if (size < 12) error("Invalid size");
   uint32_t *buf2 = (uint32_t *)buf;
   if (buf2[0] != 0x1 || buf2[1] != 0x1) error("Invalid unknown");
   uint32_t count = buf2[2];
+  uint32_t classes_count = 0;
+  uint32_t index = 0; /* of record passed to callback */
   uint32_t i;
   char *tmp = buf + 12;
-  out.count = count;
-  out.classes = calloc(count, sizeof(*out.classes));
-  if (!out.classes) error("calloc failed");
+  if (!check_count(count, size-12, 8)) error("Invalid count");
   for (i=0; i<count; ++i) {
     if (tmp-buf >= UINT32_MAX || !check_sum(tmp-buf, 4, size)) error("Invalid size");
     uint32_t len = ((uint32_t *)tmp)[0];
     if (len == 0 || !check_sum(tmp-buf, len, size)) error("Invalid size");
-    out.classes[i] = parse_class(tmp, len, offset ? offset+tmp-buf : 0);
+    if (!is_instance(tmp, len))
+      classes_count++;
     tmp += len;
   }
   if (tmp != buf+size) error("Buffer not processed");
+  if (!instances && !callback) {
+    out.classes = mem_calloc(classes_count, sizeof(*out.classes));
+    if (!out.classes) error("calloc failed");
+  }
+  tmp = buf + 12;
+  for (i=0; i<count; ++i) {
+    uint32_t len = ((uint32_t *)tmp)[0];
+    parse_budget_check();
+    diag_context(i, NULL);
+    TRACE_CLASS(NULL);
+    if (!is_instance(tmp, len)) {
+      if (!instances && callback) {
+        record = parse_class(tmp, len, offset ? offset+tmp-buf : 0);
+        callback(&record, index++, data);
+        free_class(&record);
+      } else if (!instances) {
+        out.classes[out.count++] = parse_class(tmp, len, offset ? offset+tmp-buf : 0);
+      }
+    } else if (instances) {
+      record = parse_instance(tmp, len, offset ? offset+tmp-buf : 0);
+      if (callback)
+        callback(&record, index, data);
+      index++;
+      free_class(&record);
+    }
+    tmp += len;
+  }
+  diag_context(-1, NULL);
+  TRACE_CLASS(NULL);
   return out;
 }
 
-static struct mof_classes parse_bmf(char *buf, uint32_t size) {
+/*
+ * Parse classes, instances must be parsed by parse_bmf_instances() afterwards.
+ * With callback classes are not returned, but passed to callback and freed.
+ */
+static struct mof_classes parse_bmf_classes(char *buf, uint32_t size, void (*callback)(struct mof_class *class, uint32_t index, void *data), void *data) {
   struct mof_classes out;
+  TRACE_BEGIN(parse_bmf_classes, 0, NULL);
   if (size < 8) error("Invalid file size");
   if (((uint32_t *)buf)[0] != 0x424D4F46) error("Invalid magic header");
   uint32_t len = ((uint32_t *)buf)[1];
-  if (len > size) error("Invalid size");
+  if (len > size || len < 8) error("Invalid size");
   uint32_t i;
   uint32_t count = 0;
   if (len < size) {
@@ -912,76 +1449,617 @@ static struct mof_classes parse_bmf(char *buf, uint32_t size) {
       if (((uint32_t *)(buf+len+16+4))[2*i] == 0) error("Invalid offset in second part");
     }
   }
-  out = parse_root(buf+8, len-8, (len < size) ? 8 : 0);
-  for (i=0; i<count; ++i) {
-    if (((uint32_t *)(buf+len+16+4))[2*i] != 0) error("Qualifier from second part was not parsed");
-  }
+  /* previous document could fail before parse_bmf_instances() */
+  flavor_table_free(&parse_flavors);
+  if (flavor_table_init(&parse_flavors, buf+len+16+4, count)) error("malloc failed");
+  diag_base = buf;
+  diag_base_size = size;
+  out = parse_root(buf+8, len-8, (len < size) ? 8 : 0, 0, callback, data);
+  TRACE_END(parse_bmf_classes, size, NULL);
   return out;
 }
 
-static void print_qualifiers(FILE *fout, struct mof_qualifier *qualifiers, uint32_t count, int indent) {
+/*
+ * Parse instances and check that every entry of second part was used. Buffer
+ * is not modified, so instances can be parsed again (see print_bmf_instances()).
+ */
+static void parse_bmf_instances(char *buf, uint32_t size, void (*callback)(struct mof_class *instance, uint32_t index, void *data), void *data) {
+  uint32_t len = ((uint32_t *)buf)[1];
+  TRACE_BEGIN(parse_bmf_instances, 0, NULL);
+  diag_base = buf;
+  diag_base_size = size;
+  parse_root(buf+8, len-8, (len < size) ? 8 : 0, 1, callback, data);
+  if (flavor_table_unused(&parse_flavors) < parse_flavors.count) error("Qualifier from second part was not parsed");
+  TRACE_END(parse_bmf_instances, size, NULL);
+}
+
+static struct mof_classes parse_bmf(char *buf, uint32_t size) {
+  struct mof_classes out;
+  out = parse_bmf_classes(buf, size, NULL, NULL);
+  parse_bmf_instances(buf, size, NULL, NULL);
+  return out;
+}
+
+/*
+ * Validation walk used by --check. It follows the same structure and bounds
+ * checks as the parse_* functions above, but does not convert strings and
+ * allocates only index of second part (see struct flavor_table), buffer is
+ * not modified. Semantic checks which need parsed values (CIMTYPE matching,
+ * method parameter IDs) are not done here.
+ *
+ * The same walk is used by visit_bmf(), which calls visitor for every
+ * record, class property, variable, method, parameter and qualifier with
+ * pointers into the buffer. Strings are UTF-16 spans and values are read
+ * in place, nothing is copied or converted. Data are validated in the same
+ * way as by --check, including that every entry of second part was used.
+ */
+
+/* UTF-16 string in buffer, ends at size bytes or at first NUL */
+struct mof_span {
+  const char *buf;
+  uint32_t size;
+};
+
+enum mof_visit_scope {
+  MOF_VISIT_CLASS,
+  MOF_VISIT_VARIABLE,
+  MOF_VISIT_METHOD,
+  MOF_VISIT_PARAMETER,
+};
+
+struct mof_visit_qualifier {
+  struct mof_span name;
+  uint32_t type;            /* 0x0B boolean, 0x03 sint32, 0x08 string, 0x2008 string array */
+  uint32_t flavors;         /* from second part, 0 when there is none */
+  uint8_t boolean;
+  int32_t sint32;
+  struct mof_span string;
+  struct mof_span strings;  /* strings_count NUL terminated strings */
+  uint32_t strings_count;
+};
+
+/* Class property like __CLASS (type 0x08) or __CLASSFLAGS (type 0x03) */
+struct mof_visit_property {
+  struct mof_span name;
+  uint32_t type;
+  struct mof_span string;
+  int32_t sint32;
+};
+
+struct mof_visit_variable {
+  struct mof_span name;
+  uint32_t type;            /* 0x20xx for arrays, low byte as in value_size() */
+  const char *values;       /* values_count packed values or NUL terminated strings, NULL without value */
+  uint32_t values_count;
+  uint32_t values_size;
+};
+
+/* Callbacks can be NULL, nonzero return value stops the walk */
+struct mof_visitor {
+  int (*record)(void *data, uint32_t index, int instance);
+  int (*property)(void *data, enum mof_visit_scope scope, const struct mof_visit_property *property);
+  int (*variable)(void *data, enum mof_visit_scope scope, const struct mof_visit_variable *variable);
+  int (*method)(void *data, struct mof_span name);
+  int (*qualifier)(void *data, enum mof_visit_scope scope, const struct mof_visit_qualifier *qualifier);
+  void *data;
+};
+
+static char *check_base;
+static uint32_t check_offset;
+static struct flavor_table *check_flavors;
+static const struct mof_visitor *visitor;
+static enum mof_visit_scope visit_scope;
+static int visit_stopped;
+
+#define check_fail(ptr) do { check_offset = (char *)(ptr) - check_base; return 1; } while (0)
+
+#define visit(callback, ...) do { if (visitor && visitor->callback && visitor->callback(visitor->data, __VA_ARGS__)) { visit_stopped = 1; return 1; } } while (0)
+
+#define mof_span(ptr, len) ((struct mof_span){ (ptr), (len) })
+
+/* Compare span with ASCII string */
+static int mof_span_equal(struct mof_span span, const char *str) {
+  const uint16_t *buf2 = (const uint16_t *)span.buf;
   uint32_t i;
-  for (i = 0; i < count; ++i) {
-    fprintf(fout, "%*.sQualifier %u:\n", indent, "", i);
-    fprintf(fout, "%*.s  Name=%s\n", indent, "", qualifiers[i].name);
-    fprintf(fout, "%*.s  Flavors:\n", indent, "");
-    fprintf(fout, "%*.s    ToInstance=%s\n", indent, "", qualifiers[i].toinstance ? "TRUE" : "FALSE");
-    fprintf(fout, "%*.s    ToSubclass=%s\n", indent, "", qualifiers[i].tosubclass ? "TRUE" : "FALSE");
-    fprintf(fout, "%*.s    DisableOverride=%s\n", indent, "", qualifiers[i].disableoverride ? "TRUE" : "FALSE");
-    fprintf(fout, "%*.s    Amended=%s\n", indent, "", qualifiers[i].amended ? "TRUE" : "FALSE");
-    switch (qualifiers[i].type) {
-    case MOF_QUALIFIER_BOOLEAN:
-      fprintf(fout, "%*.s  Type=Boolean\n", indent, "");
-      fprintf(fout, "%*.s  Value=%s\n", indent, "", qualifiers[i].value.boolean ? "TRUE" : "FALSE");
-      break;
-    case MOF_QUALIFIER_SINT32:
-      fprintf(fout, "%*.s  Type=Numeric\n", indent, "");
-      fprintf(fout, "%*.s  Value=%d\n", indent, "", qualifiers[i].value.sint32);
-      break;
-    case MOF_QUALIFIER_STRING:
-      fprintf(fout, "%*.s  Type=String\n", indent, "");
-      fprintf(fout, "%*.s  Value=%s\n", indent, "", qualifiers[i].value.string);
-      break;
-    default:
-      fprintf(fout, "%*.s  Type=Unknown\n", indent, "");
-      break;
-    }
+  for (i=0; i<span.size/2 && buf2[i] != 0; ++i) {
+    if (buf2[i] != (unsigned char)str[i])
+      return 0;
   }
+  return str[i] == 0;
 }
 
-static void print_variable_type(FILE *fout, struct mof_variable *variable) {
-  char *variable_type = "unknown";
-  char *type = NULL;
-  switch (variable->variable_type) {
-  case MOF_VARIABLE_BASIC:
-  case MOF_VARIABLE_BASIC_ARRAY:
-    variable_type = "Basic";
-    switch (variable->type.basic) {
-    case MOF_BASIC_TYPE_STRING: type = "String"; break;
-    case MOF_BASIC_TYPE_REAL64: type = "Real64"; break;
-    case MOF_BASIC_TYPE_REAL32: type = "Real32"; break;
-    case MOF_BASIC_TYPE_SINT32: type = "SInt32"; break;
-    case MOF_BASIC_TYPE_UINT32: type = "UInt32"; break;
-    case MOF_BASIC_TYPE_SINT16: type = "SInt16"; break;
-    case MOF_BASIC_TYPE_UINT16: type = "UInt16"; break;
-    case MOF_BASIC_TYPE_SINT64: type = "SInt64"; break;
-    case MOF_BASIC_TYPE_UINT64: type = "UInt64"; break;
-    case MOF_BASIC_TYPE_SINT8: type = "SInt8"; break;
-    case MOF_BASIC_TYPE_UINT8: type = "UInt8"; break;
-    case MOF_BASIC_TYPE_DATETIME: type = "Datetime"; break;
-    case MOF_BASIC_TYPE_CHAR16: type = "Char16"; break;
-    case MOF_BASIC_TYPE_BOOLEAN: type = "Boolean"; break;
-    default: type = "unknown"; break;
+static int check_class_data(char *buf, uint32_t size, uint32_t size1, int with_qualifiers, uint32_t offset);
+
+static int check_qualifier(char *buf, uint32_t size, uint32_t offset, enum mof_visit_scope scope) {
+  struct mof_visit_qualifier qualifier;
+  uint32_t *buf2 = (uint32_t *)buf;
+  if (size < 16) check_fail(buf);
+  uint32_t type = buf2[1];
+  uint32_t len = buf2[3];
+  if (!check_sum(16, len, size)) check_fail(buf);
+  memset(&qualifier, 0, sizeof(qualifier));
+  qualifier.name = mof_span(buf+16, len);
+  qualifier.type = type;
+  switch (type) {
+  case 0x0B:
+    if (check_sum(16+4+1, len, size) || len % 2 != 0) check_fail(buf);
+    qualifier.boolean = 1;
+    if (check_sum(16+4, len, size)) {
+      uint32_t val = *((uint32_t *)(buf+16+len));
+      if (val != 0 && val != 0xFFFF) check_fail(buf+16+len);
+      qualifier.boolean = val ? 1 : 0;
     }
     break;
-  case MOF_VARIABLE_OBJECT:
-  case MOF_VARIABLE_OBJECT_ARRAY:
-    variable_type = "Object";
-    type = variable->type.object;
+  case 0x03:
+    if (!check_sum(16+4, len, size) || len % 2 != 0) check_fail(buf);
+    qualifier.sint32 = *((int32_t *)(buf+16+len));
     break;
-  default:
+  case 0x08:
+    if (len % 2 != 0 || (size-len-16) % 2 != 0) check_fail(buf);
+    qualifier.string = mof_span(buf+16+len, size-len-16);
     break;
-  }
+  case 0x2008: {
+    uint32_t alen, acount, i, j;
+    uint16_t *str = (uint16_t *)(buf+16+len+8);
+    if (len % 2 != 0 || !check_sum(16+8, len, size)) check_fail(buf);
+    alen = ((uint32_t *)(buf+16+len))[0];
+    acount = ((uint32_t *)(buf+16+len))[1];
+    if (alen < 8 || alen > size-len-16 || alen % 2 != 0) check_fail(buf+16+len);
+    if (!check_count(acount, alen-8, 2)) check_fail(buf+16+len+4);
+    for (i=0, j=0; i<acount; ++i, ++j) {
+      while (j < (alen-8)/2 && str[j] != 0)
+        ++j;
+      if (j == (alen-8)/2) check_fail(buf+16+len);
+    }
+    qualifier.strings = mof_span(buf+16+len+8, alen-8);
+    qualifier.strings_count = acount;
+    break;
+  }
+  default:
+    break;
+  }
+  if (offset) {
+    uint32_t i, n;
+    for (i = flavor_table_find(check_flavors, offset, &n); n > 0; ++i, --n) {
+      qualifier.flavors = check_flavors->entries[i].flavors;
+      check_flavors->used[i] = 1;
+    }
+  }
+  visit(qualifier, scope, &qualifier);
+  return 0;
+}
+
+static int check_qualifiers(char *buf, char **tmp, uint32_t end, uint32_t count, uint32_t offset, uint32_t max_len, enum mof_visit_scope scope) {
+  uint32_t i;
+  for (i=0; i<count; ++i) {
+    if (*tmp-buf >= UINT32_MAX || !check_sum(*tmp-buf, 4, end)) check_fail(*tmp);
+    uint32_t len = ((uint32_t *)*tmp)[0];
+    if (len == 0 || (max_len && len >= max_len) || !check_sum(*tmp-buf, len, end)) check_fail(*tmp);
+    if (check_qualifier(*tmp, len, offset ? offset+*tmp-buf : 0, scope)) return 1;
+    *tmp += len;
+  }
+  return 0;
+}
+
+static int check_class_variable(char *buf, uint32_t size, uint32_t offset) {
+  struct mof_visit_variable variable;
+  enum mof_visit_scope scope = (visit_scope == MOF_VISIT_PARAMETER) ? MOF_VISIT_PARAMETER : MOF_VISIT_VARIABLE;
+  uint32_t *buf2 = (uint32_t *)buf;
+  if (size < 20) check_fail(buf);
+  uint32_t type = buf2[1];
+  if ((type >> 8) != 0x00 && (type >> 8) != 0x20)
+    return 0;
+  switch (type & 0xFF) {
+  case 0x02: case 0x03: case 0x04: case 0x05: case 0x08: case 0x0B: case 0x0D:
+  case 0x10: case 0x11: case 0x12: case 0x13: case 0x14: case 0x15: case 0x65: case 0x67:
+    break;
+  default:
+    return 0;
+  }
+  if (buf2[2] != 0x0) check_fail(buf);
+  uint32_t len = buf2[4];
+  if (!check_sum(20, len, size)) check_fail(buf);
+  uint32_t slen = buf2[3];
+  memset(&variable, 0, sizeof(variable));
+  variable.type = type;
+  if (slen != 0xFFFFFFFF) {
+    char *start;
+    uint32_t values_count;
+    if (!check_sum(20, slen, size) || slen > len || slen % 2 != 0) check_fail(buf);
+    if ((type & 0xFF) != 0x0D && check_value(buf+20+slen, len-slen, type, &start, &values_count)) check_fail(buf+20+slen);
+    variable.name = mof_span(buf+20, slen);
+    if ((type & 0xFF) != 0x0D) {
+      variable.values = start;
+      variable.values_count = values_count;
+      variable.values_size = buf+20+len-start;
+    }
+  } else if (len % 2 != 0) {
+    check_fail(buf);
+  } else {
+    variable.name = mof_span(buf+20, len);
+  }
+  visit(variable, scope, &variable);
+  if (!check_sum(20+8, len, size)) check_fail(buf);
+  buf2 = (uint32_t *)(buf+20+len);
+  uint32_t len1 = buf2[0];
+  if (!check_sum(len, len1, size-20)) check_fail(buf2);
+  if (!check_sum(20+8, len+len1, UINT32_MAX)) check_fail(buf2);
+  uint32_t count = buf2[1];
+  char *tmp = buf+20+len+8;
+  if (count > 0 && len == 0) check_fail(tmp);
+  if (check_qualifiers(buf, &tmp, 20+len+8+len1, count, offset, len1 ? len1 : 1, scope)) return 1;
+  if (tmp != buf+size) check_fail(tmp);
+  return 0;
+}
+
+static int check_class_method_parameters(char *buf, uint32_t size, uint32_t offset) {
+  uint32_t *buf2 = (uint32_t *)buf;
+  if (size < 16) check_fail(buf);
+  if (buf2[1] != 0x1) check_fail(buf);
+  uint32_t count = buf2[2];
+  uint32_t len = buf2[3];
+  if (len == 0 || !check_sum(12, len, size)) check_fail(buf);
+  if (len+12 != size) check_fail(buf);
+  uint32_t i;
+  int ret;
+  char *tmp = buf+16;
+  for (i=0; i<count; ++i) {
+    buf2 = (uint32_t *)tmp;
+    if (tmp-buf >= UINT32_MAX) check_fail(tmp);
+    if (!check_sum(4, tmp-buf, len)) check_fail(tmp);
+    uint32_t len1 = buf2[0];
+    if (!check_sum(tmp-buf, len1, 16+len)) check_fail(tmp);
+    if (len1 < 20) check_fail(tmp);
+    if (buf2[1] != 0xFFFFFFFF || buf2[2] != 0x0) check_fail(tmp);
+    uint32_t len2 = buf2[3];
+    if (len2 >= len || !check_sum(tmp-buf, 20-16, len-len2)) check_fail(tmp);
+    if (buf2[4] != 0x1) check_fail(tmp);
+    visit_scope = MOF_VISIT_PARAMETER;
+    ret = check_class_data(tmp+20, len2, len2, 0, offset ? offset+tmp+20-buf : 0);
+    visit_scope = MOF_VISIT_CLASS;
+    if (ret) return 1;
+    tmp += len1;
+  }
+  return 0;
+}
+
+static int check_class_method(char *buf, uint32_t size, uint32_t offset) {
+  uint32_t *buf2 = (uint32_t *)buf;
+  if (size < 20) check_fail(buf);
+  if (buf2[1] != 0x00 && buf2[1] != 0x200D)
+    return 0;
+  if (buf2[2] != 0x0) check_fail(buf);
+  uint32_t len = buf2[3];
+  /* name is before parameters */
+  if (check_sum(20, len == 0xFFFFFFFF ? buf2[4] : len, size) && (len == 0xFFFFFFFF ? buf2[4] : len) % 2 == 0)
+    visit(method, mof_span(buf+20, len == 0xFFFFFFFF ? buf2[4] : len));
+  if (len == 0xFFFFFFFF)
+    len = buf2[4];
+  else {
+    if (!check_sum(20, buf2[4], size) || buf2[4] < len) check_fail(buf);
+    if (check_class_method_parameters(buf+20+len, buf2[4]-len, offset ? offset+20+len : 0)) return 1;
+  }
+  if (!check_sum(20, len, size) || len % 2 != 0) check_fail(buf);
+  len = buf2[4];
+  if (!check_sum(20+8, len, size)) check_fail(buf);
+  buf2 = (uint32_t *)(buf+20+len);
+  uint32_t len1 = buf2[0];
+  if (!check_sum(len, len1, size-20) || !check_sum(20+8, len+len1, UINT32_MAX)) check_fail(buf2);
+  uint32_t count = buf2[1];
+  char *tmp = buf+20+len+8;
+  if (check_qualifiers(buf, &tmp, 20+len+8+len1, count, offset, 0, MOF_VISIT_METHOD)) return 1;
+  if (tmp != buf+size) check_fail(tmp);
+  return 0;
+}
+
+static int check_class_property(char *buf, uint32_t size) {
+  struct mof_visit_property property;
+  uint32_t *buf2 = (uint32_t *)buf;
+  if (size < 20) check_fail(buf);
+  uint32_t len = buf2[0];
+  if (len == 0 || size < len) check_fail(buf);
+  if (buf2[2] != 0x0 || buf2[4] != 0xFFFFFFFF) check_fail(buf);
+  uint32_t type = buf2[1];
+  uint32_t slen = buf2[3];
+  if (!check_sum(20, slen, size) || slen % 2 != 0) check_fail(buf);
+  if (type == 0x08 && (size-slen-20) % 2 != 0) check_fail(buf);
+  if (type == 0x03 && size-slen-20 != 4) check_fail(buf);
+  memset(&property, 0, sizeof(property));
+  property.name = mof_span(buf+20, slen);
+  property.type = type;
+  if (type == 0x08)
+    property.string = mof_span(buf+20+slen, size-slen-20);
+  else if (type == 0x03)
+    property.sint32 = *((int32_t *)(buf+20+slen));
+  visit(property, visit_scope, &property);
+  return 0;
+}
+
+static int check_class_data(char *buf, uint32_t size, uint32_t size1, int with_qualifiers, uint32_t offset) {
+  uint32_t *buf2 = (uint32_t *)buf;
+  if (size < 8) check_fail(buf);
+  uint32_t len1 = buf2[0];
+  if (len1 > size || len1 != size1) check_fail(buf);
+  uint32_t count1 = buf2[1];
+  uint32_t i;
+  char *tmp = buf + 8;
+  if (with_qualifiers) {
+    if (check_qualifiers(buf, &tmp, len1, count1, offset, 0, MOF_VISIT_CLASS)) return 1;
+  } else {
+    tmp = buf;
+    len1 = 0;
+  }
+  if (!check_sum(tmp-buf, 8, size)) check_fail(tmp);
+  buf2 = (uint32_t *)tmp;
+  uint32_t len2 = buf2[0];
+  uint32_t count2 = buf2[1];
+  if (!check_sum(len1, len2, size)) check_fail(tmp);
+  tmp += 8;
+  for (i=0; i<count2; ++i) {
+    if (tmp-buf >= UINT32_MAX || !check_sum(tmp-buf, 4, len1+len2)) check_fail(tmp);
+    uint32_t len = ((uint32_t *)tmp)[0];
+    if (len == 0 || !check_sum(tmp-buf, len, len1+len2)) check_fail(tmp);
+    if (tmp+16 <= buf+len1+len2 && ((uint32_t *)tmp)[4] == 0xFFFFFFFF) {
+      if (check_class_property(tmp, len)) return 1;
+    } else {
+      if (check_class_variable(tmp, len, offset ? offset+tmp-buf : 0)) return 1;
+    }
+    tmp += len;
+  }
+  while (tmp != buf+size) {
+    if (tmp-buf >= UINT32_MAX || !check_sum(tmp-buf, 4, size)) check_fail(tmp);
+    uint32_t len = ((uint32_t *)tmp)[0];
+    if (len == 0 || !check_sum(tmp-buf, len, size)) check_fail(tmp);
+    if (check_class_property(tmp, len)) return 1;
+    tmp += len;
+  }
+  return 0;
+}
+
+static int check_class(char *buf, uint32_t size, uint32_t offset) {
+  uint32_t *buf2 = (uint32_t *)buf;
+  if (size < 8) check_fail(buf);
+  if (buf2[1] != 0x0) check_fail(buf);
+  if (size < 20)
+    return 0;
+  uint32_t len1 = buf2[2];
+  uint32_t len = buf2[3];
+  if (!check_sum(20, len, size) || len1 > len) check_fail(buf);
+  if (buf2[4] == 0x1) {
+    if (check_class_data(buf+20, len, len1, 1, offset ? offset+20 : 0)) return 1;
+    buf2 = (uint32_t *)(buf+20+len);
+    if (size != 20+len && (size-20-len != 8 || buf2[0] != 8 || buf2[1] != 0)) check_fail(buf+20+len);
+    return 0;
+  }
+  if (buf2[4] != 0x0)
+    return 0;
+  if (check_class_data(buf+20, len, len1, 1, offset ? offset+20 : 0)) return 1;
+  buf += 20 + len;
+  size -= 20 + len;
+  if (offset)
+    offset += 20 + len;
+  if (size < 4) check_fail(buf);
+  buf2 = (uint32_t *)buf;
+  len = buf2[0];
+  if (len < 8 || len > size) check_fail(buf);
+  uint32_t count = buf2[1];
+  uint32_t i;
+  buf += 8;
+  size -= 8;
+  if (offset)
+    offset += 8;
+  for (i=0; i<count; ++i) {
+    if (size < 4) check_fail(buf);
+    uint32_t len1 = ((uint32_t *)buf)[0];
+    if (len1 == 0 || len1 > size) check_fail(buf);
+    if (check_class_method(buf, len1, offset)) return 1;
+    buf += len1;
+    size -= len1;
+    if (offset)
+      offset += len1;
+  }
+  return 0;
+}
+
+static int check_root(char *buf, uint32_t size, uint32_t offset) {
+  if (size < 12) check_fail(buf);
+  uint32_t *buf2 = (uint32_t *)buf;
+  if (buf2[0] != 0x1 || buf2[1] != 0x1) check_fail(buf);
+  uint32_t count = buf2[2];
+  uint32_t i;
+  char *tmp = buf + 12;
+  for (i=0; i<count; ++i) {
+    if (tmp-buf >= UINT32_MAX || !check_sum(tmp-buf, 4, size)) check_fail(tmp);
+    uint32_t len = ((uint32_t *)tmp)[0];
+    if (len == 0 || !check_sum(tmp-buf, len, size)) check_fail(tmp);
+    visit(record, i, is_instance(tmp, len));
+    if (check_class(tmp, len, offset ? offset+tmp-buf : 0)) return 1;
+    tmp += len;
+  }
+  if (tmp != buf+size) check_fail(tmp);
+  return 0;
+}
+
+static int check_bmf(char *buf, uint32_t size) {
+  struct flavor_table flavors;
+  int ret;
+  if (size < 8) check_fail(buf);
+  if (((uint32_t *)buf)[0] != 0x424D4F46) check_fail(buf);
+  uint32_t len = ((uint32_t *)buf)[1];
+  if (len > size || len < 8) check_fail(buf);
+  uint32_t i;
+  uint32_t count = 0;
+  if (len < size) {
+    if (!check_sum(20, len, size)) check_fail(buf+len);
+    if (memcmp(buf+len, "BMOFQUALFLAVOR11", 16) != 0) check_fail(buf+len);
+    count = ((uint32_t *)(buf+len+16))[0];
+    if (count >= UINT32_MAX/8 || 8*count != size-len-16-4) check_fail(buf+len+16);
+    for (i=0; i<count; ++i) {
+      if (((uint32_t *)(buf+len+16+4))[2*i] == 0) check_fail(buf+len+16+4+8*i);
+    }
+  }
+  if (flavor_table_init(&flavors, buf+len+16+4, count)) check_fail(buf+len+16);
+  check_flavors = &flavors;
+  ret = check_root(buf+8, len-8, (len < size) ? 8 : 0);
+  check_flavors = NULL;
+  if (ret == 0 && (i = flavor_table_unused(&flavors)) < count) {
+    check_offset = buf+len+16+4+8*i - check_base;
+    ret = 1;
+  }
+  flavor_table_free(&flavors);
+  return ret;
+}
+
+/*
+ * Walk decompressed BMF buffer with visitor. Returns 0 when whole buffer
+ * was visited, 1 on invalid data (offset is in check_offset) and 2 when
+ * callback stopped the walk. Buffer is not modified.
+ */
+static int visit_bmf(char *buf, uint32_t size, const struct mof_visitor *v) {
+  int ret;
+  check_base = buf;
+  check_offset = 0;
+  visitor = v;
+  visit_scope = MOF_VISIT_CLASS;
+  visit_stopped = 0;
+  ret = check_bmf(buf, size);
+  visitor = NULL;
+  if (visit_stopped)
+    return 2;
+  return ret;
+}
+
+/*
+ * Summary of all classes for printers which print one class at a time, see
+ * print_class(). Like printers, it ignores classes without name. It is
+ * computed by scan_classes() for --stream and by summarize_classes() in
+ * bmf2mof.c otherwise.
+ */
+struct classes_summary {
+  uint32_t count;  /* all class records */
+  int namespace;   /* some class has namespace other than root\default */
+  int classflags;  /* some class has classflags */
+};
+
+/* State of scan_classes(), properties of record are added to summary at next record */
+struct classes_scan {
+  struct classes_summary *summary;
+  int instance;
+  int name;
+  int namespace;
+  int classflags;
+};
+
+static void scan_classes_record_end(struct classes_scan *scan) {
+  if (scan->instance || !scan->name)
+    return;
+  if (scan->namespace)
+    scan->summary->namespace = 1;
+  if (scan->classflags)
+    scan->summary->classflags = 1;
+}
+
+static int scan_classes_record(void *data, uint32_t index, int instance) {
+  struct classes_scan *scan = data;
+  (void)index;
+  scan_classes_record_end(scan);
+  scan->instance = instance;
+  scan->name = 0;
+  scan->namespace = 0;
+  scan->classflags = 0;
+  if (!instance)
+    scan->summary->count++;
+  return 0;
+}
+
+static int scan_classes_property(void *data, enum mof_visit_scope scope, const struct mof_visit_property *property) {
+  struct classes_scan *scan = data;
+  if (scan->instance || scope != MOF_VISIT_CLASS)
+    return 0;
+  if (property->type == 0x08 && mof_span_equal(property->name, "__CLASS"))
+    scan->name = 1;
+  else if (property->type == 0x08 && mof_span_equal(property->name, "__NAMESPACE"))
+    scan->namespace = !mof_span_equal(property->string, "root\\default");
+  else if (property->type == 0x03 && mof_span_equal(property->name, "__CLASSFLAGS"))
+    scan->classflags = (property->sint32 != 0);
+  return 0;
+}
+
+/*
+ * Cheap first pass over raw records by visit_bmf(), nothing is converted
+ * or allocated. Returns nonzero when data are not valid.
+ */
+static int scan_classes(char *buf, uint32_t size, struct classes_summary *summary) {
+  struct mof_visitor visitor;
+  struct classes_scan scan;
+  memset(summary, 0, sizeof(*summary));
+  memset(&scan, 0, sizeof(scan));
+  scan.summary = summary;
+  scan.instance = 1;
+  memset(&visitor, 0, sizeof(visitor));
+  visitor.record = scan_classes_record;
+  visitor.property = scan_classes_property;
+  visitor.data = &scan;
+  if (visit_bmf(buf, size, &visitor) != 0)
+    return 1;
+  scan_classes_record_end(&scan);
+  return 0;
+}
+
+static void print_qualifiers(FILE *fout, struct mof_qualifier *qualifiers, uint32_t count, int indent) {
+  uint32_t i, j;
+  for (i = 0; i < count; ++i) {
+    fprintf(fout, "%*.sQualifier %u:\n", indent, "", i);
+    fprintf(fout, "%*.s  Name=%s\n", indent, "", qualifiers[i].name);
+    fprintf(fout, "%*.s  Flavors:\n", indent, "");
+    fprintf(fout, "%*.s    ToInstance=%s\n", indent, "", qualifiers[i].toinstance ? "TRUE" : "FALSE");
+    fprintf(fout, "%*.s    ToSubclass=%s\n", indent, "", qualifiers[i].tosubclass ? "TRUE" : "FALSE");
+    fprintf(fout, "%*.s    DisableOverride=%s\n", indent, "", qualifiers[i].disableoverride ? "TRUE" : "FALSE");
+    fprintf(fout, "%*.s    Amended=%s\n", indent, "", qualifiers[i].amended ? "TRUE" : "FALSE");
+    switch (qualifiers[i].type) {
+    case MOF_QUALIFIER_BOOLEAN:
+      fprintf(fout, "%*.s  Type=Boolean\n", indent, "");
+      fprintf(fout, "%*.s  Value=%s\n", indent, "", qualifiers[i].value.boolean ? "TRUE" : "FALSE");
+      break;
+    case MOF_QUALIFIER_SINT32:
+      fprintf(fout, "%*.s  Type=Numeric\n", indent, "");
+      fprintf(fout, "%*.s  Value=%d\n", indent, "", qualifiers[i].value.sint32);
+      break;
+    case MOF_QUALIFIER_STRING:
+      fprintf(fout, "%*.s  Type=String\n", indent, "");
+      fprintf(fout, "%*.s  Value=%s\n", indent, "", qualifiers[i].value.string);
+      break;
+    case MOF_QUALIFIER_STRING_ARRAY:
+      fprintf(fout, "%*.s  Type=String array\n", indent, "");
+      fprintf(fout, "%*.s  Value={", indent, "");
+      for (j = 0; j < qualifiers[i].value.strings.count; ++j)
+        fprintf(fout, "%s\"%s\"", j ? ", " : "", qualifiers[i].value.strings.values[j]);
+      fprintf(fout, "}\n");
+      break;
+    default:
+      fprintf(fout, "%*.s  Type=Unknown\n", indent, "");
+      break;
+    }
+  }
+}
+
+static void print_variable_type(FILE *fout, struct mof_variable *variable) {
+  char *variable_type = "unknown";
+  const char *type = NULL;
+  switch (variable->variable_type) {
+  case MOF_VARIABLE_BASIC:
+  case MOF_VARIABLE_BASIC_ARRAY:
+    variable_type = "Basic";
+    type = mof_basic_type_valid(variable->type.basic) ? mof_basic_types[variable->type.basic].name : "unknown";
+    break;
+  case MOF_VARIABLE_OBJECT:
+  case MOF_VARIABLE_OBJECT_ARRAY:
+    variable_type = "Object";
+    type = variable->type.object;
+    break;
+  default:
+    break;
+  }
   fprintf(fout, "%s", variable_type);
   if (type)
     fprintf(fout, ":%s", type);
@@ -993,11 +2071,88 @@ static void print_variable_type(FILE *fout, struct mof_variable *variable) {
   }
 }
 
+/* Print element i of default value, with quote strings are quoted and escaped */
+static void print_value(FILE *fout, struct mof_variable *variable, uint32_t i, int quote) {
+  union mof_value *value = &variable->values[i];
+  char buf[32];
+  uint16_t c;
+  int prec;
+  switch (variable->type.basic) {
+  case MOF_BASIC_TYPE_SINT8:
+  case MOF_BASIC_TYPE_SINT16:
+  case MOF_BASIC_TYPE_SINT32:
+  case MOF_BASIC_TYPE_SINT64:
+    fprintf(fout, "%lld", (long long)value->sint);
+    break;
+  case MOF_BASIC_TYPE_UINT8:
+  case MOF_BASIC_TYPE_UINT16:
+  case MOF_BASIC_TYPE_UINT32:
+  case MOF_BASIC_TYPE_UINT64:
+    fprintf(fout, "%llu", (unsigned long long)value->uint);
+    break;
+  case MOF_BASIC_TYPE_REAL32:
+  case MOF_BASIC_TYPE_REAL64:
+    /* shortest representation which reads back to same value */
+    for (prec = 1; prec < 17; ++prec) {
+      snprintf(buf, sizeof(buf), "%.*g", prec, value->real);
+      if (variable->type.basic == MOF_BASIC_TYPE_REAL32 ? (float)strtod(buf, NULL) == (float)value->real : strtod(buf, NULL) == value->real)
+        break;
+    }
+    snprintf(buf, sizeof(buf), "%.*g", prec, value->real);
+    fprintf(fout, "%s", buf);
+    break;
+  case MOF_BASIC_TYPE_BOOLEAN:
+    fprintf(fout, "%s", value->uint ? "TRUE" : "FALSE");
+    break;
+  case MOF_BASIC_TYPE_CHAR16:
+    c = value->uint;
+    convert_string(buf, (char *)&c, sizeof(c));
+    if (!quote)
+      fprintf(fout, "%s", buf);
+    else if (buf[0] == '\'' || buf[0] == '\\')
+      fprintf(fout, "'\\%s'", buf);
+    else
+      fprintf(fout, "'%s'", buf);
+    break;
+  case MOF_BASIC_TYPE_STRING:
+  case MOF_BASIC_TYPE_DATETIME:
+    if (!quote) {
+      fprintf(fout, "%s", value->string);
+      break;
+    }
+    fputc('"', fout);
+    for (prec = 0; value->string[prec]; ++prec) {
+      if (value->string[prec] == '"' || value->string[prec] == '\\')
+        fputc('\\', fout);
+      fputc(value->string[prec], fout);
+    }
+    fputc('"', fout);
+    break;
+  default:
+    fprintf(fout, "unknown");
+    break;
+  }
+}
+
 static void print_variable(FILE *fout, struct mof_variable *variable, int indent) {
+  uint32_t i;
   fprintf(fout, "%*.s  Name=%s\n", indent, "", variable->name);
   fprintf(fout, "%*.s  Type=", indent, "");
   print_variable_type(fout, variable);
   fprintf(fout, "\n");
+  if (variable->has_value && variable->variable_type == MOF_VARIABLE_BASIC) {
+    fprintf(fout, "%*.s  Value=", indent, "");
+    print_value(fout, variable, 0, 0);
+    fprintf(fout, "\n");
+  } else if (variable->has_value) {
+    fprintf(fout, "%*.s  Value={", indent, "");
+    for (i = 0; i < variable->values_count; ++i) {
+      if (i != 0)
+        fprintf(fout, ", ");
+      print_value(fout, variable, i, 1);
+    }
+    fprintf(fout, "}\n");
+  }
   print_qualifiers(fout, variable->qualifiers, variable->qualifiers_count, indent+2);
 }
 
@@ -1033,39 +2188,532 @@ static void print_parameters(FILE *fout, struct mof_method *method) {
   }
 }
 
+static void print_class(FILE *fout, struct mof_class *class, uint32_t index, const struct classes_summary *summary) {
+  uint32_t j;
+  (void)summary;
+  TRACE_BEGIN(print_class, index, class->name);
+  fprintf(fout, "Class %u:\n", index);
+  fprintf(fout, "  Name=%s\n", class->name);
+  fprintf(fout, "  Superclassname=%s\n", class->superclassname);
+  fprintf(fout, "  Classflags=%d\n", (int)class->classflags);
+  fprintf(fout, "  Namespace=%s\n", class->namespace);
+  print_qualifiers(fout, class->qualifiers, class->qualifiers_count, 2);
+  print_variables(fout, class->variables, class->variables_count);
+  for (j = 0; j < class->methods_count; ++j) {
+    fprintf(fout, "  Method %u:\n", j);
+    fprintf(fout, "    Name=%s\n", class->methods[j].name);
+    print_qualifiers(fout, class->methods[j].qualifiers, class->methods[j].qualifiers_count, 4);
+    fprintf(fout, "    Return value:\n");
+    fprintf(fout, "      Type=");
+    if (class->methods[j].return_value.variable_type)
+       print_variable_type(fout, &class->methods[j].return_value);
+    else
+       fprintf(fout, "Void");
+    fprintf(fout, "\n");
+    print_parameters(fout, &class->methods[j]);
+  }
+  TRACE_END(print_class, index, class->name);
+}
+
 static void print_classes(FILE *fout, struct mof_class *classes, uint32_t count) {
+  uint32_t i;
+  for (i = 0; i < count; ++i)
+    print_class(fout, &classes[i], i, NULL);
+}
+
+static void print_instance(FILE *fout, struct mof_class *instance, uint32_t index) {
+  TRACE_BEGIN(print_instance, index, instance->name);
+  fprintf(fout, "Instance %u:\n", index);
+  fprintf(fout, "  Class=%s\n", instance->name);
+  fprintf(fout, "  Namespace=%s\n", instance->namespace);
+  print_qualifiers(fout, instance->qualifiers, instance->qualifiers_count, 2);
+  print_variables(fout, instance->variables, instance->variables_count);
+  TRACE_END(print_instance, index, instance->name);
+}
+
+/*
+ * JSON output. Document is object with array "classes" printed by
+ * print_json_classes() and array "instances" of objects printed by
+ * print_json_instance(). Names and strings which are missing are null.
+ */
+static void print_json_string(FILE *fout, const char *str) {
+  const unsigned char *ptr = (const unsigned char *)str;
+  if (!str) {
+    fprintf(fout, "null");
+    return;
+  }
+  fputc('"', fout);
+  for (; *ptr; ++ptr) {
+    if (*ptr == '"' || *ptr == '\\')
+      fprintf(fout, "\\%c", *ptr);
+    else if (*ptr < 0x20)
+      fprintf(fout, "\\u%04x", *ptr);
+    else
+      fputc(*ptr, fout);
+  }
+  fputc('"', fout);
+}
+
+static void print_json_qualifiers(FILE *fout, struct mof_qualifier *qualifiers, uint32_t count) {
   uint32_t i, j;
+  fprintf(fout, "[");
   for (i = 0; i < count; ++i) {
-    fprintf(fout, "Class %u:\n", i);
-    fprintf(fout, "  Name=%s\n", classes[i].name);
-    fprintf(fout, "  Superclassname=%s\n", classes[i].superclassname);
-    fprintf(fout, "  Classflags=%d\n", (int)classes[i].classflags);
-    fprintf(fout, "  Namespace=%s\n", classes[i].namespace);
-    print_qualifiers(fout, classes[i].qualifiers, classes[i].qualifiers_count, 2);
-    print_variables(fout, classes[i].variables, classes[i].variables_count);
+    fprintf(fout, "%s{\"name\":", i ? "," : "");
+    print_json_string(fout, qualifiers[i].name);
+    switch (qualifiers[i].type) {
+    case MOF_QUALIFIER_BOOLEAN:
+      fprintf(fout, ",\"type\":\"boolean\",\"value\":%s", qualifiers[i].value.boolean ? "true" : "false");
+      break;
+    case MOF_QUALIFIER_SINT32:
+      fprintf(fout, ",\"type\":\"sint32\",\"value\":%d", qualifiers[i].value.sint32);
+      break;
+    case MOF_QUALIFIER_STRING:
+      fprintf(fout, ",\"type\":\"string\",\"value\":");
+      print_json_string(fout, qualifiers[i].value.string);
+      break;
+    case MOF_QUALIFIER_STRING_ARRAY:
+      fprintf(fout, ",\"type\":\"string[]\",\"value\":[");
+      for (j = 0; j < qualifiers[i].value.strings.count; ++j) {
+        if (j != 0)
+          fprintf(fout, ",");
+        print_json_string(fout, qualifiers[i].value.strings.values[j]);
+      }
+      fprintf(fout, "]");
+      break;
+    default:
+      fprintf(fout, ",\"type\":null");
+      break;
+    }
+    fprintf(fout, ",\"flavors\":[");
+    j = 0;
+    if (qualifiers[i].toinstance)
+      fprintf(fout, "%s\"ToInstance\"", j++ ? "," : "");
+    if (qualifiers[i].tosubclass)
+      fprintf(fout, "%s\"ToSubclass\"", j++ ? "," : "");
+    if (qualifiers[i].disableoverride)
+      fprintf(fout, "%s\"DisableOverride\"", j++ ? "," : "");
+    if (qualifiers[i].amended)
+      fprintf(fout, "%s\"Amended\"", j++ ? "," : "");
+    fprintf(fout, "]}");
+  }
+  fprintf(fout, "]");
+}
+
+static void print_json_value(FILE *fout, struct mof_variable *variable, uint32_t i) {
+  union mof_value *value = &variable->values[i];
+  char buf[8];
+  uint16_t c;
+  switch (variable->type.basic) {
+  case MOF_BASIC_TYPE_REAL32:
+  case MOF_BASIC_TYPE_REAL64:
+    /* JSON has no infinity and NaN */
+    if (value->real != value->real || value->real - value->real != 0)
+      fprintf(fout, "null");
+    else
+      print_value(fout, variable, i, 0);
+    break;
+  case MOF_BASIC_TYPE_BOOLEAN:
+    fprintf(fout, "%s", value->uint ? "true" : "false");
+    break;
+  case MOF_BASIC_TYPE_CHAR16:
+    c = value->uint;
+    convert_string(buf, (char *)&c, sizeof(c));
+    print_json_string(fout, buf);
+    break;
+  case MOF_BASIC_TYPE_STRING:
+  case MOF_BASIC_TYPE_DATETIME:
+    print_json_string(fout, value->string);
+    break;
+  case MOF_BASIC_TYPE_UNKNOWN:
+    fprintf(fout, "null");
+    break;
+  default:
+    print_value(fout, variable, i, 0);
+    break;
+  }
+}
+
+static void print_json_variable_type(FILE *fout, struct mof_variable *variable) {
+  fprintf(fout, "\"type\":");
+  switch (variable->variable_type) {
+  case MOF_VARIABLE_BASIC:
+  case MOF_VARIABLE_BASIC_ARRAY:
+    print_json_string(fout, mof_basic_type_valid(variable->type.basic) ? mof_basic_types[variable->type.basic].mof_name : NULL);
+    break;
+  case MOF_VARIABLE_OBJECT:
+  case MOF_VARIABLE_OBJECT_ARRAY:
+    fprintf(fout, "\"object\",\"class\":");
+    print_json_string(fout, variable->type.object);
+    break;
+  default:
+    fprintf(fout, "null");
+    break;
+  }
+  if (variable->variable_type == MOF_VARIABLE_BASIC_ARRAY || variable->variable_type == MOF_VARIABLE_OBJECT_ARRAY) {
+    fprintf(fout, ",\"array\":true");
+    if (variable->has_array_max)
+      fprintf(fout, ",\"array_max\":%d", variable->array_max);
+  }
+}
+
+static void print_json_variable(FILE *fout, struct mof_variable *variable) {
+  uint32_t i;
+  fprintf(fout, "{\"name\":");
+  print_json_string(fout, variable->name);
+  fprintf(fout, ",");
+  print_json_variable_type(fout, variable);
+  if (variable->has_value && variable->variable_type == MOF_VARIABLE_BASIC) {
+    fprintf(fout, ",\"value\":");
+    print_json_value(fout, variable, 0);
+  } else if (variable->has_value) {
+    fprintf(fout, ",\"value\":[");
+    for (i = 0; i < variable->values_count; ++i) {
+      if (i != 0)
+        fprintf(fout, ",");
+      print_json_value(fout, variable, i);
+    }
+    fprintf(fout, "]");
+  }
+  fprintf(fout, ",\"qualifiers\":");
+  print_json_qualifiers(fout, variable->qualifiers, variable->qualifiers_count);
+  fprintf(fout, "}");
+}
+
+static void print_json_variables(FILE *fout, struct mof_variable *variables, uint32_t count) {
+  uint32_t i;
+  fprintf(fout, "[");
+  for (i = 0; i < count; ++i) {
+    if (i != 0)
+      fprintf(fout, ",");
+    print_json_variable(fout, &variables[i]);
+  }
+  fprintf(fout, "]");
+}
+
+static void print_json_method(FILE *fout, struct mof_method *method) {
+  static const char *directions[] = { NULL, "in", "out", "in,out" };
+  uint32_t i;
+  fprintf(fout, "{\"name\":");
+  print_json_string(fout, method->name);
+  fprintf(fout, ",\"qualifiers\":");
+  print_json_qualifiers(fout, method->qualifiers, method->qualifiers_count);
+  fprintf(fout, ",\"return\":");
+  if (method->return_value.variable_type) {
+    fprintf(fout, "{");
+    print_json_variable_type(fout, &method->return_value);
+    fprintf(fout, "}");
+  } else {
+    fprintf(fout, "null");
+  }
+  fprintf(fout, ",\"parameters\":[");
+  for (i = 0; i < method->parameters_count; ++i) {
+    fprintf(fout, "%s{\"direction\":", i ? "," : "");
+    print_json_string(fout, method->parameters_direction[i] <= MOF_PARAMETER_IN_OUT ? directions[method->parameters_direction[i]] : NULL);
+    fprintf(fout, ",\"variable\":");
+    print_json_variable(fout, &method->parameters[i]);
+    fprintf(fout, "}");
+  }
+  fprintf(fout, "]}");
+}
+
+static void print_json_classes(FILE *fout, struct mof_class *classes, uint32_t count) {
+  uint32_t i, j;
+  fprintf(fout, "[");
+  for (i = 0; i < count; ++i) {
+    TRACE_BEGIN(print_json_class, i, classes[i].name);
+    fprintf(fout, "%s\n{\"name\":", i ? "," : "");
+    print_json_string(fout, classes[i].name);
+    fprintf(fout, ",\"superclass\":");
+    print_json_string(fout, classes[i].superclassname);
+    fprintf(fout, ",\"namespace\":");
+    print_json_string(fout, classes[i].namespace);
+    fprintf(fout, ",\"classflags\":%d,\"qualifiers\":", (int)classes[i].classflags);
+    print_json_qualifiers(fout, classes[i].qualifiers, classes[i].qualifiers_count);
+    fprintf(fout, ",\"variables\":");
+    print_json_variables(fout, classes[i].variables, classes[i].variables_count);
+    fprintf(fout, ",\"methods\":[");
     for (j = 0; j < classes[i].methods_count; ++j) {
-      fprintf(fout, "  Method %u:\n", j);
-      fprintf(fout, "    Name=%s\n", classes[i].methods[j].name);
-      print_qualifiers(fout, classes[i].methods[j].qualifiers, classes[i].methods[j].qualifiers_count, 4);
-      fprintf(fout, "    Return value:\n");
-      fprintf(fout, "      Type=");
-      if (classes[i].methods[j].return_value.variable_type)
-         print_variable_type(fout, &classes[i].methods[j].return_value);
-      else
-         fprintf(fout, "Void");
-      fprintf(fout, "\n");
-      print_parameters(fout, &classes[i].methods[j]);
+      if (j != 0)
+        fprintf(fout, ",");
+      print_json_method(fout, &classes[i].methods[j]);
     }
+    fprintf(fout, "]}");
+    TRACE_END(print_json_class, i, classes[i].name);
   }
+  fprintf(fout, "]");
+}
+
+static void print_json_instance(FILE *fout, struct mof_class *instance, uint32_t index) {
+  TRACE_BEGIN(print_json_instance, index, instance->name);
+  fprintf(fout, "%s\n{\"class\":", index ? "," : "");
+  print_json_string(fout, instance->name);
+  fprintf(fout, ",\"namespace\":");
+  print_json_string(fout, instance->namespace);
+  fprintf(fout, ",\"qualifiers\":");
+  print_json_qualifiers(fout, instance->qualifiers, instance->qualifiers_count);
+  fprintf(fout, ",\"variables\":");
+  print_json_variables(fout, instance->variables, instance->variables_count);
+  fprintf(fout, "}");
+  TRACE_END(print_json_instance, index, instance->name);
 }
 
+/* Structured dump for --dump, includer can replace print_class(), print_classes() and print_instance() */
+static void dump_classes(FILE *fout, struct mof_class *classes, uint32_t count) {
+  print_classes(fout, classes, count);
+}
+
+static void dump_instance(FILE *fout, struct mof_class *instance, uint32_t index) {
+  print_instance(fout, instance, index);
+}
+
+#undef print_class
+static void print_class(FILE *fout, struct mof_class *class, uint32_t index, const struct classes_summary *summary);
 #undef print_classes
 static void print_classes(FILE *fout, struct mof_class *classes, uint32_t count);
+#undef print_instance
+static void print_instance(FILE *fout, struct mof_class *instance, uint32_t index);
+
+static void print_instance_callback(struct mof_class *instance, uint32_t index, void *data) {
+  print_instance((FILE *)data, instance, index);
+}
+
+/* Classes printed by parse_bmf_classes() callback with --stream */
+struct print_stream {
+  FILE *fout;
+  struct classes_summary summary;
+};
+
+static void print_class_callback(struct mof_class *class, uint32_t index, void *data) {
+  struct print_stream *stream = data;
+  print_class(stream->fout, class, index, &stream->summary);
+}
+
+/*
+ * Instances are not kept in memory, so whole document is validated by first
+ * pass and instances are parsed again only for printing. Nothing is printed
+ * for invalid document. Warnings were recorded by first pass.
+ */
+static void print_bmf_instances(char *buf, uint32_t size, void (*callback)(struct mof_class *instance, uint32_t index, void *data), void *data) {
+  diag_muted = 1;
+  parse_bmf_instances(buf, size, callback, data);
+  diag_muted = 0;
+}
+
+static int stream_supported(void) {
+  return 1;
+}
 
+/*
+ * With --stream every class is printed as soon as it is parsed and freed
+ * right after, so only one class is in memory and output starts early.
+ * Summary needed by printer is taken from first pass over raw records.
+ * When first pass fails, data are processed normally, so errors are same.
+ * Error found later stops processing, output written so far is kept.
+ * Without --stream nothing is printed for invalid document.
+ */
 static int process_data(char *data, uint32_t size, FILE *fout) {
   struct mof_classes classes;
+  struct print_stream stream;
+  jmp_buf jmp;
+  if (setjmp(jmp) != 0) {
+    /* memory of failed document is released by mem_free_all() */
+    diag_muted = 0;
+    error_jmp = NULL;
+    return 1;
+  }
+  error_jmp = &jmp;
+  if (stream_classes && scan_classes(data, size, &stream.summary) == 0) {
+    stream.fout = fout;
+    classes = parse_bmf_classes(data, size, print_class_callback, &stream);
+    parse_bmf_instances(data, size, print_instance_callback, fout);
+  } else {
+    classes = parse_bmf_classes(data, size, NULL, NULL);
+    parse_bmf_instances(data, size, NULL, NULL);
+    print_classes(fout, classes.classes, classes.count);
+    print_bmf_instances(data, size, print_instance_callback, fout);
+  }
+  free_classes(classes.classes, classes.count);
+  error_jmp = NULL;
+  return 0;
+}
+
+/* MOF printer is provided by bmf2mof.c, it replaces print_classes() and print_instance() */
+static int mof_supported(void) {
+  return 0;
+}
+
+#undef mof_supported
+static int mof_supported(void);
+
+static int output_supported(enum output_format format) {
+  return format == OUTPUT_RAW || format == OUTPUT_DUMP || format == OUTPUT_JSON || (format == OUTPUT_MOF && mof_supported());
+}
+
+#undef output_supported
+static int output_supported(enum output_format format);
+
+static void print_outputs_instance(struct mof_class *instance, uint32_t index, void *data) {
+  FILE **outputs = data;
+  if (outputs[OUTPUT_MOF])
+    print_instance(outputs[OUTPUT_MOF], instance, index);
+  if (outputs[OUTPUT_DUMP])
+    dump_instance(outputs[OUTPUT_DUMP], instance, index);
+  if (outputs[OUTPUT_JSON])
+    print_json_instance(outputs[OUTPUT_JSON], instance, index);
+}
+
+static int process_outputs(char *data, uint32_t size, FILE *outputs[OUTPUT_COUNT]) {
+  struct mof_classes classes;
+  jmp_buf jmp;
+  if (bmfdec_process_outputs(data, size, outputs) != 0)
+    return 1;
+  if (!outputs[OUTPUT_MOF] && !outputs[OUTPUT_DUMP] && !outputs[OUTPUT_JSON])
+    return 0;
+  if (setjmp(jmp) != 0) {
+    diag_muted = 0;
+    error_jmp = NULL;
+    return 1;
+  }
+  error_jmp = &jmp;
+  classes = parse_bmf_classes(data, size, NULL, NULL);
+  parse_bmf_instances(data, size, NULL, NULL);
+  if (outputs[OUTPUT_MOF])
+    print_classes(outputs[OUTPUT_MOF], classes.classes, classes.count);
+  if (outputs[OUTPUT_DUMP])
+    dump_classes(outputs[OUTPUT_DUMP], classes.classes, classes.count);
+  if (outputs[OUTPUT_JSON]) {
+    fprintf(outputs[OUTPUT_JSON], "{\"classes\":");
+    print_json_classes(outputs[OUTPUT_JSON], classes.classes, classes.count);
+    fprintf(outputs[OUTPUT_JSON], ",\n\"instances\":[");
+  }
+  print_bmf_instances(data, size, print_outputs_instance, outputs);
+  if (outputs[OUTPUT_JSON])
+    fprintf(outputs[OUTPUT_JSON], "]}\n");
+  free_classes(classes.classes, classes.count);
+  error_jmp = NULL;
+  return 0;
+}
+
+/* Document parsed by parse_item(), instances are kept until print thread prints them */
+struct batch_document {
+  struct mof_classes classes;
+  uint32_t instances_count;
+  uint32_t instances_size;
+  struct mof_class *instances;
+};
+
+static void keep_instance_callback(struct mof_class *instance, uint32_t index, void *data) {
+  struct batch_document *document = data;
+  struct mof_class *instances;
+  (void)index;
+  if (document->instances_count == document->instances_size) {
+    instances = mem_realloc(document->instances, 2 * (document->instances_size + 4) * sizeof(*instances));
+    if (!instances) error("realloc failed");
+    document->instances = instances;
+    document->instances_size = 2 * (document->instances_size + 4);
+  }
+  /* parse_root() frees instance after callback, so take its memory */
+  document->instances[document->instances_count++] = *instance;
+  memset(instance, 0, sizeof(*instance));
+}
+
+static int parse_item(struct batch_item *item) {
+  struct batch_document *document;
+  jmp_buf jmp;
+  document = mem_calloc(1, sizeof(*document));
+  if (!document)
+    return 1;
+  item->parsed = document;
+  if (setjmp(jmp) != 0) {
+    error_jmp = NULL;
+    return 1;
+  }
+  error_jmp = &jmp;
+  document->classes = parse_bmf_classes(item->data, item->lout, NULL, NULL);
+  parse_bmf_instances(item->data, item->lout, keep_instance_callback, document);
+  error_jmp = NULL;
+  return 0;
+}
+
+static int print_item(struct batch_item *item, FILE *fout) {
+  struct batch_document *document = item->parsed;
+  uint32_t i;
+  print_classes(fout, document->classes.classes, document->classes.count);
+  for (i = 0; i < document->instances_count; ++i)
+    print_instance(fout, &document->instances[i], i);
+  return ferror(fout) ? 1 : 0;
+}
+
+static void release_item(struct batch_item *item) {
+  struct batch_document *document = item->parsed;
+  if (!document)
+    return;
+  free_classes(document->classes.classes, document->classes.count);
+  free_classes(document->instances, document->instances_count);
+  mem_free(document);
+  item->parsed = NULL;
+}
+
+static int check_data(char *data, uint32_t size, uint32_t *offset) {
+  check_base = data;
+  check_offset = 0;
+  if (check_bmf(data, size) == 0)
+    return 0;
+  *offset = check_offset;
+  return 1;
+}
+
+/* hashes of classes already stored by --dedupe */
+static struct hash_map dedupe_classes;
+
+static char *dedupe_data(char *data, uint32_t size, FILE *fout, const char *dir) {
+  struct mof_classes classes;
+  struct hash_map_entry *entry;
+  char path[4096];
+  jmp_buf jmp;
+  FILE *fclass;
+  char *out;
+  uint64_t hash;
+  uint32_t i;
+  if (setjmp(jmp) != 0) {
+    diag_muted = 0;
+    error_jmp = NULL;
+    return NULL;
+  }
+  error_jmp = &jmp;
   classes = parse_bmf(data, size);
   print_classes(fout, classes.classes, classes.count);
+  print_bmf_instances(data, size, print_instance_callback, fout);
+  error_jmp = NULL;
+  out = malloc(17 * classes.count + 1);
+  if (!out) {
+    free_classes(classes.classes, classes.count);
+    return NULL;
+  }
+  out[0] = 0;
+  for (i = 0; i < classes.count; ++i) {
+    if (!classes.classes[i].name)
+      continue;
+    hash = hash_class(&classes.classes[i]);
+    sprintf(out + strlen(out), "%s%016llx", out[0] ? " " : "", (unsigned long long)hash);
+    if (hash_map_find(&dedupe_classes, hash))
+      continue;
+    entry = hash_map_add(&dedupe_classes, hash);
+    if (!entry) {
+      fprintf(stderr, "Cannot allocate memory for hash map\n");
+      free(out);
+      free_classes(classes.classes, classes.count);
+      return NULL;
+    }
+    snprintf(path, sizeof(path), "%s/classes/%016llx", dir, (unsigned long long)hash);
+    fclass = fopen(path, "wb");
+    if (!fclass) {
+      fprintf(stderr, "Cannot open output file %s: %s\n", path, strerror(errno));
+      continue;
+    }
+    print_classes(fclass, &classes.classes[i], 1);
+    fclose(fclass);
+  }
   free_classes(classes.classes, classes.count);
-  return 0;
+  return out;
 }
@@ -0,0 +1,1298 @@
+/*
+    mof2bmf.c - Compile UTF-8 plain text MOF file to binary MOF file (BMF)
+    Copyright (C) 2017  Pali Rohár <pali.rohar@gmail.com>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; version 2.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#define main bmf2mof_main
+#include "bmf2mof.c"
+#undef main
+
+#include <stdarg.h>
+
+/*
+ * Compiler for subset of MOF written by bmf2mof: namespace and classflags
+ * pragmas, qualifiers with flavors, classes with properties (arrays and
+ * default values) and methods with in/out parameters, and instances. Text
+ * is parsed into struct mof_class records as produced by parse_bmf(), they
+ * are written in BMF layout described in bmfdec.c (flavors of qualifiers
+ * in second part) and compressed by DS-01, so bmf2mof reads them back.
+ * Written data are validated by check_bmf() before they are compressed.
+ *
+ * bmf2mof writes pragmas before every class and before every instance not
+ * in root\default, so pragma here applies only to next class or instance.
+ * Types of instance properties are taken from class of the same name
+ * defined earlier in file (or its superclasses), otherwise they are
+ * guessed from value.
+ */
+
+/* Largest decompressed data accepted by check_header() */
+#define MOF2BMF_MAX_SIZE 0x2000000
+
+enum mof_token {
+  MOF_TOKEN_END,
+  MOF_TOKEN_IDENT,
+  MOF_TOKEN_NUMBER,
+  MOF_TOKEN_STRING,
+  MOF_TOKEN_CHAR,
+  MOF_TOKEN_PUNCT,
+};
+
+/* Current token is text[0..len), for strings and chars without quotes and still escaped */
+struct mof_lexer {
+  const char *name;
+  const char *pos;
+  const char *end;
+  unsigned line;
+  unsigned token_line;
+  enum mof_token token;
+  const char *text;
+  uint32_t len;
+};
+
+static void syntax_error(struct mof_lexer *lex, const char *format, ...) {
+  va_list args;
+  fprintf(stderr, "%s:%u: ", lex->name, lex->token_line);
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fprintf(stderr, "\n");
+  if (error_jmp)
+    longjmp(*error_jmp, 1);
+  exit(1);
+}
+
+#define is_ident_char(c) (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || ((c) >= '0' && (c) <= '9') || (c) == '_' || ((c) & 0x80))
+#define is_digit(c) ((c) >= '0' && (c) <= '9')
+
+static void lex_next(struct mof_lexer *lex) {
+  const char *p = lex->pos;
+  const char *end = lex->end;
+  char quote;
+  for (;;) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+      if (*p == '\n')
+        lex->line++;
+      ++p;
+    }
+    if (end-p >= 2 && p[0] == '/' && p[1] == '/') {
+      while (p < end && *p != '\n')
+        ++p;
+    } else if (end-p >= 2 && p[0] == '/' && p[1] == '*') {
+      lex->token_line = lex->line;
+      for (p += 2; end-p >= 2 && (p[0] != '*' || p[1] != '/'); ++p) {
+        if (*p == '\n')
+          lex->line++;
+      }
+      if (end-p < 2)
+        syntax_error(lex, "Unterminated comment");
+      p += 2;
+    } else {
+      break;
+    }
+  }
+  lex->token_line = lex->line;
+  lex->text = p;
+  if (p == end) {
+    lex->token = MOF_TOKEN_END;
+  } else if (is_digit(*p) || ((*p == '-' || *p == '+' || *p == '.') && end-p >= 2 && (is_ident_char(p[1]) || p[1] == '.'))) {
+    /* digits, letters, dot and sign of exponent, strtod() and friends check it later */
+    for (++p; p < end && (is_ident_char(*p) || *p == '.' || ((*p == '-' || *p == '+') && (p[-1] == 'e' || p[-1] == 'E'))); ++p);
+    lex->token = MOF_TOKEN_NUMBER;
+  } else if (is_ident_char(*p)) {
+    for (++p; p < end && is_ident_char(*p); ++p);
+    lex->token = MOF_TOKEN_IDENT;
+  } else if (*p == '"' || *p == '\'') {
+    quote = *p++;
+    lex->text = p;
+    while (p < end && *p != quote) {
+      if (*p == '\\' && end-p >= 2)
+        ++p;
+      if (*p == '\n')
+        lex->line++;
+      ++p;
+    }
+    if (p == end)
+      syntax_error(lex, "Unterminated %s", quote == '"' ? "string" : "character");
+    lex->token = (quote == '"') ? MOF_TOKEN_STRING : MOF_TOKEN_CHAR;
+    lex->len = p - lex->text;
+    lex->pos = p + 1;
+    return;
+  } else if (*p && strchr("#()[]{},;:=", *p)) {
+    ++p;
+    lex->token = MOF_TOKEN_PUNCT;
+  } else {
+    syntax_error(lex, "Unexpected character 0x%02x", (unsigned char)*p);
+  }
+  lex->len = p - lex->text;
+  lex->pos = p;
+}
+
+static int lex_is(struct mof_lexer *lex, char c) {
+  return lex->token == MOF_TOKEN_PUNCT && lex->text[0] == c;
+}
+
+/* Keywords and values TRUE, FALSE are case insensitive */
+static int lex_keyword(struct mof_lexer *lex, const char *keyword) {
+  return lex->token == MOF_TOKEN_IDENT && strlen(keyword) == lex->len && strncasecmp(lex->text, keyword, lex->len) == 0;
+}
+
+static void lex_expect(struct mof_lexer *lex, char c) {
+  if (!lex_is(lex, c))
+    syntax_error(lex, "Expected '%c'", c);
+  lex_next(lex);
+}
+
+static void lex_expect_keyword(struct mof_lexer *lex, const char *keyword) {
+  if (!lex_keyword(lex, keyword))
+    syntax_error(lex, "Expected %s", keyword);
+  lex_next(lex);
+}
+
+static char *lex_name(struct mof_lexer *lex) {
+  char *out;
+  if (lex->token != MOF_TOKEN_IDENT)
+    syntax_error(lex, "Expected name");
+  out = mem_malloc(lex->len+1);
+  if (!out) error("malloc failed");
+  memcpy(out, lex->text, lex->len);
+  out[lex->len] = 0;
+  lex_next(lex);
+  return out;
+}
+
+/* Unescaped string or char token */
+static char *lex_string(struct mof_lexer *lex) {
+  char *out, *p;
+  uint32_t i;
+  if (lex->token != MOF_TOKEN_STRING && lex->token != MOF_TOKEN_CHAR)
+    syntax_error(lex, "Expected string");
+  out = mem_malloc(lex->len+1);
+  if (!out) error("malloc failed");
+  for (i = 0, p = out; i < lex->len; ++i) {
+    if (lex->text[i] != '\\') {
+      *p++ = lex->text[i];
+      continue;
+    }
+    switch (lex->text[++i]) {
+    case 'b': *p++ = '\b'; break;
+    case 't': *p++ = '\t'; break;
+    case 'n': *p++ = '\n'; break;
+    case 'f': *p++ = '\f'; break;
+    case 'r': *p++ = '\r'; break;
+    default: *p++ = lex->text[i]; break;
+    }
+  }
+  *p = 0;
+  lex_next(lex);
+  return out;
+}
+
+/* Number token as NUL terminated string in buf */
+static const char *lex_number(struct mof_lexer *lex, char *buf, size_t size) {
+  if ((lex->token != MOF_TOKEN_NUMBER && lex->token != MOF_TOKEN_IDENT) || lex->len >= size)
+    syntax_error(lex, "Expected number");
+  memcpy(buf, lex->text, lex->len);
+  buf[lex->len] = 0;
+  return buf;
+}
+
+/* Decode one UTF-8 character to UTF-16 code units, returns their count or 0 when invalid */
+static int utf8_decode(const unsigned char **str, uint16_t out[2]) {
+  const unsigned char *s = *str;
+  uint32_t c;
+  if (s[0] < 0x80) {
+    c = s[0];
+    s += 1;
+  } else if ((s[0] & 0xE0) == 0xC0 && (s[1] & 0xC0) == 0x80) {
+    c = ((s[0] & 0x1F) << 6) | (s[1] & 0x3F);
+    s += 2;
+  } else if ((s[0] & 0xF0) == 0xE0 && (s[1] & 0xC0) == 0x80 && (s[2] & 0xC0) == 0x80) {
+    /* also surrogates, convert_string() writes unpaired ones this way */
+    c = ((s[0] & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+    s += 3;
+  } else if ((s[0] & 0xF8) == 0xF0 && (s[1] & 0xC0) == 0x80 && (s[2] & 0xC0) == 0x80 && (s[3] & 0xC0) == 0x80) {
+    c = ((s[0] & 0x07) << 18) | ((s[1] & 0x3F) << 12) | ((s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+    if (c < 0x10000 || c > 0x10FFFF)
+      return 0;
+    *str = s + 4;
+    out[0] = 0xD800 + ((c - 0x10000) >> 10);
+    out[1] = 0xDC00 + ((c - 0x10000) & 0x3FF);
+    return 2;
+  } else {
+    return 0;
+  }
+  *str = s;
+  out[0] = c;
+  return 1;
+}
+
+/* Make room for one more item, capacity doubles when count is power of two */
+static void *array_grow(void *items, uint32_t count, size_t size) {
+  if (count & (count-1))
+    return items;
+  if (count > UINT32_MAX/2) error("Too many items");
+  items = mem_realloc(items, (count ? 2*count : 1) * size);
+  if (!items) error("realloc failed");
+  return items;
+}
+
+/* Pointer to new zeroed item at end of array */
+#define array_push(items, count) ((items) = array_grow((items), (count), sizeof(*(items))), memset(&(items)[(count)], 0, sizeof(*(items))), &(items)[(count)++])
+
+static void compile_qualifier(struct mof_lexer *lex, struct mof_qualifier *qualifier) {
+  char **strings = NULL;
+  uint32_t count = 0, size = 0, i;
+  char buf[32];
+  char *data, *end;
+  long value;
+  qualifier->name = lex_name(lex);
+  qualifier->type = MOF_QUALIFIER_BOOLEAN;
+  qualifier->value.boolean = 1;
+  if (lex_is(lex, '(')) {
+    lex_next(lex);
+    if (lex_keyword(lex, "TRUE") || lex_keyword(lex, "FALSE")) {
+      qualifier->value.boolean = lex_keyword(lex, "TRUE");
+      lex_next(lex);
+    } else if (lex->token == MOF_TOKEN_STRING) {
+      qualifier->type = MOF_QUALIFIER_STRING;
+      qualifier->value.string = lex_string(lex);
+    } else {
+      lex_number(lex, buf, sizeof(buf));
+      errno = 0;
+      value = strtol(buf, &end, 10);
+      if (errno || *end || value < INT32_MIN || value > INT32_MAX)
+        syntax_error(lex, "Invalid value of qualifier %s", qualifier->name);
+      qualifier->type = MOF_QUALIFIER_SINT32;
+      qualifier->value.sint32 = value;
+      lex_next(lex);
+    }
+    lex_expect(lex, ')');
+  } else if (lex_is(lex, '{')) {
+    lex_next(lex);
+    while (!lex_is(lex, '}')) {
+      if (count)
+        lex_expect(lex, ',');
+      *array_push(strings, count) = lex_string(lex);
+      size += strlen(strings[count-1]) + 1;
+    }
+    lex_next(lex);
+    /* pointers followed by string data in one block, see struct mof_qualifier */
+    qualifier->type = MOF_QUALIFIER_STRING_ARRAY;
+    qualifier->value.strings.count = count;
+    qualifier->value.strings.values = mem_malloc(count*sizeof(char *) + size);
+    if (!qualifier->value.strings.values) error("malloc failed");
+    data = (char *)(qualifier->value.strings.values + count);
+    for (i = 0; i < count; ++i) {
+      qualifier->value.strings.values[i] = data;
+      data = stpcpy(data, strings[i]) + 1;
+      mem_free(strings[i]);
+    }
+    mem_free(strings);
+  }
+  if (lex_is(lex, ':')) {
+    lex_next(lex);
+    do {
+      if (lex_keyword(lex, "ToInstance"))
+        qualifier->toinstance = 1;
+      else if (lex_keyword(lex, "ToSubclass"))
+        qualifier->tosubclass = 1;
+      else if (lex_keyword(lex, "DisableOverride"))
+        qualifier->disableoverride = 1;
+      else if (lex_keyword(lex, "Amended"))
+        qualifier->amended = 1;
+      else
+        syntax_error(lex, "Unknown flavor of qualifier %s", qualifier->name);
+      lex_next(lex);
+    } while (lex->token == MOF_TOKEN_IDENT);
+  }
+}
+
+static struct mof_qualifier *compile_qualifiers(struct mof_lexer *lex, uint32_t *count) {
+  struct mof_qualifier *qualifiers = NULL;
+  *count = 0;
+  if (!lex_is(lex, '['))
+    return NULL;
+  lex_next(lex);
+  for (;;) {
+    compile_qualifier(lex, array_push(qualifiers, *count));
+    if (!lex_is(lex, ','))
+      break;
+    lex_next(lex);
+  }
+  lex_expect(lex, ']');
+  return qualifiers;
+}
+
+/* Type name of property, parameter or return value, returns 0 for void */
+static int compile_type(struct mof_lexer *lex, struct mof_variable *variable) {
+  unsigned i;
+  if (lex_keyword(lex, "void")) {
+    lex_next(lex);
+    return 0;
+  }
+  for (i = 1; mof_basic_type_valid(i); ++i) {
+    if (lex_keyword(lex, mof_basic_types[i].mof_name)) {
+      variable->variable_type = MOF_VARIABLE_BASIC;
+      variable->type.basic = i;
+      lex_next(lex);
+      return 1;
+    }
+  }
+  variable->variable_type = MOF_VARIABLE_OBJECT;
+  variable->type.object = lex_name(lex);
+  return 1;
+}
+
+/* Optional [] or [max] after name */
+static void compile_array(struct mof_lexer *lex, struct mof_variable *variable) {
+  char buf[32];
+  char *end;
+  long value;
+  if (!lex_is(lex, '['))
+    return;
+  lex_next(lex);
+  if (!lex_is(lex, ']')) {
+    lex_number(lex, buf, sizeof(buf));
+    errno = 0;
+    value = strtol(buf, &end, 10);
+    if (errno || *end || value < INT32_MIN || value > INT32_MAX)
+      syntax_error(lex, "Invalid array size");
+    variable->array_max = value;
+    variable->has_array_max = 1;
+    lex_next(lex);
+  }
+  lex_expect(lex, ']');
+  variable->variable_type = (variable->variable_type == MOF_VARIABLE_OBJECT) ? MOF_VARIABLE_OBJECT_ARRAY : MOF_VARIABLE_BASIC_ARRAY;
+}
+
+static void compile_value(struct mof_lexer *lex, struct mof_variable *variable, union mof_value *value) {
+  static const struct {
+    int64_t min;
+    uint64_t max;
+  } ranges[] = {
+    [MOF_BASIC_TYPE_SINT8] = { INT8_MIN, INT8_MAX },
+    [MOF_BASIC_TYPE_SINT16] = { INT16_MIN, INT16_MAX },
+    [MOF_BASIC_TYPE_SINT32] = { INT32_MIN, INT32_MAX },
+    [MOF_BASIC_TYPE_SINT64] = { INT64_MIN, INT64_MAX },
+    [MOF_BASIC_TYPE_UINT8] = { 0, UINT8_MAX },
+    [MOF_BASIC_TYPE_UINT16] = { 0, UINT16_MAX },
+    [MOF_BASIC_TYPE_UINT32] = { 0, UINT32_MAX },
+    [MOF_BASIC_TYPE_UINT64] = { 0, UINT64_MAX },
+  };
+  const unsigned char *str;
+  uint16_t units[2];
+  char buf[64];
+  char *end, *tmp;
+  if (variable->variable_type != MOF_VARIABLE_BASIC && variable->variable_type != MOF_VARIABLE_BASIC_ARRAY)
+    syntax_error(lex, "Value of object %s is not supported", variable->name);
+  errno = 0;
+  switch (variable->type.basic) {
+  case MOF_BASIC_TYPE_SINT8:
+  case MOF_BASIC_TYPE_SINT16:
+  case MOF_BASIC_TYPE_SINT32:
+  case MOF_BASIC_TYPE_SINT64:
+    value->sint = strtoll(lex_number(lex, buf, sizeof(buf)), &end, 10);
+    if (errno || *end || value->sint < ranges[variable->type.basic].min || value->sint > (int64_t)ranges[variable->type.basic].max)
+      syntax_error(lex, "Invalid value of %s", variable->name);
+    break;
+  case MOF_BASIC_TYPE_UINT8:
+  case MOF_BASIC_TYPE_UINT16:
+  case MOF_BASIC_TYPE_UINT32:
+  case MOF_BASIC_TYPE_UINT64:
+    value->uint = strtoull(lex_number(lex, buf, sizeof(buf)), &end, 10);
+    if (errno || *end || buf[0] == '-' || value->uint > ranges[variable->type.basic].max)
+      syntax_error(lex, "Invalid value of %s", variable->name);
+    break;
+  case MOF_BASIC_TYPE_REAL32:
+  case MOF_BASIC_TYPE_REAL64:
+    /* overflow to infinity is fine, value was written as inf */
+    value->real = strtod(lex_number(lex, buf, sizeof(buf)), &end);
+    if (*end || end == buf)
+      syntax_error(lex, "Invalid value of %s", variable->name);
+    break;
+  case MOF_BASIC_TYPE_BOOLEAN:
+    if (!lex_keyword(lex, "TRUE") && !lex_keyword(lex, "FALSE"))
+      syntax_error(lex, "Invalid value of %s", variable->name);
+    value->uint = lex_keyword(lex, "TRUE");
+    break;
+  case MOF_BASIC_TYPE_CHAR16:
+    if (lex->token != MOF_TOKEN_CHAR)
+      syntax_error(lex, "Invalid value of %s", variable->name);
+    tmp = lex_string(lex);
+    str = (const unsigned char *)tmp;
+    value->uint = 0;
+    if (*str && (utf8_decode(&str, units) != 1 || *str))
+      syntax_error(lex, "Invalid value of %s", variable->name);
+    if (*tmp)
+      value->uint = units[0];
+    mem_free(tmp);
+    return;
+  case MOF_BASIC_TYPE_STRING:
+  case MOF_BASIC_TYPE_DATETIME:
+    if (lex->token != MOF_TOKEN_STRING)
+      syntax_error(lex, "Invalid value of %s", variable->name);
+    value->string = lex_string(lex);
+    return;
+  default:
+    syntax_error(lex, "Invalid value of %s", variable->name);
+  }
+  lex_next(lex);
+}
+
+static void compile_values(struct mof_lexer *lex, struct mof_variable *variable) {
+  variable->has_value = 1;
+  if (variable->variable_type != MOF_VARIABLE_BASIC_ARRAY && variable->variable_type != MOF_VARIABLE_OBJECT_ARRAY) {
+    compile_value(lex, variable, array_push(variable->values, variable->values_count));
+    return;
+  }
+  lex_expect(lex, '{');
+  while (!lex_is(lex, '}')) {
+    if (variable->values_count)
+      lex_expect(lex, ',');
+    compile_value(lex, variable, array_push(variable->values, variable->values_count));
+  }
+  lex_next(lex);
+}
+
+/* Type of instance property from its value when class is not known */
+static void guess_type(struct mof_lexer *lex, struct mof_variable *variable) {
+  struct mof_lexer next = *lex;
+  int array = lex_is(lex, '{');
+  if (array)
+    lex_next(&next);
+  variable->variable_type = array ? MOF_VARIABLE_BASIC_ARRAY : MOF_VARIABLE_BASIC;
+  if (next.token == MOF_TOKEN_STRING || (array && lex_is(&next, '}')))
+    variable->type.basic = MOF_BASIC_TYPE_STRING;
+  else if (next.token == MOF_TOKEN_CHAR)
+    variable->type.basic = MOF_BASIC_TYPE_CHAR16;
+  else if (lex_keyword(&next, "TRUE") || lex_keyword(&next, "FALSE"))
+    variable->type.basic = MOF_BASIC_TYPE_BOOLEAN;
+  else if (next.token == MOF_TOKEN_IDENT || (next.token == MOF_TOKEN_NUMBER && strcspn(next.text, ".eEiInN") < next.len))
+    variable->type.basic = MOF_BASIC_TYPE_REAL64;
+  else if (next.token == MOF_TOKEN_NUMBER)
+    variable->type.basic = (next.text[0] == '-') ? MOF_BASIC_TYPE_SINT64 : MOF_BASIC_TYPE_UINT64;
+  else
+    syntax_error(lex, "Invalid value of %s", variable->name);
+}
+
+/* Declaration of property in class or its superclasses, newest class of name wins */
+static struct mof_variable *find_property(struct mof_classes *classes, const char *class_name, const char *name) {
+  static uint32_t last;
+  uint32_t depth, i, j;
+  for (depth = 0; class_name && depth < classes->count; ++depth) {
+    if (last >= classes->count || strcmp(classes->classes[last].name, class_name) != 0) {
+      for (i = classes->count; i > 0 && strcmp(classes->classes[i-1].name, class_name) != 0; --i);
+      if (i == 0)
+        return NULL;
+      last = i-1;
+    }
+    for (j = 0; j < classes->classes[last].variables_count; ++j) {
+      if (strcmp(classes->classes[last].variables[j].name, name) == 0)
+        return &classes->classes[last].variables[j];
+    }
+    class_name = classes->classes[last].superclassname;
+  }
+  return NULL;
+}
+
+static void compile_method(struct mof_lexer *lex, struct mof_method *method, struct mof_variable *return_value) {
+  struct mof_variable *parameter;
+  struct mof_qualifier *qualifiers;
+  enum mof_parameter_direction *direction;
+  uint32_t count, index, i;
+  if (return_value->variable_type) {
+    method->return_value = *return_value;
+    method->return_value.name = mem_strdup("ReturnValue");
+    if (!method->return_value.name) error("strdup failed");
+  }
+  lex_expect(lex, '(');
+  while (!lex_is(lex, ')')) {
+    if (method->parameters_count)
+      lex_expect(lex, ',');
+    qualifiers = compile_qualifiers(lex, &count);
+    index = method->parameters_count;
+    direction = array_push(method->parameters_direction, index);
+    parameter = array_push(method->parameters, method->parameters_count);
+    /* in and out are stored as direction, they are added back by write_variable() */
+    for (i = 0; i < count; ++i) {
+      if (qualifiers[i].type == MOF_QUALIFIER_BOOLEAN && qualifiers[i].value.boolean && mof_name_lookup(qualifiers[i].name) == MOF_NAME_IN)
+        *direction |= MOF_PARAMETER_IN;
+      else if (qualifiers[i].type == MOF_QUALIFIER_BOOLEAN && qualifiers[i].value.boolean && mof_name_lookup(qualifiers[i].name) == MOF_NAME_OUT)
+        *direction |= MOF_PARAMETER_OUT;
+      else {
+        *array_push(parameter->qualifiers, parameter->qualifiers_count) = qualifiers[i];
+        continue;
+      }
+      free_qualifier(&qualifiers[i]);
+    }
+    mem_free(qualifiers);
+    if (!compile_type(lex, parameter))
+      syntax_error(lex, "Parameter cannot be void");
+    parameter->name = lex_name(lex);
+    if (!*direction)
+      syntax_error(lex, "Parameter %s is not in nor out", parameter->name);
+    compile_array(lex, parameter);
+  }
+  lex_next(lex);
+  lex_expect(lex, ';');
+}
+
+static void compile_class(struct mof_lexer *lex, struct mof_class *class) {
+  struct mof_variable variable;
+  struct mof_method *method;
+  struct mof_qualifier *qualifiers;
+  uint32_t count;
+  char *name;
+  int type;
+  class->name = lex_name(lex);
+  if (lex_is(lex, ':')) {
+    lex_next(lex);
+    class->superclassname = lex_name(lex);
+  }
+  lex_expect(lex, '{');
+  while (!lex_is(lex, '}')) {
+    memset(&variable, 0, sizeof(variable));
+    qualifiers = compile_qualifiers(lex, &count);
+    type = compile_type(lex, &variable);
+    name = lex_name(lex);
+    if (lex_is(lex, '(')) {
+      method = array_push(class->methods, class->methods_count);
+      method->name = name;
+      method->qualifiers = qualifiers;
+      method->qualifiers_count = count;
+      compile_method(lex, method, &variable);
+      continue;
+    }
+    if (!type)
+      syntax_error(lex, "Property %s cannot be void", name);
+    variable.name = name;
+    variable.qualifiers = qualifiers;
+    variable.qualifiers_count = count;
+    compile_array(lex, &variable);
+    if (lex_is(lex, '=')) {
+      lex_next(lex);
+      compile_values(lex, &variable);
+    }
+    lex_expect(lex, ';');
+    *array_push(class->variables, class->variables_count) = variable;
+  }
+  lex_next(lex);
+  lex_expect(lex, ';');
+}
+
+static void compile_instance(struct mof_lexer *lex, struct mof_class *instance, struct mof_classes *classes) {
+  struct mof_variable *variable, *declared;
+  lex_expect_keyword(lex, "of");
+  instance->name = lex_name(lex);
+  lex_expect(lex, '{');
+  while (!lex_is(lex, '}')) {
+    variable = array_push(instance->variables, instance->variables_count);
+    variable->qualifiers = compile_qualifiers(lex, &variable->qualifiers_count);
+    variable->name = lex_name(lex);
+    lex_expect(lex, '=');
+    declared = find_property(classes, instance->name, variable->name);
+    if (declared) {
+      variable->variable_type = declared->variable_type;
+      variable->type = declared->type;
+      if (variable->variable_type == MOF_VARIABLE_OBJECT || variable->variable_type == MOF_VARIABLE_OBJECT_ARRAY) {
+        variable->type.object = mem_strdup(declared->type.object);
+        if (!variable->type.object) error("strdup failed");
+      }
+    } else {
+      guess_type(lex, variable);
+    }
+    compile_values(lex, variable);
+    lex_expect(lex, ';');
+  }
+  lex_next(lex);
+  lex_expect(lex, ';');
+}
+
+static void compile_pragma(struct mof_lexer *lex, char **namespace, int32_t *classflags) {
+  static const struct {
+    const char *name;
+    int32_t value;
+  } flags[] = {
+    { "updateonly", 1 }, { "createonly", 2 }, { "safeupdate", 32 }, { "forceupdate", 64 },
+  };
+  char buf[32];
+  char *end, *str;
+  unsigned i;
+  long value;
+  lex_expect(lex, '#');
+  lex_expect_keyword(lex, "pragma");
+  if (lex_keyword(lex, "namespace")) {
+    lex_next(lex);
+    lex_expect(lex, '(');
+    mem_free(*namespace);
+    *namespace = lex_string(lex);
+    lex_expect(lex, ')');
+  } else if (lex_keyword(lex, "classflags")) {
+    lex_next(lex);
+    lex_expect(lex, '(');
+    *classflags = 0;
+    for (;;) {
+      if (lex->token == MOF_TOKEN_STRING) {
+        str = lex_string(lex);
+        for (i = 0; i < sizeof(flags)/sizeof(flags[0]) && strcasecmp(str, flags[i].name) != 0; ++i);
+        if (i == sizeof(flags)/sizeof(flags[0]))
+          syntax_error(lex, "Unknown class flag %s", str);
+        *classflags |= flags[i].value;
+        mem_free(str);
+      } else {
+        lex_number(lex, buf, sizeof(buf));
+        errno = 0;
+        value = strtol(buf, &end, 10);
+        if (errno || *end || value < INT32_MIN || value > INT32_MAX)
+          syntax_error(lex, "Invalid class flags");
+        *classflags |= value;
+        lex_next(lex);
+      }
+      if (!lex_is(lex, ','))
+        break;
+      lex_next(lex);
+    }
+    lex_expect(lex, ')');
+  } else {
+    syntax_error(lex, "Unknown pragma");
+  }
+}
+
+static void compile_mof(struct mof_lexer *lex, struct mof_classes *classes, struct mof_classes *instances) {
+  struct mof_qualifier *qualifiers;
+  struct mof_class *record;
+  char *namespace = NULL;
+  int32_t classflags = 0;
+  uint32_t count;
+  lex_next(lex);
+  while (lex->token != MOF_TOKEN_END) {
+    if (lex_is(lex, '#')) {
+      compile_pragma(lex, &namespace, &classflags);
+      continue;
+    }
+    qualifiers = compile_qualifiers(lex, &count);
+    if (lex_keyword(lex, "class")) {
+      lex_next(lex);
+      record = array_push(classes->classes, classes->count);
+      compile_class(lex, record);
+    } else if (lex_keyword(lex, "instance")) {
+      lex_next(lex);
+      record = array_push(instances->classes, instances->count);
+      compile_instance(lex, record, classes);
+    } else {
+      syntax_error(lex, "Expected class or instance");
+    }
+    record->qualifiers = qualifiers;
+    record->qualifiers_count = count;
+    record->namespace = namespace;
+    record->classflags = classflags;
+    namespace = NULL;
+    classflags = 0;
+  }
+  mem_free(namespace);
+}
+
+/* BMF data with second part (offsets and flavors of qualifiers) */
+struct bmf_writer {
+  char *data;
+  uint32_t size;
+  uint32_t alloc;
+  uint32_t *flavors;
+  uint32_t flavors_count;
+};
+
+/* Append size bytes, returns their offset */
+static uint32_t writer_reserve(struct bmf_writer *writer, uint32_t size) {
+  uint32_t offset = writer->size;
+  uint32_t alloc = writer->alloc ? writer->alloc : 0x10000;
+  if (size > MOF2BMF_MAX_SIZE - writer->size) error("BMF data too large");
+  if (writer->size + size > writer->alloc) {
+    while (alloc < writer->size + size)
+      alloc *= 2;
+    writer->data = mem_realloc(writer->data, alloc);
+    if (!writer->data) error("realloc failed");
+    writer->alloc = alloc;
+  }
+  writer->size += size;
+  return offset;
+}
+
+static uint32_t writer_bytes(struct bmf_writer *writer, const void *data, uint32_t size) {
+  uint32_t offset = writer_reserve(writer, size);
+  memcpy(writer->data + offset, data, size);
+  return offset;
+}
+
+static uint32_t writer_u32(struct bmf_writer *writer, uint32_t value) {
+  return writer_bytes(writer, &value, sizeof(value));
+}
+
+static void writer_set(struct bmf_writer *writer, uint32_t offset, uint32_t value) {
+  memcpy(writer->data + offset, &value, sizeof(value));
+}
+
+/* NUL terminated UTF-16 string, returns its size */
+static uint32_t writer_string(struct bmf_writer *writer, const char *str) {
+  const unsigned char *s = (const unsigned char *)str;
+  uint32_t offset = writer->size;
+  uint16_t units[2];
+  int count;
+  while (*s) {
+    count = utf8_decode(&s, units);
+    if (!count) error("Invalid UTF-8 string");
+    writer_bytes(writer, units, count * sizeof(units[0]));
+  }
+  writer_bytes(writer, "\0", 2);
+  return writer->size - offset;
+}
+
+/* Start of section with total size and count of records, size is set by writer_end() */
+static uint32_t writer_section(struct bmf_writer *writer, uint32_t count) {
+  uint32_t offset = writer_u32(writer, 0);
+  writer_u32(writer, count);
+  return offset;
+}
+
+static void writer_end(struct bmf_writer *writer, uint32_t offset) {
+  writer_set(writer, offset, writer->size - offset);
+}
+
+static void write_qualifier(struct bmf_writer *writer, struct mof_qualifier *qualifier) {
+  uint32_t start = writer_u32(writer, 0);
+  uint32_t flavors = 0;
+  uint32_t offset, i;
+  switch (qualifier->type) {
+  case MOF_QUALIFIER_BOOLEAN: writer_u32(writer, 0x0B); break;
+  case MOF_QUALIFIER_SINT32: writer_u32(writer, 0x03); break;
+  case MOF_QUALIFIER_STRING: writer_u32(writer, 0x08); break;
+  case MOF_QUALIFIER_STRING_ARRAY: writer_u32(writer, 0x2008); break;
+  default: error("Unknown qualifier type");
+  }
+  writer_u32(writer, 0);
+  offset = writer_u32(writer, 0);
+  writer_set(writer, offset, writer_string(writer, qualifier->name));
+  switch (qualifier->type) {
+  case MOF_QUALIFIER_BOOLEAN:
+    writer_u32(writer, qualifier->value.boolean ? 0xFFFF : 0);
+    break;
+  case MOF_QUALIFIER_SINT32:
+    writer_u32(writer, qualifier->value.sint32);
+    break;
+  case MOF_QUALIFIER_STRING:
+    writer_string(writer, qualifier->value.string);
+    break;
+  default:
+    offset = writer_section(writer, qualifier->value.strings.count);
+    for (i = 0; i < qualifier->value.strings.count; ++i)
+      writer_string(writer, qualifier->value.strings.values[i]);
+    writer_end(writer, offset);
+    break;
+  }
+  writer_end(writer, start);
+  if (qualifier->toinstance)
+    flavors |= 1U << 0;
+  if (qualifier->tosubclass)
+    flavors |= 1U << 1;
+  if (qualifier->disableoverride)
+    flavors |= 1U << 4;
+  if (qualifier->amended)
+    flavors |= 1U << 7;
+  if (flavors) {
+    writer->flavors = array_grow(writer->flavors, writer->flavors_count, 2*sizeof(*writer->flavors));
+    writer->flavors[2*writer->flavors_count] = start;
+    writer->flavors[2*writer->flavors_count+1] = flavors;
+    writer->flavors_count++;
+  }
+}
+
+static void write_value(struct bmf_writer *writer, struct mof_variable *variable, union mof_value *value) {
+  uint8_t u8 = value->uint;
+  uint16_t u16 = value->uint;
+  uint32_t u32 = value->uint;
+  float real32 = value->real;
+  switch (variable->type.basic) {
+  case MOF_BASIC_TYPE_SINT8:
+  case MOF_BASIC_TYPE_UINT8:
+    writer_bytes(writer, &u8, sizeof(u8));
+    break;
+  case MOF_BASIC_TYPE_BOOLEAN:
+    u16 = value->uint ? 0xFFFF : 0;
+    /* fall through */
+  case MOF_BASIC_TYPE_SINT16:
+  case MOF_BASIC_TYPE_UINT16:
+  case MOF_BASIC_TYPE_CHAR16:
+    writer_bytes(writer, &u16, sizeof(u16));
+    break;
+  case MOF_BASIC_TYPE_SINT32:
+  case MOF_BASIC_TYPE_UINT32:
+    writer_bytes(writer, &u32, sizeof(u32));
+    break;
+  case MOF_BASIC_TYPE_SINT64:
+  case MOF_BASIC_TYPE_UINT64:
+    writer_bytes(writer, &value->uint, sizeof(value->uint));
+    break;
+  case MOF_BASIC_TYPE_REAL32:
+    writer_bytes(writer, &real32, sizeof(real32));
+    break;
+  case MOF_BASIC_TYPE_REAL64:
+    writer_bytes(writer, &value->real, sizeof(value->real));
+    break;
+  default:
+    writer_string(writer, value->string);
+    break;
+  }
+}
+
+/*
+ * Property or parameter. Parameter (direction is set) has in or out and ID
+ * qualifiers, return value has out without ID (id is -1). Array size and
+ * type are in MAX and CIMTYPE qualifiers.
+ */
+static void write_variable(struct bmf_writer *writer, struct mof_variable *variable, enum mof_parameter_direction direction, int32_t id) {
+  static const uint32_t types[] = {
+    [MOF_BASIC_TYPE_STRING] = 0x08, [MOF_BASIC_TYPE_REAL64] = 0x05, [MOF_BASIC_TYPE_REAL32] = 0x04,
+    [MOF_BASIC_TYPE_SINT32] = 0x03, [MOF_BASIC_TYPE_UINT32] = 0x13, [MOF_BASIC_TYPE_SINT16] = 0x02,
+    [MOF_BASIC_TYPE_UINT16] = 0x12, [MOF_BASIC_TYPE_SINT64] = 0x14, [MOF_BASIC_TYPE_UINT64] = 0x15,
+    [MOF_BASIC_TYPE_SINT8] = 0x10, [MOF_BASIC_TYPE_UINT8] = 0x11, [MOF_BASIC_TYPE_DATETIME] = 0x65,
+    [MOF_BASIC_TYPE_CHAR16] = 0x67, [MOF_BASIC_TYPE_BOOLEAN] = 0x0B,
+  };
+  struct mof_qualifier qualifier;
+  int object = (variable->variable_type == MOF_VARIABLE_OBJECT || variable->variable_type == MOF_VARIABLE_OBJECT_ARRAY);
+  int array = (variable->variable_type == MOF_VARIABLE_BASIC_ARRAY || variable->variable_type == MOF_VARIABLE_OBJECT_ARRAY);
+  uint32_t start, name, size, offset, i;
+  char *cimtype;
+  if (!object && (!mof_basic_type_valid(variable->type.basic) || !types[variable->type.basic])) error("Unknown variable type");
+  start = writer_u32(writer, 0);
+  writer_u32(writer, (object ? 0x0D : types[variable->type.basic]) | (array ? 0x2000 : 0));
+  writer_u32(writer, 0);
+  offset = writer_u32(writer, 0xFFFFFFFF);
+  writer_u32(writer, 0);
+  name = writer->size;
+  size = writer_string(writer, variable->name);
+  if (variable->has_value) {
+    writer_set(writer, offset, size);
+    if (array) {
+      size = writer_section(writer, variable->values_count);
+      for (i = 0; i < variable->values_count; ++i)
+        write_value(writer, variable, &variable->values[i]);
+      writer_end(writer, size);
+    } else {
+      write_value(writer, variable, &variable->values[0]);
+    }
+  }
+  writer_set(writer, offset+4, writer->size - name);
+  offset = writer_section(writer, variable->qualifiers_count + (direction ? 1 : 0) + (id >= 0) + (array && variable->has_array_max) + 1);
+  memset(&qualifier, 0, sizeof(qualifier));
+  if (direction) {
+    qualifier.type = MOF_QUALIFIER_BOOLEAN;
+    qualifier.name = (direction == MOF_PARAMETER_IN) ? "in" : "out";
+    qualifier.value.boolean = 1;
+    write_qualifier(writer, &qualifier);
+  }
+  if (id >= 0) {
+    qualifier.type = MOF_QUALIFIER_SINT32;
+    qualifier.name = "ID";
+    qualifier.value.sint32 = id;
+    write_qualifier(writer, &qualifier);
+  }
+  for (i = 0; i < variable->qualifiers_count; ++i)
+    write_qualifier(writer, &variable->qualifiers[i]);
+  if (array && variable->has_array_max) {
+    qualifier.type = MOF_QUALIFIER_SINT32;
+    qualifier.name = "MAX";
+    qualifier.value.sint32 = variable->array_max;
+    write_qualifier(writer, &qualifier);
+  }
+  if (object) {
+    cimtype = mem_malloc(strlen("object:") + strlen(variable->type.object) + 1);
+    if (!cimtype) error("malloc failed");
+    strcat(strcpy(cimtype, "object:"), variable->type.object);
+  } else {
+    cimtype = mem_strdup(mof_basic_types[variable->type.basic].name);
+    if (!cimtype) error("strdup failed");
+  }
+  qualifier.type = MOF_QUALIFIER_STRING;
+  qualifier.name = "CIMTYPE";
+  qualifier.value.string = cimtype;
+  write_qualifier(writer, &qualifier);
+  mem_free(cimtype);
+  writer_end(writer, offset);
+  writer_end(writer, start);
+}
+
+/* Class property, value is string or sint32 when string is NULL */
+static void write_property(struct bmf_writer *writer, const char *name, const char *string, int32_t sint32) {
+  uint32_t start = writer_u32(writer, 0);
+  uint32_t offset;
+  writer_u32(writer, string ? 0x08 : 0x03);
+  writer_u32(writer, 0);
+  offset = writer_u32(writer, 0);
+  writer_u32(writer, 0xFFFFFFFF);
+  writer_set(writer, offset, writer_string(writer, name));
+  if (string)
+    writer_string(writer, string);
+  else
+    writer_u32(writer, sint32);
+  writer_end(writer, start);
+}
+
+/* Parameters are in two __PARAMETERS objects, first with input and second with output ones */
+static void write_parameters(struct bmf_writer *writer, struct mof_method *method, int in, int out) {
+  enum mof_parameter_direction group;
+  uint32_t start, record, offset, count, i;
+  start = writer_u32(writer, 0);
+  writer_u32(writer, 1);
+  writer_u32(writer, in + out);
+  writer_u32(writer, 0);
+  for (group = MOF_PARAMETER_IN; group <= MOF_PARAMETER_OUT; ++group) {
+    if ((group == MOF_PARAMETER_IN && !in) || (group == MOF_PARAMETER_OUT && !out))
+      continue;
+    record = writer_u32(writer, 0);
+    writer_u32(writer, 0xFFFFFFFF);
+    writer_u32(writer, 0);
+    offset = writer_u32(writer, 0);
+    writer_u32(writer, 1);
+    count = (group == MOF_PARAMETER_OUT && method->return_value.variable_type) ? 2 : 1;
+    for (i = 0; i < method->parameters_count; ++i)
+      count += (method->parameters_direction[i] & group) ? 1 : 0;
+    count = writer_section(writer, count);
+    for (i = 0; i < method->parameters_count; ++i) {
+      if (method->parameters_direction[i] & group)
+        write_variable(writer, &method->parameters[i], group, i);
+    }
+    if (group == MOF_PARAMETER_OUT && method->return_value.variable_type)
+      write_variable(writer, &method->return_value, group, -1);
+    write_property(writer, "__CLASS", "__PARAMETERS", 0);
+    writer_end(writer, count);
+    writer_set(writer, offset, writer->size - count);
+    writer_end(writer, record);
+  }
+  writer_end(writer, start);
+  writer_set(writer, start+12, writer->size - start - 12);
+}
+
+static void write_method(struct bmf_writer *writer, struct mof_method *method) {
+  int in = 0, out = method->return_value.variable_type ? 1 : 0;
+  uint32_t start, type, name, size, i;
+  for (i = 0; i < method->parameters_count; ++i) {
+    if (method->parameters_direction[i] & MOF_PARAMETER_IN)
+      in = 1;
+    if (method->parameters_direction[i] & MOF_PARAMETER_OUT)
+      out = 1;
+  }
+  start = writer_u32(writer, 0);
+  type = writer_u32(writer, 0);
+  writer_u32(writer, 0);
+  writer_u32(writer, 0xFFFFFFFF);
+  writer_u32(writer, 0);
+  name = writer->size;
+  size = writer_string(writer, method->name);
+  if (in || out) {
+    writer_set(writer, type, 0x200D);
+    writer_set(writer, type+8, size);
+    write_parameters(writer, method, in, out);
+  }
+  writer_set(writer, type+12, writer->size - name);
+  size = writer_section(writer, method->qualifiers_count);
+  for (i = 0; i < method->qualifiers_count; ++i)
+    write_qualifier(writer, &method->qualifiers[i]);
+  writer_end(writer, size);
+  writer_end(writer, start);
+}
+
+static void write_class(struct bmf_writer *writer, struct mof_class *class, int instance) {
+  uint32_t start, header, data, offset, i;
+  start = writer_u32(writer, 0);
+  writer_u32(writer, 0);
+  header = writer_u32(writer, 0);
+  writer_u32(writer, 0);
+  writer_u32(writer, instance ? 1 : 0);
+  data = writer->size;
+  offset = writer_section(writer, class->qualifiers_count);
+  for (i = 0; i < class->qualifiers_count; ++i)
+    write_qualifier(writer, &class->qualifiers[i]);
+  writer_end(writer, offset);
+  writer_set(writer, header, writer->size - data);
+  offset = writer_section(writer, class->variables_count + (class->superclassname ? 2 : 1));
+  for (i = 0; i < class->variables_count; ++i)
+    write_variable(writer, &class->variables[i], MOF_PARAMETER_UNKNOWN, -1);
+  write_property(writer, "__CLASS", class->name, 0);
+  if (class->superclassname)
+    write_property(writer, "__SUPERCLASS", class->superclassname, 0);
+  writer_end(writer, offset);
+  if (class->namespace)
+    write_property(writer, "__NAMESPACE", class->namespace, 0);
+  if (class->classflags)
+    write_property(writer, "__CLASSFLAGS", NULL, class->classflags);
+  writer_set(writer, header+4, writer->size - data);
+  if (!instance) {
+    offset = writer_section(writer, class->methods_count);
+    for (i = 0; i < class->methods_count; ++i)
+      write_method(writer, &class->methods[i]);
+    writer_end(writer, offset);
+  }
+  writer_end(writer, start);
+}
+
+static void write_bmf(struct bmf_writer *writer, struct mof_classes *classes, struct mof_classes *instances) {
+  uint32_t offset, i;
+  writer_u32(writer, 0x424D4F46);
+  offset = writer_u32(writer, 0);
+  writer_u32(writer, 1);
+  writer_u32(writer, 1);
+  writer_u32(writer, classes->count + instances->count);
+  for (i = 0; i < classes->count; ++i)
+    write_class(writer, &classes->classes[i], 0);
+  for (i = 0; i < instances->count; ++i)
+    write_class(writer, &instances->classes[i], 1);
+  writer_set(writer, offset, writer->size);
+  if (!writer->flavors_count)
+    return;
+  writer_bytes(writer, "BMOFQUALFLAVOR11", 16);
+  writer_u32(writer, writer->flavors_count);
+  writer_bytes(writer, writer->flavors, writer->flavors_count * 2*sizeof(*writer->flavors));
+}
+
+/*
+ * DS-01 compression for ds_dec(), greedy LZ77 with hash chains. Output
+ * is split into 512 byte blocks by sync tokens (which ds_dec_parallel()
+ * looks for) and matches do not cross block boundary.
+ */
+
+#define DS_ENC_BLOCK 512
+#define DS_ENC_MAX_OFFSET 0x113E /* 0x113F is sync token */
+#define DS_ENC_WINDOW 0x2000
+#define DS_ENC_HASH_SIZE 0x4000
+#define DS_ENC_CHAIN_DEPTH 32
+
+struct ds_writer {
+  __u8 *out;
+  size_t len;
+  __u32 bits;
+  int count;
+};
+
+static void ds_put(struct ds_writer *writer, unsigned value, int n) {
+  writer->bits |= (__u32)value << writer->count;
+  writer->count += n;
+  while (writer->count >= 16) {
+    writer->out[writer->len++] = writer->bits & 0xFF;
+    writer->out[writer->len++] = (writer->bits >> 8) & 0xFF;
+    writer->bits >>= 16;
+    writer->count -= 16;
+  }
+}
+
+/* Length of match as read by dblb_rdlen() */
+static void ds_put_length(struct ds_writer *writer, unsigned length) {
+  unsigned value = length + 1;
+  unsigned bits;
+  if (value == 3) {
+    ds_put(writer, 1, 1);
+    return;
+  }
+  for (bits = 1; value > (2U << bits) + 1; ++bits);
+  ds_put(writer, 1U << bits, bits+1);
+  ds_put(writer, value - (1U << bits) - 2, bits);
+}
+
+static void ds_put_sync(struct ds_writer *writer) {
+  ds_put(writer, 7, 3);
+  ds_put(writer, 0xFFF, 12);
+}
+
+#define ds_hash(p) ((((unsigned)(p)[0] << 8 ^ (unsigned)(p)[1] << 4 ^ (p)[2]) * 2654435761U >> 18) & (DS_ENC_HASH_SIZE-1))
+
+/* Returns size of compressed data written to out, which needs ds_enc_bound(lin) bytes */
+#define ds_enc_bound(lin) ((size_t)(lin)/8*9 + (size_t)(lin)/DS_ENC_BLOCK*2 + 32)
+
+static size_t ds_enc(const __u8 *pin, size_t lin, __u8 *out) {
+  struct ds_writer writer = { out, 0, 0, 0 };
+  size_t *head, *chain;
+  size_t pos = 0, best_len, best_off, len, max, cand;
+  unsigned depth;
+  head = malloc(DS_ENC_HASH_SIZE * sizeof(*head));
+  chain = malloc(DS_ENC_WINDOW * sizeof(*chain));
+  if (!head || !chain) error("malloc failed");
+  /* positions are stored plus one, zero is empty */
+  memset(head, 0, DS_ENC_HASH_SIZE * sizeof(*head));
+  ds_put(&writer, 0x5344, 16);
+  ds_put(&writer, 0x0100, 16);
+  while (pos < lin) {
+    if (pos && pos % DS_ENC_BLOCK == 0)
+      ds_put_sync(&writer);
+    best_len = best_off = 0;
+    max = DS_ENC_BLOCK - pos % DS_ENC_BLOCK;
+    if (max > lin - pos)
+      max = lin - pos;
+    if (max >= 3) {
+      for (cand = head[ds_hash(pin+pos)], depth = 0; cand && pos - (cand-1) <= DS_ENC_MAX_OFFSET && depth < DS_ENC_CHAIN_DEPTH; cand = chain[(cand-1) % DS_ENC_WINDOW], ++depth) {
+        for (len = 0; len < max && pin[cand-1+len] == pin[pos+len]; ++len);
+        if (len > best_len) {
+          best_len = len;
+          best_off = pos - (cand-1);
+          if (len == max)
+            break;
+        }
+      }
+    }
+    if (best_len < 3)
+      best_len = 1;
+    for (len = 0; len < best_len; ++len) {
+      if (lin - (pos+len) >= 3) {
+        chain[(pos+len) % DS_ENC_WINDOW] = head[ds_hash(pin+pos+len)];
+        head[ds_hash(pin+pos+len)] = pos+len+1;
+      }
+    }
+    if (best_len == 1) {
+      if (pin[pos] & 0x80) {
+        ds_put(&writer, 1, 2);
+        ds_put(&writer, pin[pos] & 0x7F, 7);
+      } else {
+        ds_put(&writer, 2, 2);
+        ds_put(&writer, pin[pos], 7);
+      }
+    } else {
+      if (best_off < 64) {
+        ds_put(&writer, 0, 2);
+        ds_put(&writer, best_off, 6);
+      } else if (best_off < 320) {
+        ds_put(&writer, 3, 3);
+        ds_put(&writer, best_off - 64, 8);
+      } else {
+        ds_put(&writer, 7, 3);
+        ds_put(&writer, best_off - 320, 12);
+      }
+      ds_put_length(&writer, best_len);
+    }
+    pos += best_len;
+  }
+  ds_put_sync(&writer);
+  if (writer.count)
+    ds_put(&writer, 0, 16 - writer.count);
+  free(head);
+  free(chain);
+  return writer.len;
+}
+
+/* BMF file with header described in bmfdec.c, returns buffer allocated by mem_malloc() */
+static char *compress_data(char *data, uint32_t size, size_t *lout) {
+  uint32_t *out = mem_malloc(16 + ds_enc_bound(size));
+  size_t len;
+  if (!out) error("malloc failed");
+  len = ds_enc((__u8 *)data, size, (__u8 *)(out+4));
+  out[0] = 0x424D4F46;
+  out[1] = 1;
+  out[2] = len;
+  out[3] = size;
+  *lout = 16 + len;
+  return (char *)out;
+}
+
+int main(int argc, char *argv[]) {
+  struct mof_classes classes = { 0, NULL };
+  struct mof_classes instances = { 0, NULL };
+  struct bmf_writer writer;
+  struct mof_lexer lex;
+  enum read_status status;
+  uint32_t *text = NULL;
+  size_t size = 0;
+  size_t len;
+  char *input;
+  char *output;
+  char *out;
+  size_t lout;
+  uint32_t offset;
+  FILE *fout;
+  int raw = 0;
+  int err = 0;
+  int argi;
+  int ret;
+  for (argi = 1; argi < argc && argv[argi][0] == '-' && argv[argi][1]; ++argi) {
+    if (strcmp(argv[argi], "--raw") == 0) {
+      raw = 1;
+    } else if (strcmp(argv[argi], "--") == 0) {
+      ++argi;
+      break;
+    } else {
+      argc = 0;
+      break;
+    }
+  }
+  if (argc == 0 || argc-argi > 2) {
+    fprintf(stderr, "Usage: %s [options] [input_file [output_file]]\n", argv[0]);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --raw                 write decompressed data\n");
+    return 1;
+  }
+  input = (argc-argi >= 1) ? argv[argi] : NULL;
+  output = (argc-argi >= 2) ? argv[argi+1] : NULL;
+  if (input) {
+    status = read_file(input, &text, &size, &len, &err);
+    if (status != READ_OK) {
+      read_error(input, status, err);
+      free(text);
+      return 1;
+    }
+  } else {
+    text = read_input(stdin, "(stdin)", &len);
+    if (!text)
+      return 1;
+  }
+  /* buffers have room for NUL after data */
+  ((char *)text)[len] = 0;
+  memset(&lex, 0, sizeof(lex));
+  lex.name = input ? input : "(stdin)";
+  lex.pos = (char *)text;
+  lex.end = (char *)text + len;
+  lex.line = 1;
+  compile_mof(&lex, &classes, &instances);
+  memset(&writer, 0, sizeof(writer));
+  write_bmf(&writer, &classes, &instances);
+  /* written data have to pass same validation as bmfdec --check */
+  if (check_data(writer.data, writer.size, &offset) != 0) {
+    fprintf(stderr, "Written BMF is not valid at offset 0x%x\n", (unsigned int)offset);
+    return 1;
+  }
+  if (raw) {
+    out = writer.data;
+    lout = writer.size;
+  } else {
+    out = compress_data(writer.data, writer.size, &lout);
+  }
+  if (output) {
+    fout = fopen(output, "wb");
+    if (!fout) {
+      fprintf(stderr, "Cannot open output file %s: %s\n", output, strerror(errno));
+      return 1;
+    }
+  } else {
+    fout = stdout;
+  }
+  ret = (fwrite(out, 1, lout, fout) == lout) ? 0 : 1;
+  if (output && fclose(fout) != 0)
+    ret = 1;
+  if (ret)
+    fprintf(stderr, "Cannot write output\n");
+  if (input)
+    free(text);
+  else
+    mem_free(text);
+  free_classes(classes.classes, classes.count);
+  free_classes(instances.classes, instances.count);
+  mem_free_all();
+  return ret;
+}